@@ -0,0 +1,172 @@
+use bytes::BytesMut;
+use std::hint::black_box;
+use std::time::{Duration, Instant};
+
+use fivedcserver::datatype::*;
+
+/* codec microbenchmarks, run with `cargo bench`.
+Every case runs for about BENCH_TIME after a short warm up and prints the mean time per call. */
+
+const WARM_UP_TIME: Duration = Duration::from_millis(100);
+const BENCH_TIME: Duration = Duration::from_millis(500);
+
+fn bench<T>(name: &str, mut f: impl FnMut() -> T) {
+    let warm_up = Instant::now();
+    while warm_up.elapsed() < WARM_UP_TIME {
+        black_box(f());
+    }
+    let mut iterations: u64 = 0;
+    let start = Instant::now();
+    while start.elapsed() < BENCH_TIME {
+        for _ in 0..1000 {
+            black_box(f());
+        }
+        iterations += 1000;
+    }
+    let ns = start.elapsed().as_nanos() as f64 / iterations as f64;
+    println!("{:<40} {:>10.1} ns/iter", name, ns);
+}
+
+fn settings() -> MatchSettings {
+    MatchSettings {
+        color: OptionalColorWithRandom::White,
+        clock: OptionalClock::Medium,
+        variant: Variant::Standard,
+        visibility: Visibility::Public,
+        passcode: 1234567,
+        match_id: 42,
+    }
+}
+
+fn action() -> C2SOrS2CActionBody {
+    C2SOrS2CActionBody {
+        action_type: ActionType::Move,
+        color: Color::White,
+        seconds_passed: 30,
+        src_l: 0,
+        src_t: 1,
+        src_board_color: Color::White,
+        src_y: 1,
+        src_x: 4,
+        dst_l: 0,
+        dst_t: 1,
+        dst_board_color: Color::White,
+        dst_y: 3,
+        dst_x: 4,
+    }
+}
+
+fn match_list(host: bool) -> Message {
+    let history = S2CMatchListServerHistoryMatch {
+        state: HistoryMatchState::InProgress,
+        clock: OptionalClock::Short,
+        variant: Variant::Random,
+        visibility: Visibility::Public,
+        seconds_passed: 600,
+    };
+    let body = S2CMatchListNonhostBody {
+        public_matches: [settings().into(); 13],
+        public_matches_count: 13,
+        server_history_matches: [history; 13],
+        server_history_matches_count: 13,
+    };
+    Message::S2CMatchList(Box::new(if host {
+        S2CMatchListBody::Host(S2CMatchListHostBody {
+            color: OptionalColorWithRandom::Black,
+            clock: OptionalClock::Long,
+            variant: Variant::Small,
+            passcode: 7654321,
+            body,
+        })
+    } else {
+        S2CMatchListBody::Nonhost(body)
+    }))
+}
+
+// C2S frames as sent by the game, without the length field
+fn raw(message_type: MessageType, fields: &[i64]) -> BytesMut {
+    let mut bytes = BytesMut::with_capacity(message_type.legal_length());
+    write_i64_le(&mut bytes, message_type as i64);
+    for field in fields {
+        write_i64_le(&mut bytes, *field);
+    }
+    bytes.resize(message_type.legal_length(), 0);
+    bytes
+}
+
+fn main() {
+    let packed = [
+        ("pack S2CGreet", Message::S2CGreet),
+        (
+            "pack S2CMatchCreateOrJoinResult",
+            Message::S2CMatchCreateOrJoinResult(
+                S2CMatchCreateOrJoinResultBody::Success(settings()),
+            ),
+        ),
+        (
+            "pack S2CMatchCancelResult",
+            Message::S2CMatchCancelResult(S2CMatchCancelResultBody::Success),
+        ),
+        (
+            "pack S2CMatchStart",
+            Message::S2CMatchStart(S2CMatchStartBody {
+                m: settings().into(),
+                match_id: 42,
+                seconds_passed: 30,
+            }),
+        ),
+        ("pack S2COpponentLeft", Message::S2COpponentLeft),
+        ("pack C2SOrS2CAction", Message::C2SOrS2CAction(action())),
+        ("pack S2CMatchList host", match_list(true)),
+        ("pack S2CMatchList nonhost", match_list(false)),
+    ];
+    for (name, msg) in packed.iter() {
+        bench(name, || msg.pack_frame().unwrap());
+    }
+
+    let a = action();
+    let unpacked = [
+        ("unpack C2SGreet", raw(MessageType::C2SGreet, &[11, 16])),
+        (
+            "unpack C2SMatchCreateOrJoin create",
+            raw(MessageType::C2SMatchCreateOrJoin, &[2, 3, 1, 1, -1]),
+        ),
+        (
+            "unpack C2SMatchCreateOrJoin join",
+            raw(MessageType::C2SMatchCreateOrJoin, &[0, 0, 0, 0, 1234567]),
+        ),
+        (
+            "unpack C2SMatchCancel",
+            raw(MessageType::C2SMatchCancel, &[]),
+        ),
+        ("unpack C2SForfeit", raw(MessageType::C2SForfeit, &[])),
+        (
+            "unpack C2SOrS2CAction",
+            raw(
+                MessageType::C2SOrS2CAction,
+                &[
+                    a.action_type as i64,
+                    a.color as i64,
+                    a.seconds_passed as i64,
+                    a.src_l,
+                    a.src_t,
+                    a.src_board_color as i64,
+                    a.src_y,
+                    a.src_x,
+                    a.dst_l,
+                    a.dst_t,
+                    a.dst_board_color as i64,
+                    a.dst_y,
+                    a.dst_x,
+                ],
+            ),
+        ),
+        (
+            "unpack C2SMatchListRequest",
+            raw(MessageType::C2SMatchListRequest, &[]),
+        ),
+    ];
+    for (name, bytes) in unpacked.iter() {
+        bench(name, || Message::unpack(&bytes).unwrap());
+    }
+}
@@ -0,0 +1,296 @@
+use byteorder::{ByteOrder, LittleEndian};
+use bytes::{Bytes, BytesMut};
+use futures::future::join_all;
+use futures::StreamExt;
+use std::env;
+use std::error::Error;
+use std::io::{ErrorKind, Result};
+use std::process::exit;
+use std::time::Duration;
+use tokio::io::AsyncWriteExt;
+use tokio::net::tcp::{OwnedReadHalf, OwnedWriteHalf};
+use tokio::net::TcpStream;
+use tokio::sync::Semaphore;
+use tokio::time::{timeout, Instant};
+use tokio_util::codec::{FramedRead, LengthDelimitedCodec};
+
+use fivedcserver::datatype::*;
+use fivedcserver::metrics::Histogram;
+use fivedcserver::{err_disconnected, err_invalid_data};
+
+/* synthetic clients for load testing a running server.
+Every pair of clients greets, creates and joins a private match,
+then both sides send actions through the server at the same time.
+The time an action was sent is carried in its srcL field,
+so the relay latency is measured when the opponent receives it. */
+
+const RECV_TIMEOUT: Duration = Duration::from_secs(10);
+
+static LATENCY: Histogram = Histogram::new();
+
+fn print_usage(arg0: &String) {
+    println!();
+    println!(
+        "usage: {} <ADDR:PORT> [PAIRS = 1] [ACTIONS = 10000] [WINDOW = 16] [MAX P99 US = 0]",
+        arg0
+    );
+    println!();
+    println!("ACTIONS are sent by each client, at most WINDOW of them not yet echoed back.");
+    println!("Exits with 1 if a pair failed or the p99 relay latency exceeds MAX P99 US (0 means no limit).");
+}
+
+// C2S messages are not packed by the server, so frames are built field by field
+fn frame(message_type: MessageType, fields: &[i64]) -> Bytes {
+    let length = message_type.legal_length();
+    let mut bytes = BytesMut::with_capacity(8 + length);
+    write_u64_le(&mut bytes, length as u64);
+    write_i64_le(&mut bytes, message_type as i64);
+    for field in fields {
+        write_i64_le(&mut bytes, *field);
+    }
+    bytes.resize(8 + length, 0);
+    bytes.freeze()
+}
+
+// i-th field after the message type
+fn field(frame: &[u8], i: usize) -> i64 {
+    LittleEndian::read_i64(&frame[8 + 8 * i..16 + 8 * i])
+}
+
+fn action(color: i64, stamp: i64, seq: i64) -> Bytes {
+    frame(
+        MessageType::C2SOrS2CAction,
+        &[
+            ActionType::Move as i64,
+            color,
+            0,     // seconds passed, filled by the server
+            stamp, // src_l
+            seq,   // src_t
+            color,
+            0,
+            0,
+            0,
+            0,
+            color,
+            0,
+            0,
+        ],
+    )
+}
+
+struct Client {
+    reader: FramedRead<OwnedReadHalf, LengthDelimitedCodec>,
+    writer: OwnedWriteHalf,
+}
+
+impl Client {
+    async fn connect(addr: &str) -> Result<Self> {
+        let stream = TcpStream::connect(addr).await?;
+        stream.set_nodelay(true)?;
+        let (reader, writer) = stream.into_split();
+        Ok(Client {
+            reader: LengthDelimitedCodec::builder()
+                .little_endian()
+                .length_field_type::<u64>()
+                .max_frame_length(MESSAGE_LENGTH_MAX)
+                .new_read(reader),
+            writer,
+        })
+    }
+
+    async fn send(&mut self, frame: &[u8]) -> Result<()> {
+        self.writer.write_all(frame).await
+    }
+
+    async fn expect(&mut self, message_type: MessageType) -> Result<BytesMut> {
+        let frame = recv(&mut self.reader).await?;
+        if LittleEndian::read_i64(&frame[0..8]) != message_type as i64 {
+            return err_invalid_data!("Expected {:?}.", message_type);
+        }
+        Ok(frame)
+    }
+
+    async fn greet(&mut self) -> Result<()> {
+        self.send(&frame(MessageType::C2SGreet, &[11, 16])).await?;
+        self.expect(MessageType::S2CGreet).await?;
+        Ok(())
+    }
+}
+
+// frame without the length field
+async fn recv(reader: &mut FramedRead<OwnedReadHalf, LengthDelimitedCodec>) -> Result<BytesMut> {
+    match timeout(RECV_TIMEOUT, reader.next()).await {
+        Ok(Some(frame)) => frame,
+        Ok(None) => err_disconnected!(),
+        Err(_) => Err(std::io::Error::new(ErrorKind::TimedOut, "Timed out.")),
+    }
+}
+
+// send actions and receive both the echoes and the opponent's actions
+async fn play(
+    client: Client,
+    color: i64,
+    actions: usize,
+    window: usize,
+    base: Instant,
+) -> Result<()> {
+    let Client {
+        mut reader,
+        mut writer,
+    } = client;
+    let permits = Semaphore::new(window);
+    let send = async {
+        for seq in 0..actions {
+            permits.acquire().await.unwrap().forget();
+            let stamp = base.elapsed().as_nanos() as i64;
+            writer.write_all(&action(color, stamp, seq as i64)).await?;
+        }
+        Ok::<_, std::io::Error>(())
+    };
+    let receive = async {
+        let (mut echoes, mut received) = (0, 0);
+        while echoes < actions || received < actions {
+            let frame = recv(&mut reader).await?;
+            match LittleEndian::read_i64(&frame[0..8]) {
+                t if t == MessageType::C2SOrS2CAction as i64 => {
+                    if field(&frame, 1) == color {
+                        echoes += 1;
+                        permits.add_permits(1);
+                    } else {
+                        received += 1;
+                        let stamp = field(&frame, 3) as u64;
+                        let now = base.elapsed().as_nanos() as u64;
+                        LATENCY.record(Duration::from_nanos(now.saturating_sub(stamp)));
+                    }
+                }
+                t if t == MessageType::S2COpponentLeft as i64 => {
+                    return err_invalid_data!("Opponent left.");
+                }
+                t => return err_invalid_data!("Unexpected message type {}.", t),
+            }
+        }
+        Ok(())
+    };
+    let (sent, received) = tokio::join!(send, receive);
+    sent.and(received)
+}
+
+// returns when the action phase started and ended
+async fn run_pair(
+    addr: String,
+    actions: usize,
+    window: usize,
+    base: Instant,
+) -> Result<(Instant, Instant)> {
+    let mut host = Client::connect(&addr).await?;
+    let mut joiner = Client::connect(&addr).await?;
+    host.greet().await?;
+    joiner.greet().await?;
+
+    // white, no clock, standard, private
+    host.send(&frame(
+        MessageType::C2SMatchCreateOrJoin,
+        &[
+            2,
+            1,
+            Variant::Standard as i64,
+            Visibility::Private as i64,
+            -1,
+        ],
+    ))
+    .await?;
+    let result = host.expect(MessageType::S2CMatchCreateOrJoinResult).await?;
+    if field(&result, 0) != 1 {
+        return err_invalid_data!("Failed to create match.");
+    }
+    let passcode = field(&result, 6);
+    joiner
+        .send(&frame(
+            MessageType::C2SMatchCreateOrJoin,
+            &[0, 0, 0, 0, passcode],
+        ))
+        .await?;
+    let result = joiner
+        .expect(MessageType::S2CMatchCreateOrJoinResult)
+        .await?;
+    if field(&result, 0) != 1 {
+        return err_invalid_data!("Failed to join match {}.", passcode);
+    }
+    let host_color = field(&host.expect(MessageType::S2CMatchStart).await?, 3);
+    let joiner_color = field(&joiner.expect(MessageType::S2CMatchStart).await?, 3);
+
+    let start = Instant::now();
+    let (h, j) = tokio::join!(
+        play(host, host_color, actions, window, base),
+        play(joiner, joiner_color, actions, window, base)
+    );
+    h.and(j)?;
+    Ok((start, Instant::now()))
+}
+
+#[tokio::main]
+async fn main() -> std::result::Result<(), Box<dyn Error>> {
+    // parse args
+    let args: Vec<String> = env::args().collect();
+    if args.len() <= 1 {
+        print_usage(&args[0]);
+        exit(1);
+    }
+    let addr = args[1].clone();
+    let arg = |i: usize, default: usize| match args.get(i) {
+        Some(v) => v.parse(),
+        None => Ok(default),
+    };
+    let pairs = arg(2, 1)?;
+    let actions = arg(3, 10000)?;
+    let window = arg(4, 16)?.max(1);
+    let max_p99 = arg(5, 0)? as u64;
+    println!(
+        "{} pairs, {} actions per client, window {}",
+        pairs, actions, window
+    );
+
+    // run
+    let base = Instant::now();
+    let handles = (0..pairs).map(|_| tokio::spawn(run_pair(addr.clone(), actions, window, base)));
+    let mut failed = 0;
+    let (mut first, mut last) = (None::<Instant>, None::<Instant>);
+    for result in join_all(handles).await {
+        match result? {
+            Ok((start, end)) => {
+                first = Some(first.map_or(start, |first| first.min(start)));
+                last = Some(last.map_or(end, |last| last.max(end)));
+            }
+            Err(e) => {
+                println!("pair failed: {}", e);
+                failed += 1;
+            }
+        }
+    }
+
+    // report
+    let relayed = LATENCY.count();
+    if let (Some(first), Some(last)) = (first, last) {
+        let seconds = last.duration_since(first).as_secs_f64();
+        println!(
+            "relayed {} actions in {:.3} s, {:.0} actions/s",
+            relayed,
+            seconds,
+            relayed as f64 / seconds
+        );
+    }
+    let [p50, p99, p999] = LATENCY.quantiles([0.5, 0.99, 0.999]).map(|v| v / 1000);
+    println!(
+        "relay latency p50 {} us, p99 {} us, p999 {} us",
+        p50, p99, p999
+    );
+    if failed > 0 {
+        println!("{} of {} pairs failed", failed, pairs);
+        exit(1);
+    }
+    if max_p99 > 0 && p99 > max_p99 {
+        println!("p99 {} us exceeds {} us", p99, max_p99);
+        exit(1);
+    }
+    Ok(())
+}
@@ -0,0 +1,475 @@
+use byteorder::{ByteOrder, LittleEndian};
+use bytes::{Bytes, BytesMut};
+use futures::StreamExt;
+use std::collections::{BTreeMap, HashMap, VecDeque};
+use std::env;
+use std::error::Error;
+use std::io::{ErrorKind, Result};
+use std::process::exit;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::io::AsyncWriteExt;
+use tokio::net::TcpStream;
+use tokio::sync::{watch, Notify};
+use tokio::time::{sleep_until, timeout, timeout_at, Instant};
+use tokio_util::codec::LengthDelimitedCodec;
+
+use fivedcserver::capture;
+use fivedcserver::datatype::*;
+use fivedcserver::{err_disconnected, err_invalid_data};
+
+/* replays a session of a capture file against a running server.
+Every captured connection becomes a client sending its C2S frames at their captured time,
+divided by SPEED (0 sends as fast as possible) and with idle gaps cut to MAX GAP seconds.
+A frame is only sent after the client received as many S2C frames as were captured before it,
+so that the replay keeps the captured order at any speed.
+The server assigns passcodes again, joins are rewritten to the passcodes of the replay. */
+
+const WAIT_TIMEOUT: Duration = Duration::from_secs(10);
+const DIVERGENCES_SHOWN: u64 = 20;
+
+fn print_usage(arg0: &String) {
+    println!();
+    println!(
+        "usage: {} <CAPTURE FILE> <ADDR:PORT> [SPEED = 1] [SESSION = 1] [MAX GAP SECONDS = 0]",
+        arg0
+    );
+    println!();
+    println!("SPEED 0 replays as fast as possible, MAX GAP SECONDS 0 keeps idle gaps.");
+    println!("Exits with 1 if the server diverged from the capture.");
+}
+
+// a C2S frame to send
+struct Step {
+    at: Duration,    // since the start of the replay
+    after: usize,    // S2C frames to receive first
+    frame: BytesMut, // including the length field
+}
+
+struct Connection {
+    id: u32,
+    start: Duration,
+    steps: Vec<Step>,
+    expected: Vec<Bytes>, // S2C frames without the length field
+}
+
+#[derive(Default)]
+struct Shared {
+    passcodes: Mutex<HashMap<Passcode, Passcode>>, // captured to replayed
+    random: Mutex<HashMap<Passcode, Random>>,      // captured to settings its host asked to draw
+    passcode_assigned: Notify,
+    divergences: AtomicU64,
+    sent: AtomicU64,
+    received: AtomicU64,
+}
+
+impl Shared {
+    fn diverged(&self, connection: u32, what: String) {
+        if self.divergences.fetch_add(1, Ordering::Relaxed) < DIVERGENCES_SHOWN {
+            println!("connection {}: {}", connection, what);
+        }
+    }
+
+    fn assign(&self, captured: Passcode, replayed: Passcode) {
+        self.passcodes
+            .lock()
+            .unwrap()
+            .entry(captured)
+            .or_insert(replayed);
+        self.passcode_assigned.notify_waiters();
+    }
+
+    // settings the server draws for a match, recorded from the echo of its host
+    fn random(&self, captured: Passcode, host: Random) -> Random {
+        let mut random = self.random.lock().unwrap();
+        *random.entry(captured).or_insert(host)
+    }
+
+    // wait for the host of a captured passcode to create its match
+    async fn passcode(&self, captured: Passcode) -> Option<Passcode> {
+        let deadline = Instant::now() + WAIT_TIMEOUT;
+        loop {
+            // created before checking, so that an assignment in between is not missed
+            let assigned = self.passcode_assigned.notified();
+            if let Some(replayed) = self.passcodes.lock().unwrap().get(&captured) {
+                return Some(*replayed);
+            }
+            if timeout_at(deadline, assigned).await.is_err() {
+                return None;
+            }
+        }
+    }
+}
+
+// settings of a match asked for as Random, drawn again by the server of the replay
+#[derive(Debug, Clone, Copy, Default)]
+struct Random {
+    color: bool,
+    variant: bool,
+}
+
+fn field(body: &[u8], i: usize) -> i64 {
+    LittleEndian::read_i64(&body[8 * i..8 * i + 8])
+}
+
+fn is_action(body: &[u8]) -> bool {
+    field(body, 0) == MessageType::C2SOrS2CAction as i64
+}
+
+/* comparison state of the S2C frames of a connection.
+Frames caused by different connections may interleave differently than in the capture,
+e.g. echoes of its own actions and actions of the opponent when both players send at once,
+so frames are compared in order per type, and actions in order per color. */
+struct Check<'a> {
+    actions: [VecDeque<&'a Bytes>; 2],
+    others: HashMap<i64, VecDeque<&'a Bytes>>,
+    failed: bool, // frames are out of step, the rest is not compared
+    first_seconds: Option<(u64, u64)>,
+    last_seconds: u64,
+}
+
+impl<'a> Check<'a> {
+    fn new(expected: &'a [Bytes]) -> Self {
+        let mut check = Check {
+            actions: [VecDeque::new(), VecDeque::new()],
+            others: HashMap::new(),
+            failed: false,
+            first_seconds: None,
+            last_seconds: 0,
+        };
+        for body in expected {
+            match is_action(body) && (field(body, 2) as u64) < 2 {
+                true => check.actions[field(body, 2) as usize].push_back(body),
+                false => check
+                    .others
+                    .entry(field(body, 0))
+                    .or_default()
+                    .push_back(body),
+            }
+        }
+        check
+    }
+
+    // captured frame to compare with
+    fn expected(&mut self, got: &[u8]) -> Option<&'a Bytes> {
+        if is_action(got) && (field(got, 2) as u64) < 2 {
+            self.actions[field(got, 2) as usize].pop_front()
+        } else {
+            self.others.get_mut(&field(got, 0))?.pop_front()
+        }
+    }
+}
+
+fn load(
+    path: &str,
+    session: u64,
+    speed: f64,
+    max_gap: Duration,
+) -> Result<(Vec<Connection>, Duration)> {
+    let mut connections = BTreeMap::new();
+    let (mut current, mut first, mut last) = (0, None, None);
+    let mut clock = Duration::ZERO;
+    for record in capture::Reader::open(path)? {
+        let record = record?;
+        if record.direction == 0 {
+            current += 1;
+            if current > session {
+                break;
+            }
+            continue;
+        }
+        if current != session {
+            continue;
+        }
+        if let Some(last) = last {
+            let gap = Duration::from_nanos(record.timestamp.saturating_sub(last));
+            clock += if max_gap.is_zero() {
+                gap
+            } else {
+                gap.min(max_gap)
+            };
+        }
+        first.get_or_insert(record.timestamp);
+        last = Some(record.timestamp);
+        let at = if speed > 0.0 {
+            clock.div_f64(speed)
+        } else {
+            Duration::ZERO
+        };
+        let c = connections
+            .entry(record.connection)
+            .or_insert_with(|| Connection {
+                id: record.connection,
+                start: at,
+                steps: Vec::new(),
+                expected: Vec::new(),
+            });
+        if record.direction == capture::Direction::C2S as u32 {
+            let mut frame = BytesMut::with_capacity(8 + record.body.len());
+            write_u64_le(&mut frame, record.body.len() as u64);
+            frame.extend_from_slice(&record.body);
+            c.steps.push(Step {
+                at,
+                after: c.expected.len(),
+                frame,
+            });
+        } else {
+            c.expected.push(record.body);
+        }
+    }
+    if current < session {
+        return err_invalid_data!("Session {} not found in {}.", session, path);
+    }
+    let length = Duration::from_nanos(last.unwrap_or(0) - first.unwrap_or(0));
+    Ok((connections.into_values().collect(), length))
+}
+
+fn compare(shared: &Shared, id: u32, check: &mut Check, i: usize, got: &[u8], drift: bool) {
+    if check.failed {
+        return;
+    }
+    let expected = match check.expected(got) {
+        Some(expected) => expected,
+        None => {
+            shared.diverged(
+                id,
+                format!(
+                    "S2C frame {} of type {} is not in capture",
+                    i,
+                    field(got, 0)
+                ),
+            );
+            check.failed = true;
+            return;
+        }
+    };
+    let message_type = field(expected, 0);
+    if message_type != field(got, 0) || expected.len() != got.len() {
+        shared.diverged(
+            id,
+            format!(
+                "S2C frame {} is of type {}, {} in capture",
+                i,
+                field(got, 0),
+                message_type
+            ),
+        );
+        check.failed = true;
+        return;
+    }
+    if message_type == MessageType::S2CMatchCreateOrJoinResult as i64 {
+        // passcodes are compared through the passcode map, drawn settings are left out
+        let random = shared.random(
+            field(expected, 7),
+            Random {
+                color: field(expected, 3) == OptionalColorWithRandom::Random as i64,
+                variant: field(expected, 5) == Variant::Random as i64,
+            },
+        );
+        let compared = |body: &[u8]| {
+            (1..7)
+                .filter(|&i| !(i == 3 && random.color || i == 5 && random.variant))
+                .map(|i| field(body, i))
+                .collect::<Vec<_>>()
+        };
+        if compared(expected) != compared(got) {
+            shared.diverged(
+                id,
+                format!(
+                    "S2CMatchCreateOrJoinResult {:?}, {:?} in capture",
+                    (1..7).map(|i| field(got, i)).collect::<Vec<_>>(),
+                    (1..7).map(|i| field(expected, i)).collect::<Vec<_>>()
+                ),
+            );
+        } else if field(got, 1) == 1 {
+            shared.assign(field(expected, 7), field(got, 7));
+        }
+    } else if message_type == MessageType::C2SOrS2CAction as i64 {
+        if expected[8..24] != got[8..24] || expected[32..] != got[32..] {
+            shared.diverged(
+                id,
+                format!("action of S2C frame {} differs from capture", i),
+            );
+        }
+        let (captured, replayed) = (field(expected, 3) as u64, field(got, 3) as u64);
+        if replayed < check.last_seconds {
+            shared.diverged(
+                id,
+                format!(
+                    "secondsPassed of S2C frame {} went back from {} to {}",
+                    i, check.last_seconds, replayed
+                ),
+            );
+        }
+        check.last_seconds = replayed;
+        let (captured_first, replayed_first) =
+            *check.first_seconds.get_or_insert((captured, replayed));
+        let (captured, replayed) = (captured - captured_first, replayed - replayed_first);
+        if drift && captured.abs_diff(replayed) > 1 {
+            shared.diverged(
+                id,
+                format!(
+                    "secondsPassed of S2C frame {} is {} s after the first action, {} s in capture",
+                    i, replayed, captured
+                ),
+            );
+            check.failed = true;
+        }
+    }
+}
+
+// wait until n S2C frames were received
+async fn wait(received: &mut watch::Receiver<usize>, n: usize, deadline: Instant) -> Result<()> {
+    while *received.borrow_and_update() < n {
+        match timeout_at(deadline, received.changed()).await {
+            Ok(Ok(())) => {}
+            _ => {
+                return Err(std::io::Error::new(
+                    ErrorKind::TimedOut,
+                    format!("Timed out waiting for S2C frame {}.", n),
+                ))
+            }
+        }
+    }
+    Ok(())
+}
+
+async fn replay(
+    c: Connection,
+    addr: Arc<String>,
+    shared: Arc<Shared>,
+    base: Instant,
+    drift: bool,
+) -> Result<()> {
+    let Connection {
+        id,
+        start,
+        steps,
+        expected,
+    } = c;
+    sleep_until(base + start).await;
+    let stream = TcpStream::connect(addr.as_str()).await?;
+    stream.set_nodelay(true)?;
+    let (reader, mut writer) = stream.into_split();
+    let mut reader = LengthDelimitedCodec::builder()
+        .little_endian()
+        .length_field_type::<u64>()
+        .max_frame_length(MESSAGE_LENGTH_MAX)
+        .new_read(reader);
+    let (received_tx, mut received_rx) = watch::channel(0);
+
+    let send = async {
+        for mut step in steps {
+            let at = base + step.at;
+            wait(
+                &mut received_rx,
+                step.after,
+                at.max(Instant::now()) + WAIT_TIMEOUT,
+            )
+            .await?;
+            sleep_until(at).await;
+            if field(&step.frame[8..], 0) == MessageType::C2SMatchCreateOrJoin as i64 {
+                let captured = field(&step.frame[8..], 5);
+                if captured >= 0 {
+                    match shared.passcode(captured).await {
+                        Some(replayed) => {
+                            LittleEndian::write_i64(&mut step.frame[48..56], replayed)
+                        }
+                        None => {
+                            shared.diverged(id, format!("match {} was never created", captured))
+                        }
+                    }
+                }
+            }
+            writer.write_all(&step.frame).await?;
+            shared.sent.fetch_add(1, Ordering::Relaxed);
+        }
+        wait(
+            &mut received_rx,
+            expected.len(),
+            Instant::now() + WAIT_TIMEOUT,
+        )
+        .await?;
+        let _ = writer.shutdown().await;
+        Ok::<_, std::io::Error>(())
+    };
+    let receive = async {
+        let mut check = Check::new(&expected);
+        for i in 0..expected.len() {
+            let got = match timeout(WAIT_TIMEOUT, reader.next()).await {
+                Ok(Some(got)) => got?,
+                Ok(None) => err_disconnected!()?,
+                Err(_) => err_invalid_data!("Timed out waiting for S2C frame {}.", i)?,
+            };
+            compare(&shared, id, &mut check, i, &got, drift);
+            shared.received.fetch_add(1, Ordering::Relaxed);
+            received_tx.send_replace(i + 1);
+        }
+        Ok(())
+    };
+    tokio::try_join!(send, receive)?;
+    Ok(())
+}
+
+#[tokio::main]
+async fn main() -> std::result::Result<(), Box<dyn Error>> {
+    // parse args
+    let args: Vec<String> = env::args().collect();
+    if args.len() <= 2 {
+        print_usage(&args[0]);
+        exit(1);
+    }
+    let speed: f64 = args.get(3).map_or(Ok(1.0), |v| v.parse())?;
+    let session: u64 = args.get(4).map_or(Ok(1), |v| v.parse())?;
+    let max_gap: f64 = args.get(5).map_or(Ok(0.0), |v| v.parse())?;
+    let max_gap = Duration::from_secs_f64(max_gap);
+
+    // load
+    let (connections, length) = load(&args[1], session, speed, max_gap)?;
+    let expected: usize = connections.iter().map(|c| c.expected.len()).sum();
+    println!(
+        "session {}: {} connections over {:.3} s",
+        session,
+        connections.len(),
+        length.as_secs_f64()
+    );
+    let count = connections.len();
+
+    // replay
+    let addr = Arc::new(args[2].clone());
+    let shared = Arc::new(Shared::default());
+    let drift = speed == 1.0 && max_gap.is_zero(); // secondsPassed is only comparable in real time
+    let base = Instant::now();
+    let handles: Vec<_> = connections
+        .into_iter()
+        .map(|c| {
+            (
+                c.id,
+                tokio::spawn(replay(c, addr.clone(), shared.clone(), base, drift)),
+            )
+        })
+        .collect();
+    for (id, handle) in handles {
+        if let Err(e) = handle.await? {
+            shared.diverged(id, e.to_string());
+        }
+    }
+
+    // report
+    println!(
+        "replayed {} connections in {:.3} s, sent {} frames, received {} of {} frames",
+        count,
+        base.elapsed().as_secs_f64(),
+        shared.sent.load(Ordering::Relaxed),
+        shared.received.load(Ordering::Relaxed),
+        expected
+    );
+    let divergences = shared.divergences.load(Ordering::Relaxed);
+    if divergences > 0 {
+        println!("{} divergences", divergences);
+        exit(1);
+    }
+    println!("no divergence");
+    Ok(())
+}
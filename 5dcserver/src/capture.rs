@@ -0,0 +1,169 @@
+use bytes::Bytes;
+use std::fs::{File, OpenOptions};
+use std::io::{BufReader, BufWriter, Error, ErrorKind, Read, Result, Write};
+use std::sync::mpsc::{sync_channel, Receiver, SyncSender, TrySendError};
+use std::sync::OnceLock;
+use std::thread;
+use std::time::{SystemTime, UNIX_EPOCH};
+use tracing::{error, info};
+
+use crate::datatype::MESSAGE_LENGTH_MAX;
+use crate::metrics::METRICS;
+
+/* append-only capture of every frame, the file format is described in analysis/capture.h.
+Records are handed to a background thread through a bounded queue and written in batches,
+a record that doesn't fit in the queue is dropped and counted so that capture never blocks. */
+
+const MAGIC: &[u8; 8] = b"5DCCAP\0\0";
+const VERSION: u64 = 1;
+const QUEUE_LENGTH: usize = 65536;
+const BATCH_MAX: usize = 4096; // records written between flushes
+const WRITE_BUFFER_SIZE: usize = 1 << 20;
+
+#[derive(Debug, Copy, Clone)]
+pub enum Direction {
+    C2S = 1,
+    S2C = 2,
+}
+
+#[derive(Debug)]
+pub struct Record {
+    pub timestamp: u64, // nanoseconds since unix epoch
+    pub connection: u32,
+    pub direction: u32, // 0 for session records
+    pub body: Bytes,    // frame without the length field
+}
+
+#[derive(Debug)]
+struct Capture {
+    tx: SyncSender<Record>,
+}
+
+static CAPTURE: OnceLock<Capture> = OnceLock::new();
+
+fn now() -> u64 {
+    SystemTime::now()
+        .duration_since(UNIX_EPOCH)
+        .map_or(0, |d| d.as_nanos() as u64)
+}
+
+fn write_record(writer: &mut BufWriter<File>, record: &Record) -> Result<()> {
+    let mut head = [0; 24];
+    head[0..8].copy_from_slice(&record.timestamp.to_le_bytes());
+    head[8..12].copy_from_slice(&record.connection.to_le_bytes());
+    head[12..16].copy_from_slice(&record.direction.to_le_bytes());
+    head[16..24].copy_from_slice(&(record.body.len() as u64).to_le_bytes());
+    writer.write_all(&head)?;
+    writer.write_all(&record.body)
+}
+
+// block for the first record of a batch, then take what is already queued
+fn run(mut writer: BufWriter<File>, rx: Receiver<Record>) {
+    while let Ok(record) = rx.recv() {
+        let mut result = write_record(&mut writer, &record);
+        for record in rx.try_iter().take(BATCH_MAX - 1) {
+            result = result.and_then(|_| write_record(&mut writer, &record));
+        }
+        if let Err(e) = result.and_then(|_| writer.flush()) {
+            error!("Failed to write capture: {}", e);
+            return;
+        }
+    }
+}
+
+// start capturing to path, appending a new session if the file exists
+pub fn start(path: &str) -> Result<()> {
+    let file = OpenOptions::new().create(true).append(true).open(path)?;
+    let empty = file.metadata()?.len() == 0;
+    let mut writer = BufWriter::with_capacity(WRITE_BUFFER_SIZE, file);
+    if empty {
+        writer.write_all(MAGIC)?;
+        writer.write_all(&VERSION.to_le_bytes())?;
+    }
+    let session = Record {
+        timestamp: now(),
+        connection: 0,
+        direction: 0,
+        body: Bytes::new(),
+    };
+    write_record(&mut writer, &session)?;
+    writer.flush()?;
+
+    let (tx, rx) = sync_channel(QUEUE_LENGTH);
+    thread::Builder::new()
+        .name("capture".into())
+        .spawn(move || run(writer, rx))?;
+    let _ = CAPTURE.set(Capture { tx });
+    info!("capturing to {} ...", path);
+    Ok(())
+}
+
+pub fn enabled() -> bool {
+    CAPTURE.get().is_some()
+}
+
+pub fn record(connection: u32, direction: Direction, body: Bytes) {
+    if let Some(capture) = CAPTURE.get() {
+        let record = Record {
+            timestamp: now(),
+            connection,
+            direction: direction as u32,
+            body,
+        };
+        if let Err(TrySendError::Full(_)) = capture.tx.try_send(record) {
+            METRICS.capture_dropped();
+        }
+    }
+}
+
+// records of a capture file in order, stops at a truncated record
+pub struct Reader<R: Read> {
+    reader: BufReader<R>,
+}
+
+impl Reader<File> {
+    pub fn open(path: &str) -> Result<Self> {
+        let mut reader = BufReader::with_capacity(WRITE_BUFFER_SIZE, File::open(path)?);
+        let mut header = [0; 16];
+        reader.read_exact(&mut header)?;
+        if &header[0..8] != MAGIC || header[8..16] != VERSION.to_le_bytes() {
+            return Err(Error::new(
+                ErrorKind::InvalidData,
+                format!("{} is not a capture file of version {}.", path, VERSION),
+            ));
+        }
+        Ok(Reader { reader })
+    }
+}
+
+impl<R: Read> Iterator for Reader<R> {
+    type Item = Result<Record>;
+
+    fn next(&mut self) -> Option<Result<Record>> {
+        let mut head = [0; 24];
+        match self.reader.read_exact(&mut head) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return None,
+            Err(e) => return Some(Err(e)),
+        }
+        let length = u64::from_le_bytes(head[16..24].try_into().unwrap()) as usize;
+        if length > MESSAGE_LENGTH_MAX {
+            return Some(Err(Error::new(
+                ErrorKind::InvalidData,
+                format!("Record of length {} is corrupted.", length),
+            )));
+        }
+        let mut body = vec![0; length];
+        match self.reader.read_exact(&mut body) {
+            Ok(()) => {}
+            Err(e) if e.kind() == ErrorKind::UnexpectedEof => return None,
+            Err(e) => return Some(Err(e)),
+        }
+        Some(Ok(Record {
+            timestamp: u64::from_le_bytes(head[0..8].try_into().unwrap()),
+            connection: u32::from_le_bytes(head[8..12].try_into().unwrap()),
+            direction: u32::from_le_bytes(head[12..16].try_into().unwrap()),
+            body: body.into(),
+        }))
+    }
+}
@@ -0,0 +1,326 @@
+use byteorder::{ByteOrder, LittleEndian};
+use bytes::BytesMut;
+use std::io::{Error, ErrorKind, Result};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::io::{copy, AsyncReadExt, AsyncWriteExt};
+use tokio::net::TcpStream;
+use tokio::select;
+use tokio::sync::broadcast::{self, error::RecvError};
+use tokio::time::{sleep, Instant};
+use tracing::{error, info};
+
+use crate::datatype::*;
+use crate::passcode::PASSCODE_SPACE;
+use crate::server::ServerState;
+use crate::shard::bind_when_free;
+
+/* cluster of servers sharing one passcode space.
+Node i of n owns the i-th of n contiguous ranges of passcodes, so the owner of a passcode
+follows from its value alone, with 12 nodes it is the highest base-12 digit (the 6th piece).
+A join for a passcode of another node is spliced to that node's client port,
+the connection keeps going through this node until the client disconnects.
+Every node pushes its public matches and server history to every other node:
+a link starts with the full state after a reset, then carries the changes as they happen,
+and starts over when the link is lost or lags behind. */
+
+const EVENT_QUEUE: usize = 4096; // changes buffered per link before it starts over
+const RECONNECT_DELAY: Duration = Duration::from_secs(1);
+const FRAME_FIELDS: usize = 8;
+const FRAME_LENGTH: usize = FRAME_FIELDS * 8;
+
+// kinds of link frames, every frame is 8 little-endian i64 fields starting with the kind
+const HELLO: i64 = 1; // node of the sender
+const RESET: i64 = 2; // forget the state of the sender
+const PUBLIC_ADD: i64 = 3; // passcode, color, clock, variant, match id
+const PUBLIC_REMOVE: i64 = 4; // passcode
+const HISTORY_INSERT: i64 = 5; // ticket, state, clock, variant, visibility, age in milliseconds
+const HISTORY_COMPLETE: i64 = 6; // ticket
+
+// change of the match list of a node
+#[derive(Debug, Clone)]
+pub enum ClusterEvent {
+    PublicAdd(MatchSettingsWithoutVisibility),
+    PublicRemove(Passcode),
+    HistoryInsert(HistoryTicket, ServerHistoryMatch),
+    HistoryComplete(HistoryTicket),
+}
+
+#[derive(Debug, Clone)]
+pub struct ClusterNode {
+    pub addr: String, // client port, joins are spliced to it
+    pub link: String, // receives the changes of the other nodes
+}
+
+#[derive(Debug)]
+pub struct Cluster {
+    pub node: usize,
+    pub nodes: Vec<ClusterNode>,
+    pub events: broadcast::Sender<ClusterEvent>,
+}
+
+impl Cluster {
+    pub fn new(node: usize, nodes: Vec<ClusterNode>) -> Self {
+        Cluster {
+            node,
+            nodes,
+            events: broadcast::channel(EVENT_QUEUE).0,
+        }
+    }
+
+    // passcodes of a node, the last one also takes the remainder
+    pub fn range(&self, node: usize) -> (Passcode, u64) {
+        let len = PASSCODE_SPACE / self.nodes.len() as u64;
+        let start = node as u64 * len;
+        if node == self.nodes.len() - 1 {
+            (start as Passcode, PASSCODE_SPACE - start)
+        } else {
+            (start as Passcode, len)
+        }
+    }
+
+    // node owning a passcode other than this one
+    pub fn remote_owner(&self, passcode: Passcode) -> Option<usize> {
+        if passcode < 0 || passcode as u64 >= PASSCODE_SPACE {
+            return None;
+        }
+        let len = PASSCODE_SPACE / self.nodes.len() as u64;
+        let node = ((passcode as u64 / len) as usize).min(self.nodes.len() - 1);
+        (node != self.node).then_some(node)
+    }
+}
+
+fn frame(fields: [i64; FRAME_FIELDS]) -> [u8; FRAME_LENGTH] {
+    let mut bytes = [0; FRAME_LENGTH];
+    for (chunk, field) in bytes.chunks_exact_mut(8).zip(fields) {
+        LittleEndian::write_i64(chunk, field);
+    }
+    bytes
+}
+
+fn event_frame(event: &ClusterEvent) -> [u8; FRAME_LENGTH] {
+    match event {
+        ClusterEvent::PublicAdd(m) => frame([
+            PUBLIC_ADD,
+            m.passcode,
+            m.color as i64,
+            m.clock as i64,
+            m.variant as i64,
+            m.match_id,
+            0,
+            0,
+        ]),
+        ClusterEvent::PublicRemove(passcode) => frame([PUBLIC_REMOVE, *passcode, 0, 0, 0, 0, 0, 0]),
+        ClusterEvent::HistoryInsert(ticket, m) => frame([
+            HISTORY_INSERT,
+            *ticket as i64,
+            m.state as i64,
+            m.clock as i64,
+            m.variant as i64,
+            m.visibility as i64,
+            Instant::now().duration_since(m.time_start).as_millis() as i64,
+            0,
+        ]),
+        ClusterEvent::HistoryComplete(ticket) => {
+            frame([HISTORY_COMPLETE, *ticket as i64, 0, 0, 0, 0, 0, 0])
+        }
+    }
+}
+
+fn parse_event(f: &[i64; FRAME_FIELDS]) -> Result<ClusterEvent> {
+    Ok(match f[0] {
+        PUBLIC_ADD => ClusterEvent::PublicAdd(MatchSettingsWithoutVisibility {
+            passcode: f[1],
+            color: try_i64_to_enum(f[2])?,
+            clock: try_i64_to_enum(f[3])?,
+            variant: try_i64_to_enum(f[4])?,
+            match_id: f[5],
+        }),
+        PUBLIC_REMOVE => ClusterEvent::PublicRemove(f[1]),
+        HISTORY_INSERT => ClusterEvent::HistoryInsert(
+            f[1] as HistoryTicket,
+            ServerHistoryMatch {
+                state: try_i64_to_enum(f[2])?,
+                clock: try_i64_to_enum(f[3])?,
+                variant: try_i64_to_enum(f[4])?,
+                visibility: try_i64_to_enum(f[5])?,
+                time_start: Instant::now()
+                    .checked_sub(Duration::from_millis(f[6].max(0) as u64))
+                    .unwrap_or_else(Instant::now),
+            },
+        ),
+        HISTORY_COMPLETE => ClusterEvent::HistoryComplete(f[1] as HistoryTicket),
+        kind => err_invalid_data!("Invalid cluster frame kind {}.", kind)?,
+    })
+}
+
+async fn read_frame(stream: &mut TcpStream) -> Result<[i64; FRAME_FIELDS]> {
+    let mut bytes = [0; FRAME_LENGTH];
+    stream.read_exact(&mut bytes).await?;
+    let mut fields = [0; FRAME_FIELDS];
+    for (field, chunk) in fields.iter_mut().zip(bytes.chunks_exact(8)) {
+        *field = LittleEndian::read_i64(chunk);
+    }
+    Ok(fields)
+}
+
+// receive the changes of one node until its link closes, its state is dropped then
+async fn receive(state: Arc<ServerState>, mut stream: TcpStream) -> Result<()> {
+    let hello = read_frame(&mut stream).await?;
+    let nodes = state.cluster.as_ref().unwrap().nodes.len();
+    if hello[0] != HELLO || hello[1] < 0 || hello[1] as usize >= nodes {
+        return err_invalid_data!("Invalid cluster hello {:?}.", hello);
+    }
+    let node = hello[1] as usize;
+    let link = state.registry.remote_link(node);
+    info!("cluster node {} linked", node);
+    let result = async {
+        loop {
+            let f = read_frame(&mut stream).await?;
+            match f[0] {
+                RESET => state.registry.remote_reset(node, link),
+                _ => state.registry.remote_apply(node, link, parse_event(&f)?),
+            }
+        }
+    }
+    .await;
+    // the state pushed over a newer link of the node stays
+    state.registry.remote_reset(node, link);
+    info!("cluster node {} unlinked", node);
+    result
+}
+
+// push the state of this node and then its changes to one node, reconnecting whenever lost
+async fn push(state: Arc<ServerState>, node: usize) {
+    let cluster = state.cluster.as_ref().unwrap();
+    let addr = cluster.nodes[node].link.clone();
+    loop {
+        if let Err(e) = push_link(&state, cluster, &addr).await {
+            error!("Cluster link to node {} at {} lost: {}", node, addr, e);
+        }
+        sleep(RECONNECT_DELAY).await;
+    }
+}
+
+async fn push_link(state: &ServerState, cluster: &Cluster, addr: &str) -> Result<()> {
+    let mut stream = TcpStream::connect(addr).await?;
+    stream.set_nodelay(true)?;
+    stream
+        .write_all(&frame([HELLO, cluster.node as i64, 0, 0, 0, 0, 0, 0]))
+        .await?;
+    let mut buffer = Vec::new();
+    loop {
+        // subscribed before the state is read, changes meanwhile are sent again after it
+        let mut events = cluster.events.subscribe();
+        buffer.extend_from_slice(&frame([RESET, 0, 0, 0, 0, 0, 0, 0]));
+        for event in state.registry.local_state() {
+            buffer.extend_from_slice(&event_frame(&event));
+        }
+        stream.write_all(&buffer).await?;
+        buffer.clear();
+        loop {
+            match events.recv().await {
+                Ok(event) => buffer.extend_from_slice(&event_frame(&event)),
+                Err(RecvError::Lagged(_)) => break,
+                Err(RecvError::Closed) => return Ok(()),
+            }
+            // everything queued goes out in one write
+            while let Ok(event) = events.try_recv() {
+                buffer.extend_from_slice(&event_frame(&event));
+            }
+            stream.write_all(&buffer).await?;
+            buffer.clear();
+        }
+    }
+}
+
+// accept the links of the other nodes and keep a link to each of them
+pub async fn serve(state: Arc<ServerState>) {
+    let cluster = state.cluster.as_ref().unwrap();
+    // pushed to the other nodes only once bound, after the server taken over from has unlinked
+    let listener = match bind_when_free(&cluster.nodes[cluster.node].link).await {
+        Ok(listener) => listener,
+        Err(e) => {
+            error!(
+                "Failed to bind cluster link {}: {}",
+                cluster.nodes[cluster.node].link, e
+            );
+            return;
+        }
+    };
+    info!(
+        "cluster node {} of {} linking on {} ...",
+        cluster.node,
+        cluster.nodes.len(),
+        cluster.nodes[cluster.node].link
+    );
+    for node in (0..cluster.nodes.len()).filter(|&node| node != cluster.node) {
+        tokio::spawn(push(state.clone(), node));
+    }
+    loop {
+        match listener.accept().await {
+            Ok((stream, _)) => {
+                let _ = stream.set_nodelay(true);
+                let state = state.clone();
+                tokio::spawn(async move {
+                    if let Err(e) = receive(state, stream).await {
+                        error!("Cluster link failed: {}", e);
+                    }
+                });
+            }
+            Err(e) => {
+                error!("Failed to accept cluster link: {}", e);
+                sleep(RECONNECT_DELAY).await;
+            }
+        }
+    }
+}
+
+// C2SMatchCreateOrJoin joining passcode
+fn join_frame(passcode: Passcode) -> BytesMut {
+    let mut bytes = BytesMut::with_capacity(56);
+    write_u64_le(&mut bytes, 48);
+    write_i64_le(&mut bytes, MessageType::C2SMatchCreateOrJoin as i64);
+    for _ in 0..4 {
+        write_i64_le(&mut bytes, 0);
+    }
+    write_i64_le(&mut bytes, passcode);
+    bytes
+}
+
+/* join on the owning node and relay the connection to it from then on.
+The client sees the result of the join from that node as if it was connected to it.
+The relay ends with the connection on that node, e.g. closed by one of its timeouts,
+without waiting for a silent client to send. */
+pub async fn splice(io: &mut MessageIO, node: &ClusterNode, passcode: Passcode) -> Result<()> {
+    let mut remote = TcpStream::connect(&node.addr).await.map_err(|e| {
+        Error::new(
+            e.kind(),
+            format!("Failed to reach cluster node {}: {}", node.addr, e),
+        )
+    })?;
+    remote.set_nodelay(true)?;
+    remote.write_all(&join_frame(passcode)).await?;
+    let (buffered, client_read, client_write) = io.splice_parts().await?;
+    remote.write_all(&buffered).await?;
+    let (mut remote_read, mut remote_write) = remote.split();
+    let upstream = async {
+        copy(client_read, &mut remote_write).await?;
+        remote_write.shutdown().await?;
+        // the owning node closes its side once it saw the end
+        std::future::pending().await
+    };
+    let downstream = async {
+        copy(&mut remote_read, client_write).await?;
+        client_write.shutdown().await
+    };
+    let result = select! {
+        result = upstream => result,
+        result = downstream => result,
+    };
+    match result {
+        Ok(_) => Ok(()),
+        Err(e) if e.kind() == ErrorKind::ConnectionReset => Ok(()),
+        Err(e) => Err(e),
+    }
+}
@@ -0,0 +1,149 @@
+use std::error::Error;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Arc, Mutex};
+use tracing::info;
+
+use crate::datatype::*;
+use crate::metrics::Lock;
+use crate::registry::lock;
+use crate::server::ServerState;
+
+pub type ConfigMap = toml::value::Map<String, toml::Value>;
+
+pub fn get_config<'a, T: toml::macros::Deserialize<'a>>(
+    config: &ConfigMap,
+    name: &str,
+    default: T,
+) -> T {
+    match config.get(name) {
+        Some(value) => match value.clone().try_into() {
+            Ok(value) => value,
+            _ => default,
+        },
+        None => default,
+    }
+}
+
+// settings that may change while running, a connection picks them up with its next message
+#[derive(Debug)]
+pub struct LiveConfig {
+    pub allow_reset_puzzle: bool,
+    pub validate_moves: bool,
+    variants: u64,                           // bit v is set if variant v may be created
+    variants_without_random: Box<[Variant]>, // what a random variant is determined from
+}
+
+impl LiveConfig {
+    pub fn new(config: &ConfigMap) -> Result<Self, Box<dyn Error>> {
+        let variants = get_config(config, "variants", toml::value::Array::new());
+        let variants: Vec<Variant> = if variants.is_empty() {
+            (1..46).map(try_i64_to_enum).collect::<Result<_, _>>()?
+        } else {
+            variants
+                .iter()
+                .map(|v| match v.as_integer() {
+                    Some(v) => try_i64_to_enum(v),
+                    None => err_invalid_data!("Variant {} is not a number.", v),
+                })
+                .collect::<Result<_, _>>()?
+        };
+        let mut variants_without_random: Vec<Variant> = variants
+            .iter()
+            .copied()
+            .filter(|&v| v != Variant::Random)
+            .collect();
+        variants_without_random.sort_by_key(|&v| v as i64);
+        variants_without_random.dedup();
+        if variants_without_random.is_empty() {
+            Err("variants needs a variant other than Random.")?;
+        }
+        Ok(LiveConfig {
+            allow_reset_puzzle: get_config(config, "allow_reset_puzzle", false),
+            validate_moves: get_config(config, "validate_moves", false),
+            variants: variants.iter().fold(0, |bits, &v| bits | 1 << v as i64),
+            variants_without_random: variants_without_random.into_boxed_slice(),
+        })
+    }
+
+    pub fn allows(&self, variant: Variant) -> bool {
+        self.variants >> variant as i64 & 1 == 1
+    }
+
+    pub fn determined(&self, variant: Variant) -> Variant {
+        variant.determined(&self.variants_without_random)
+    }
+
+    pub fn variant_count(&self) -> usize {
+        self.variants.count_ones() as usize
+    }
+}
+
+/* snapshot replaced as a whole, read-copy-update style.
+Readers keep an Arc of the snapshot they last saw with its version and only load the version
+on the hot path, the lock is taken once per reader and store to pick up the new snapshot,
+and the old one is freed when its last reader moved on. */
+#[derive(Debug)]
+pub struct Live<T> {
+    version: AtomicU64,
+    current: Mutex<Arc<T>>,
+}
+
+#[derive(Debug, Clone)]
+pub struct Snapshot<T> {
+    version: u64,
+    value: Arc<T>,
+}
+
+impl<T> std::ops::Deref for Snapshot<T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.value
+    }
+}
+
+impl<T> Live<T> {
+    pub fn new(value: T) -> Self {
+        Live {
+            version: AtomicU64::new(0),
+            current: Mutex::new(Arc::new(value)),
+        }
+    }
+
+    pub fn load(&self) -> Snapshot<T> {
+        let current = lock(&self.current, Lock::Config);
+        Snapshot {
+            // read under the lock, so a store meanwhile is seen by the next refresh
+            version: self.version.load(Ordering::Acquire),
+            value: current.clone(),
+        }
+    }
+
+    // bring a snapshot up to date, a single atomic load unless a new value was stored
+    pub fn refresh(&self, snapshot: &mut Snapshot<T>) {
+        if self.version.load(Ordering::Acquire) != snapshot.version {
+            *snapshot = self.load();
+        }
+    }
+
+    pub fn store(&self, value: T) {
+        let mut current = lock(&self.current, Lock::Config);
+        *current = Arc::new(value);
+        self.version.fetch_add(1, Ordering::Release);
+    }
+}
+
+// read the config file again and swap in its live settings, the others need a restart
+pub fn reload(path: &str, state: &ServerState) -> Result<(), Box<dyn Error>> {
+    let config: ConfigMap = toml::from_str(&std::fs::read_to_string(path)?)?;
+    let live = LiveConfig::new(&config)?;
+    info!(
+        "Reloaded {}: {} variants, allow_reset_puzzle = {}, validate_moves = {}",
+        path,
+        live.variant_count(),
+        live.allow_reset_puzzle,
+        live.validate_moves
+    );
+    state.config.store(live);
+    Ok(())
+}
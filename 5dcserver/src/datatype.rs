@@ -1,20 +1,40 @@
 use byteorder::{ByteOrder, LittleEndian};
-use bytes::{Bytes, BytesMut};
+use bytes::{Buf, Bytes, BytesMut};
 use enum_primitive::{enum_from_primitive, enum_from_primitive_impl, enum_from_primitive_impl_ty};
-use futures::{SinkExt, StreamExt};
+use futures::FutureExt;
 use rand::Rng;
-use std::collections::HashMap;
-use std::io::{Error, Result};
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::io::{Error, ErrorKind, IoSlice, Result};
+use std::net::SocketAddr;
+use std::sync::atomic::{AtomicU32, Ordering};
+use tokio::io::{AsyncWrite, AsyncWriteExt};
+use tokio::net::tcp::{OwnedReadHalf, OwnedWriteHalf};
 use tokio::net::TcpStream;
-use tokio::sync::{broadcast, Mutex};
-use tokio::time::Instant;
-use tokio_util::codec::{Framed, LengthDelimitedCodec};
+use tokio::sync::mpsc;
+use tokio::time::{sleep_until, Instant};
 use tracing::trace;
 
+use crate::capture::{self, Direction};
+use crate::limit::{Limiter, RateLimits};
+use crate::metrics::{type_kind, METRICS};
+#[cfg(target_os = "linux")]
+use crate::uring;
+
 pub const MESSAGE_LENGTH_MAX: usize = 4096; // >= 1008, prevent attacks
 
 pub type Passcode = i64;
 pub type MatchId = i64;
+pub type HistoryTicket = u64; // position of a match in the server history
+
+/* one direction of the pipe between the two players of a match, carries Internal* messages.
+A sender only waits for the echoes of its own actions, so a player reading its socket slower
+than the opponent plays queues frames here, under load up to a few batches of
+MESSAGE_BATCH_MAX + 1 frames of server.rs. A sender filling the pipe while the peer stalls
+is disconnected, so a stalled peer holds at most this many frames. */
+pub const PEER_PIPE_CAPACITY: usize = 1024;
+pub type PeerSender = mpsc::Sender<Message>;
+pub type PeerReceiver = mpsc::Receiver<Message>;
 
 #[macro_export]
 macro_rules! err_invalid_data {
@@ -34,6 +54,15 @@ macro_rules! err_disconnected {
         ))
     };
 }
+#[macro_export]
+macro_rules! err_timed_out {
+    ( $($arg:tt)* ) => {
+        Err(std::io::Error::new(
+            std::io::ErrorKind::TimedOut,
+            format!($($arg)*),
+        ))
+    };
+}
 
 enum_from_primitive! {
     #[repr(i64)]
@@ -164,7 +193,7 @@ enum_from_primitive! {
     }
 }
 impl Variant {
-    pub fn determined(&self, variants_without_random: &Vec<Self>) -> Self {
+    pub fn determined(&self, variants_without_random: &[Self]) -> Self {
         match self {
             Variant::Random => {
                 variants_without_random
@@ -320,13 +349,13 @@ pub enum Message {
     C2SForfeit,
     C2SOrS2CAction(C2SOrS2CActionBody),
     C2SMatchListRequest,
-    S2CMatchList(S2CMatchListBody),
+    S2CMatchList(Box<S2CMatchListBody>), // boxed, the body would make every message over 1 KiB
 
-    InternalInitialize(broadcast::Sender<Message>),
-    InternalJoin,
-    InternalMatchStart(S2CMatchStartBody),
+    InternalJoin(OptionalColorWithRandom), // color asked for by the joiner, Random if none
+    InternalMatchStart(S2CMatchStartBody, HistoryTicket, bool), // and whether moves are validated
     InternalForfeit,
-    InternalAction(C2SOrS2CActionBody),
+    InternalAction(Bytes, Instant), // packed C2SOrS2CAction frame, forwarded as is, and when it was read
+    InternalTimeout,                // deadline of the connection passed
 }
 #[derive(Debug, Copy, Clone)]
 pub struct C2SGreetBody {
@@ -434,39 +463,40 @@ impl Message {
     }
 
     pub fn pack(&self) -> Result<Bytes> {
-        let mut bytes = BytesMut::new();
-        write_i64_le(&mut bytes, self.message_type() as i64);
+        Ok(self.pack_frame()?.slice(8..))
+    }
+
+    /* pack into a frame ready to be written, including the length field.
+    The frame is carved from a per-thread arena with exactly its length and every field
+    is written at its fixed offset, the layouts are the structs of analysis/message.h. */
+    pub fn pack_frame(&self) -> Result<Bytes> {
+        let length = self.legal_length();
+        let mut bytes = frame_buffer(8 + length);
+        LittleEndian::write_u64(&mut bytes[0..8], length as u64);
+        let frame = &mut bytes[8..];
+        LittleEndian::write_i64(&mut frame[0..8], self.message_type() as i64);
         match self {
             Message::S2CGreet => {
-                write_i64_le(&mut bytes, 1); // version, unconfirmed
-                for _ in 0..5 {
-                    write_i64_le(&mut bytes, 0); // unknown
-                }
-            }
-            Message::S2CMatchCreateOrJoinResult(body) => {
-                match body {
-                    S2CMatchCreateOrJoinResultBody::Success(body) => {
-                        write_i64_le(&mut bytes, 1); // success
-                        write_i64_le(&mut bytes, 0); // success
-                        write_i64_le(&mut bytes, body.color as i64);
-                        write_i64_le(&mut bytes, body.clock as i64);
-                        write_i64_le(&mut bytes, body.variant as i64);
-                        write_i64_le(&mut bytes, body.visibility as i64);
-                        write_i64_le(&mut bytes, body.passcode);
-                    }
-                    S2CMatchCreateOrJoinResultBody::Failed => {
-                        write_i64_le(&mut bytes, 0); // failed
-                        write_i64_le(&mut bytes, 1); // failed
-                        for _ in 0..4 {
-                            write_i64_le(&mut bytes, 0);
-                        }
-                        write_i64_le(&mut bytes, -1);
-                    }
-                };
+                put_field(frame, 0, 1); // version, unconfirmed
             }
+            Message::S2CMatchCreateOrJoinResult(body) => match body {
+                S2CMatchCreateOrJoinResultBody::Success(body) => {
+                    put_field(frame, 0, 1); // success
+                    put_field(frame, 2, body.color as i64);
+                    put_field(frame, 3, body.clock as i64);
+                    put_field(frame, 4, body.variant as i64);
+                    put_field(frame, 5, body.visibility as i64);
+                    put_field(frame, 6, body.passcode);
+                }
+                S2CMatchCreateOrJoinResultBody::Failed => {
+                    put_field(frame, 1, 1); // failed
+                    put_field(frame, 6, -1);
+                }
+            },
             Message::S2CMatchCancelResult(body) => {
-                write_i64_le(
-                    &mut bytes,
+                put_field(
+                    frame,
+                    0,
                     match body {
                         S2CMatchCancelResultBody::Success => 1,
                         S2CMatchCancelResultBody::Failed => 0,
@@ -474,74 +504,66 @@ impl Message {
                 );
             }
             Message::S2CMatchStart(body) => {
-                write_i64_le(&mut bytes, body.m.clock as i64);
-                write_i64_le(&mut bytes, body.m.variant as i64);
-                write_i64_le(&mut bytes, body.match_id);
-                write_i64_le(&mut bytes, TryInto::<Color>::try_into(body.m.color)? as i64);
-                write_u64_le(&mut bytes, body.seconds_passed);
-            }
-            Message::S2COpponentLeft => {
-                bytes.extend_from_slice(&[0]); // unknown
+                put_field(frame, 0, body.m.clock as i64);
+                put_field(frame, 1, body.m.variant as i64);
+                put_field(frame, 2, body.match_id);
+                put_field(frame, 3, TryInto::<Color>::try_into(body.m.color)? as i64);
+                put_field(frame, 4, body.seconds_passed as i64);
             }
+            Message::S2COpponentLeft => {} // a single unknown byte of 0
             Message::C2SOrS2CAction(body) => {
-                write_i64_le(&mut bytes, body.action_type as i64);
-                write_i64_le(&mut bytes, body.color as i64);
-                write_u64_le(&mut bytes, body.seconds_passed);
-                write_i64_le(&mut bytes, body.src_l);
-                write_i64_le(&mut bytes, body.src_t);
-                write_i64_le(&mut bytes, body.src_board_color as i64);
-                write_i64_le(&mut bytes, body.src_y);
-                write_i64_le(&mut bytes, body.src_x);
-                write_i64_le(&mut bytes, body.dst_l);
-                write_i64_le(&mut bytes, body.dst_t);
-                write_i64_le(&mut bytes, body.dst_board_color as i64);
-                write_i64_le(&mut bytes, body.dst_y);
-                write_i64_le(&mut bytes, body.dst_x);
+                put_field(frame, 0, body.action_type as i64);
+                put_field(frame, 1, body.color as i64);
+                put_field(frame, 2, body.seconds_passed as i64);
+                put_field(frame, 3, body.src_l);
+                put_field(frame, 4, body.src_t);
+                put_field(frame, 5, body.src_board_color as i64);
+                put_field(frame, 6, body.src_y);
+                put_field(frame, 7, body.src_x);
+                put_field(frame, 8, body.dst_l);
+                put_field(frame, 9, body.dst_t);
+                put_field(frame, 10, body.dst_board_color as i64);
+                put_field(frame, 11, body.dst_y);
+                put_field(frame, 12, body.dst_x);
             }
             Message::S2CMatchList(body) => {
-                let body = match body {
+                put_field(frame, 0, 1); // unknown
+                let body = match &**body {
                     S2CMatchListBody::Host(body) => {
-                        write_i64_le(&mut bytes, 1); // unknown
-                        write_i64_le(&mut bytes, body.color as i64);
-                        write_i64_le(&mut bytes, body.clock as i64);
-                        write_i64_le(&mut bytes, body.variant as i64);
-                        write_i64_le(&mut bytes, body.passcode);
-                        write_i64_le(&mut bytes, 1); // is_host
+                        put_field(frame, 1, body.color as i64);
+                        put_field(frame, 2, body.clock as i64);
+                        put_field(frame, 3, body.variant as i64);
+                        put_field(frame, 4, body.passcode);
+                        put_field(frame, 5, 1); // is_host
                         &body.body
                     }
-                    S2CMatchListBody::Nonhost(body) => {
-                        write_i64_le(&mut bytes, 1); // unknown
-                        for _ in 0..5 {
-                            write_i64_le(&mut bytes, 0);
-                        }
-                        body
-                    }
+                    S2CMatchListBody::Nonhost(body) => body,
                 };
-                for i in 0..body.public_matches_count {
-                    write_i64_le(&mut bytes, body.public_matches[i].color as i64);
-                    write_i64_le(&mut bytes, body.public_matches[i].clock as i64);
-                    write_i64_le(&mut bytes, body.public_matches[i].variant as i64);
-                    write_i64_le(&mut bytes, body.public_matches[i].passcode);
-                }
-                for _ in body.public_matches_count..13 {
-                    for _ in 0..4 {
-                        write_i64_le(&mut bytes, 0);
-                    }
-                }
-                write_u64_le(&mut bytes, body.public_matches_count as u64);
-                for i in 0..body.server_history_matches_count {
-                    write_i64_le(&mut bytes, body.server_history_matches[i].state as i64);
-                    write_i64_le(&mut bytes, body.server_history_matches[i].clock as i64);
-                    write_i64_le(&mut bytes, body.server_history_matches[i].variant as i64);
-                    write_i64_le(&mut bytes, body.server_history_matches[i].visibility as i64);
-                    write_u64_le(&mut bytes, body.server_history_matches[i].seconds_passed);
+                // 13 public matches of 4 fields from field 6, unused ones left zeroed
+                for (i, m) in body.public_matches[..body.public_matches_count]
+                    .iter()
+                    .enumerate()
+                {
+                    let field = 6 + i * 4;
+                    put_field(frame, field, m.color as i64);
+                    put_field(frame, field + 1, m.clock as i64);
+                    put_field(frame, field + 2, m.variant as i64);
+                    put_field(frame, field + 3, m.passcode);
                 }
-                for _ in body.server_history_matches_count..13 {
-                    for _ in 0..5 {
-                        write_i64_le(&mut bytes, 0);
-                    }
+                put_field(frame, 58, body.public_matches_count as i64);
+                // 13 server history matches of 5 fields from field 59
+                for (i, m) in body.server_history_matches[..body.server_history_matches_count]
+                    .iter()
+                    .enumerate()
+                {
+                    let field = 59 + i * 5;
+                    put_field(frame, field, m.state as i64);
+                    put_field(frame, field + 1, m.clock as i64);
+                    put_field(frame, field + 2, m.variant as i64);
+                    put_field(frame, field + 3, m.visibility as i64);
+                    put_field(frame, field + 4, m.seconds_passed as i64);
                 }
-                write_u64_le(&mut bytes, body.server_history_matches_count as u64);
+                put_field(frame, 124, body.server_history_matches_count as i64);
             }
             _ => {
                 return err_invalid_data!(
@@ -550,22 +572,16 @@ impl Message {
                 );
             }
         };
-
-        // check message length
-        if bytes.len() != self.legal_length() {
-            return err_invalid_data!(
-                "Message of type {:?} should be of length {}, not {}.",
-                self.message_type(),
-                self.legal_length(),
-                bytes.len()
-            );
-        }
-        Ok(bytes.into())
+        Ok(bytes.freeze())
     }
 
-    pub fn unpack(mut bytes: BytesMut) -> Result<Message> {
+    // unpack a frame without its length field, fields are read in place at their fixed offsets
+    pub fn unpack(bytes: &[u8]) -> Result<Message> {
         let length = bytes.len();
-        let message_type: MessageType = try_i64_to_enum(read_i64_le(&mut bytes))?;
+        if length < 8 {
+            return err_invalid_data!("Message of length {} has no type.", length);
+        }
+        let message_type: MessageType = try_i64_to_enum(LittleEndian::read_i64(&bytes[0..8]))?;
 
         // check message length
         if length != message_type.legal_length() {
@@ -576,31 +592,23 @@ impl Message {
                 length
             );
         }
+        let field = |i: usize| get_field(bytes, i);
 
         match message_type {
-            MessageType::C2SGreet => {
-                let version1 = read_i64_le(&mut bytes);
-                let version2 = read_i64_le(&mut bytes);
-                Ok(Message::C2SGreet(C2SGreetBody { version1, version2 }))
-            }
+            MessageType::C2SGreet => Ok(Message::C2SGreet(C2SGreetBody {
+                version1: field(0),
+                version2: field(1),
+            })),
             MessageType::C2SMatchCreateOrJoin => {
-                let color = read_i64_le(&mut bytes);
-                let clock = read_i64_le(&mut bytes);
-                let variant = read_i64_le(&mut bytes);
-                let visibility = read_i64_le(&mut bytes);
-                let passcode = read_i64_le(&mut bytes);
+                let passcode = field(4);
                 if passcode < 0 {
                     // create match
-                    let color = try_i64_to_enum(color)?;
-                    let clock = try_i64_to_enum(clock)?;
-                    let variant = try_i64_to_enum(variant)?;
-                    let visibility = try_i64_to_enum(visibility)?;
                     Ok(Message::C2SMatchCreateOrJoin(
                         C2SMatchCreateOrJoinBody::Create(MatchSettings {
-                            color,
-                            clock,
-                            variant,
-                            visibility,
+                            color: try_i64_to_enum(field(0))?,
+                            clock: try_i64_to_enum(field(1))?,
+                            variant: try_i64_to_enum(field(2))?,
+                            visibility: try_i64_to_enum(field(3))?,
                             passcode,
                             match_id: -1,
                         }),
@@ -614,95 +622,428 @@ impl Message {
             }
             MessageType::C2SMatchCancel => Ok(Message::C2SMatchCancel),
             MessageType::C2SForfeit => Ok(Message::C2SForfeit),
-            MessageType::C2SOrS2CAction => {
-                let action_type = try_i64_to_enum(read_i64_le(&mut bytes))?;
-                let color = try_i64_to_enum(read_i64_le(&mut bytes))?;
-                let seconds_passed = read_u64_le(&mut bytes);
-                let src_l = read_i64_le(&mut bytes);
-                let src_t = read_i64_le(&mut bytes);
-                let src_board_color = try_i64_to_enum(read_i64_le(&mut bytes))?;
-                let src_y = read_i64_le(&mut bytes);
-                let src_x = read_i64_le(&mut bytes);
-                let dst_l = read_i64_le(&mut bytes);
-                let dst_t = read_i64_le(&mut bytes);
-                let dst_board_color = try_i64_to_enum(read_i64_le(&mut bytes))?;
-                let dst_y = read_i64_le(&mut bytes);
-                let dst_x = read_i64_le(&mut bytes);
-                Ok(Message::C2SOrS2CAction(C2SOrS2CActionBody {
-                    action_type,
-                    color,
-                    seconds_passed,
-                    src_l,
-                    src_t,
-                    src_board_color,
-                    src_y,
-                    src_x,
-                    dst_l,
-                    dst_t,
-                    dst_board_color,
-                    dst_y,
-                    dst_x,
-                }))
-            }
+            MessageType::C2SOrS2CAction => Ok(Message::C2SOrS2CAction(C2SOrS2CActionBody {
+                action_type: try_i64_to_enum(field(0))?,
+                color: try_i64_to_enum(field(1))?,
+                seconds_passed: field(2) as u64,
+                src_l: field(3),
+                src_t: field(4),
+                src_board_color: try_i64_to_enum(field(5))?,
+                src_y: field(6),
+                src_x: field(7),
+                dst_l: field(8),
+                dst_t: field(9),
+                dst_board_color: try_i64_to_enum(field(10))?,
+                dst_y: field(11),
+                dst_x: field(12),
+            })),
             MessageType::C2SMatchListRequest => Ok(Message::C2SMatchListRequest),
             _ => err_invalid_data!("Message type {:?} shouldn't be unpacked.", message_type),
         }
     }
 }
 
+// i-th 8 byte field after the type of a frame without its length field
+fn put_field(body: &mut [u8], i: usize, v: i64) {
+    let offset = 8 + i * 8;
+    LittleEndian::write_i64(&mut body[offset..offset + 8], v);
+}
+
+fn get_field(body: &[u8], i: usize) -> i64 {
+    let offset = 8 + i * 8;
+    LittleEndian::read_i64(&body[offset..offset + 8])
+}
+
+const WRITE_ARENA_SIZE: usize = 64 * 1024;
+
+thread_local! {
+    static WRITE_ARENA: RefCell<BytesMut> = RefCell::new(BytesMut::new());
+}
+
+/* zeroed buffer of exactly length bytes carved from the arena of the thread,
+frames share the allocation of their arena chunk, which is freed once all of them are */
+fn frame_buffer(length: usize) -> BytesMut {
+    if length > WRITE_ARENA_SIZE / 4 {
+        return BytesMut::zeroed(length);
+    }
+    WRITE_ARENA.with(|arena| {
+        let mut arena = arena.borrow_mut();
+        if arena.capacity() < length {
+            *arena = BytesMut::with_capacity(WRITE_ARENA_SIZE);
+        }
+        arena.resize(length, 0);
+        arena.split_to(length)
+    })
+}
+
+const WRITE_SLICES_MAX: usize = 64;
+const READ_BUFFER_SIZE: usize = 1024; // holds a burst of C2S frames, grown for longer frames
+const READ_BUFFER_POOL_MAX: usize = 256; // free read buffers kept per thread
+
+static NEXT_CONNECTION: AtomicU32 = AtomicU32::new(1);
+
+thread_local! {
+    static READ_BUFFERS: RefCell<Vec<BytesMut>> = const { RefCell::new(Vec::new()) };
+}
+
+// socket of a connection, served by the tokio reactor or by the io_uring of its shard
+#[derive(Debug)]
+enum Stream {
+    Tokio(OwnedReadHalf, OwnedWriteHalf),
+    #[cfg(target_os = "linux")]
+    Uring(uring::Socket),
+}
+
+impl Stream {
+    async fn readable(&self) -> Result<()> {
+        match self {
+            Stream::Tokio(reader, _) => reader.readable().await,
+            #[cfg(target_os = "linux")]
+            Stream::Uring(socket) => socket.readable().await,
+        }
+    }
+
+    fn try_read_buf(&self, buffer: &mut BytesMut) -> Result<usize> {
+        match self {
+            Stream::Tokio(reader, _) => reader.try_read_buf(buffer),
+            #[cfg(target_os = "linux")]
+            Stream::Uring(socket) => socket.try_read_buf(buffer),
+        }
+    }
+}
+
+/* reads length delimited frames, a connection holds a read buffer only while a frame is
+partially received, idle connections wait for readiness without one.
+Buffers come from a per-thread free list and go back to it as soon as they are drained,
+frames are unpacked in place from the buffer. */
+#[derive(Debug)]
+struct FrameReader {
+    buffer: Option<BytesMut>,
+    consumed: usize, // length of the frame returned last, still at the front of the buffer
+    limiter: Option<Box<Limiter>>,
+}
+
+impl FrameReader {
+    fn take_buffer() -> BytesMut {
+        let mut buffer = READ_BUFFERS
+            .with(|buffers| buffers.borrow_mut().pop())
+            .unwrap_or_default();
+        buffer.reserve(READ_BUFFER_SIZE);
+        buffer
+    }
+
+    fn give_buffer(mut buffer: BytesMut) {
+        if buffer.capacity() > 2 * READ_BUFFER_SIZE {
+            return;
+        }
+        buffer.clear();
+        READ_BUFFERS.with(|buffers| {
+            let mut buffers = buffers.borrow_mut();
+            if buffers.len() < READ_BUFFER_POOL_MAX {
+                buffers.push(buffer);
+            }
+        });
+    }
+
+    // length of the whole frame at the front of the buffer, None until it is received
+    fn ready(&mut self) -> Result<Option<usize>> {
+        let buffer = match self.buffer.as_mut() {
+            Some(buffer) if buffer.len() >= 8 => buffer,
+            _ => return Ok(None),
+        };
+        let length = LittleEndian::read_u64(&buffer[..8]) as usize;
+        if length > MESSAGE_LENGTH_MAX {
+            return err_invalid_data!("Frame of length {} is too long.", length);
+        }
+        if buffer.len() < 8 + length {
+            buffer.reserve(8 + length - buffer.len());
+            return Ok(None);
+        }
+        Ok(Some(8 + length))
+    }
+
+    // drop the frame returned last, the buffer goes back to the free list once drained
+    fn consume(&mut self) {
+        if self.consumed == 0 {
+            return;
+        }
+        let buffer = self.buffer.as_mut().unwrap();
+        buffer.advance(self.consumed);
+        self.consumed = 0;
+        if buffer.is_empty() {
+            Self::give_buffer(self.buffer.take().unwrap());
+        }
+    }
+
+    /* next frame without its length field, borrowed from the buffer until the next call.
+    Cancel safe, nothing is lost when dropped while waiting for readiness or a rate limit. */
+    async fn next(&mut self, stream: &Stream) -> Option<Result<&[u8]>> {
+        self.consume();
+        loop {
+            match self.ready() {
+                Ok(Some(length)) => {
+                    // held back in the buffer while over its rate limit
+                    if let Some(limiter) = self.limiter.as_mut() {
+                        let kind = type_kind(&self.buffer.as_ref().unwrap()[8..length]);
+                        match limiter.check(kind) {
+                            Ok(None) => {}
+                            Ok(Some(due)) => {
+                                sleep_until(due).await;
+                                continue;
+                            }
+                            Err(e) => return Some(Err(e)),
+                        }
+                    }
+                    self.consumed = length;
+                    return Some(Ok(&self.buffer.as_ref().unwrap()[8..length]));
+                }
+                Ok(None) => {}
+                Err(e) => return Some(Err(e)),
+            }
+            if let Err(e) = stream.readable().await {
+                return Some(Err(e));
+            }
+            let mut buffer = self.buffer.take().unwrap_or_else(Self::take_buffer);
+            buffer.reserve(1);
+            match stream.try_read_buf(&mut buffer) {
+                Ok(0) if buffer.is_empty() => {
+                    Self::give_buffer(buffer);
+                    return None;
+                }
+                Ok(0) => {
+                    return Some(Err(Error::new(
+                        ErrorKind::UnexpectedEof,
+                        "Disconnected in the middle of a frame.",
+                    )))
+                }
+                Ok(_) => self.buffer = Some(buffer),
+                Err(e) if e.kind() == ErrorKind::WouldBlock => {
+                    if buffer.is_empty() {
+                        Self::give_buffer(buffer);
+                    } else {
+                        self.buffer = Some(buffer);
+                    }
+                }
+                Err(e) => return Some(Err(e)),
+            }
+        }
+    }
+}
+
+impl Drop for FrameReader {
+    fn drop(&mut self) {
+        if let Some(buffer) = self.buffer.take() {
+            Self::give_buffer(buffer);
+        }
+    }
+}
+
+/* reads frames through a pooled frame reader,
+writes queued frames with vectored I/O so that several frames go out in one syscall */
 #[derive(Debug)]
 pub struct MessageIO {
-    framed: Framed<TcpStream, LengthDelimitedCodec>,
+    connection: u32, // id unique during a run, 0 is never used
+    reader: FrameReader,
+    stream: Stream,
+    pending: VecDeque<Bytes>, // frames including the length field
+    urgent: bool,             // a pending frame belongs to a match and should not wait
+}
+
+// replies in the lobby, which may wait a little for more frames to share their write
+fn lobby_kind(kind: usize) -> bool {
+    matches!(
+        try_i64_to_enum::<MessageType>(kind as i64).ok(),
+        Some(
+            MessageType::S2CGreet
+                | MessageType::S2CMatchCreateOrJoinResult
+                | MessageType::S2CMatchCancelResult
+                | MessageType::S2CMatchList
+        )
+    )
 }
 
 impl MessageIO {
-    pub fn new(stream: TcpStream) -> Self {
+    fn with_stream(stream: Stream) -> Self {
         MessageIO {
-            framed: LengthDelimitedCodec::builder()
-                .little_endian()
-                .length_field_type::<u64>()
-                .max_frame_length(MESSAGE_LENGTH_MAX)
-                .new_framed(stream),
+            connection: NEXT_CONNECTION.fetch_add(1, Ordering::Relaxed),
+            reader: FrameReader {
+                buffer: None,
+                consumed: 0,
+                limiter: None,
+            },
+            stream,
+            pending: VecDeque::new(),
+            urgent: false,
         }
     }
 
-    pub async fn get(&mut self) -> Result<Message> {
-        match self.framed.next().await {
-            Some(Ok(msg)) => match Message::unpack(msg) {
-                Ok(msg) => {
-                    trace!("Get {:?}", msg);
-                    Ok(msg)
+    pub fn new(stream: TcpStream) -> Self {
+        let (reader, writer) = stream.into_split();
+        Self::with_stream(Stream::Tokio(reader, writer))
+    }
+
+    // connection on the io_uring of the calling shard
+    #[cfg(target_os = "linux")]
+    pub fn new_uring(socket: uring::Socket) -> Self {
+        Self::with_stream(Stream::Uring(socket))
+    }
+
+    // throttle and shed the client by the limits from now on
+    pub fn limit(&mut self, limits: RateLimits, addr: SocketAddr) {
+        self.reader.limiter = limits
+            .enabled()
+            .then(|| Box::new(Limiter::new(limits, self.connection, addr)));
+    }
+
+    fn unpack(connection: u32, frame: Option<Result<&[u8]>>) -> Result<Message> {
+        match frame {
+            Some(Ok(msg)) => {
+                METRICS.frame_in(type_kind(msg), 8 + msg.len());
+                if capture::enabled() {
+                    capture::record(connection, Direction::C2S, Bytes::copy_from_slice(msg));
                 }
-                Err(e) => Err(e),
-            },
+                match Message::unpack(msg) {
+                    Ok(msg) => {
+                        trace!("Get {:?}", msg);
+                        Ok(msg)
+                    }
+                    Err(e) => Err(e),
+                }
+            }
             Some(Err(e)) => Err(e),
             None => err_disconnected!(),
         }
     }
 
-    pub async fn put(&mut self, msg: Message) -> Result<()> {
+    pub async fn get(&mut self) -> Result<Message> {
+        Self::unpack(self.connection, self.reader.next(&self.stream).await)
+    }
+
+    // message already received and buffered, None if getting one would wait
+    pub fn try_get(&mut self) -> Option<Result<Message>> {
+        let connection = self.connection;
+        self.reader
+            .next(&self.stream)
+            .now_or_never()
+            .map(|frame| Self::unpack(connection, frame))
+    }
+
+    pub fn put(&mut self, msg: Message) -> Result<()> {
         trace!("Put {:?}", msg);
-        match msg.pack() {
-            Ok(msg) => self.framed.feed(msg).await,
-            Err(e) => Err(e),
-        }
+        let frame = msg.pack_frame()?;
+        METRICS.frame_out(msg.message_type() as usize, frame.len());
+        capture::record(self.connection, Direction::S2C, frame.slice(8..));
+        self.urgent |= !lobby_kind(msg.message_type() as usize);
+        self.pending.push_back(frame);
+        Ok(())
+    }
+
+    // put a frame packed in advance, e.g. a cached match list or an action shared with the peer
+    pub fn put_packed(&mut self, frame: Bytes) -> Result<()> {
+        trace!("Put packed {} bytes", frame.len());
+        let kind = type_kind(&frame[8..]);
+        METRICS.frame_out(kind, frame.len());
+        capture::record(self.connection, Direction::S2C, frame.slice(8..));
+        self.urgent |= !lobby_kind(kind);
+        self.pending.push_back(frame);
+        Ok(())
+    }
+
+    // frames queued and not yet flushed
+    pub fn queued(&self) -> bool {
+        !self.pending.is_empty()
+    }
+
+    pub fn urgent(&self) -> bool {
+        self.urgent
     }
 
     pub async fn flush(&mut self) -> Result<()> {
-        self.framed.flush().await
+        if self.pending.is_empty() {
+            return Ok(());
+        }
+        let start = Instant::now();
+        match &mut self.stream {
+            Stream::Tokio(_, writer) => write_frames(writer, &mut self.pending).await?,
+            #[cfg(target_os = "linux")]
+            Stream::Uring(socket) => socket.write_frames(&mut self.pending).await?,
+        }
+        // a burst may have grown the queue, idle connections keep a small one
+        if self.pending.capacity() > WRITE_SLICES_MAX {
+            self.pending.shrink_to(WRITE_SLICES_MAX);
+        }
+        self.urgent = false;
+        METRICS.flush_time(start.elapsed());
+        Ok(())
     }
 
-    pub async fn close(mut self) -> Result<()> {
-        self.framed.close().await
+    // flushed halves of the stream and what was received after the last frame read, for relaying
+    pub async fn splice_parts(
+        &mut self,
+    ) -> Result<(BytesMut, &mut OwnedReadHalf, &mut OwnedWriteHalf)> {
+        self.flush().await?;
+        self.reader.consume();
+        let mut buffered = match self.reader.buffer.take() {
+            Some(buffer) => {
+                let buffered = BytesMut::from(&buffer[..]);
+                FrameReader::give_buffer(buffer);
+                buffered
+            }
+            None => BytesMut::new(),
+        };
+        // relaying goes through the reactor, the socket leaves the ring with what it received
+        #[cfg(target_os = "linux")]
+        if let Stream::Uring(socket) = &mut self.stream {
+            let (stream, received) = socket.detach().await?;
+            buffered.extend_from_slice(&received);
+            stream.set_nonblocking(true)?;
+            let (reader, writer) = TcpStream::from_std(stream)?.into_split();
+            self.stream = Stream::Tokio(reader, writer);
+        }
+        match &mut self.stream {
+            Stream::Tokio(reader, writer) => Ok((buffered, reader, writer)),
+            #[cfg(target_os = "linux")]
+            Stream::Uring(_) => unreachable!(),
+        }
     }
-}
 
-pub fn read_i64_le(bytes: &mut BytesMut) -> i64 {
-    LittleEndian::read_i64(&bytes.split_to(8)[..])
+    pub async fn close(mut self) -> Result<()> {
+        self.flush().await?;
+        match &mut self.stream {
+            Stream::Tokio(_, writer) => writer.shutdown().await,
+            #[cfg(target_os = "linux")]
+            Stream::Uring(socket) => socket.shutdown().await,
+        }
+    }
 }
 
-pub fn read_u64_le(bytes: &mut BytesMut) -> u64 {
-    LittleEndian::read_u64(&bytes.split_to(8)[..])
+// write whole frames with as few syscalls as possible, written frames are popped
+pub async fn write_frames<W: AsyncWrite + Unpin>(
+    writer: &mut W,
+    pending: &mut VecDeque<Bytes>,
+) -> Result<()> {
+    while !pending.is_empty() {
+        let mut slices = [IoSlice::new(&[]); WRITE_SLICES_MAX];
+        let count = pending.len().min(WRITE_SLICES_MAX);
+        for (slice, frame) in slices.iter_mut().zip(pending.iter()) {
+            *slice = IoSlice::new(frame);
+        }
+        let mut written = writer.write_vectored(&slices[..count]).await?;
+        if written == 0 {
+            return Err(Error::new(ErrorKind::WriteZero, "Failed to write frame."));
+        }
+        while written > 0 {
+            let frame = pending.front_mut().unwrap();
+            if written >= frame.len() {
+                written -= frame.len();
+                pending.pop_front();
+            } else {
+                frame.advance(written);
+                written = 0;
+            }
+        }
+    }
+    Ok(())
 }
 
 pub fn write_i64_le(bytes: &mut BytesMut, n: i64) {
@@ -727,19 +1068,3 @@ pub fn try_i64_to_enum<T: num::FromPrimitive>(v: i64) -> Result<T> {
         ),
     }
 }
-
-pub fn generate_random_passcode_internal() -> Passcode {
-    rand::thread_rng().gen_range(0..=2985983) // kkkkkk = 2985983
-}
-
-pub async fn generate_random_passcode_internal_with_exceptions(
-    exceptions: &Mutex<HashMap<Passcode, broadcast::Receiver<Message>>>,
-) -> Passcode {
-    let exceptions = exceptions.lock().await;
-    loop {
-        let passcode = generate_random_passcode_internal();
-        if !exceptions.contains_key(&passcode) {
-            return passcode;
-        }
-    }
-}
@@ -0,0 +1,523 @@
+use std::collections::VecDeque;
+use std::io::Result;
+
+use crate::datatype::*;
+
+/* multiverse of a match, replayed from its actions to reject moves no client could make.
+Every connection of a match keeps its own replica, its client's actions are checked
+and applied, relayed actions of the peer were checked on the other side and are applied.
+Moves are checked for pseudo-legality only: the board is playable, the piece belongs to
+the player and moves along its 4D pattern to an existing board of the same color,
+sliders don't jump over pieces or missing boards, and nothing captures its own side.
+Whether a king is left in check is judged by the clients, as before.
+
+Conventions of the coordinates, as far as they are known:
+y = 0 is the back rank of white, x = 0 is the a-file,
+a board is identified by (L, T, color) with L = 0 the starting timeline,
+timelines created by white get L > 0 and by black L < 0,
+pawns move forward along L towards the timelines of the opponent.
+Boards of a timeline are stored contiguously by half turn h = 2 * T + color,
+a move only ever appends boards, so undo pops what the move appended. */
+
+const BLACK: u8 = 0x80; // square holds a black piece, the low bits are the piece
+const EMPTY: u8 = 0;
+const PAWN: u8 = 1;
+const KNIGHT: u8 = 2;
+const BISHOP: u8 = 3;
+const ROOK: u8 = 4;
+const QUEEN: u8 = 5;
+const KING: u8 = 6;
+const UNICORN: u8 = 7;
+const DRAGON: u8 = 8;
+const PRINCESS: u8 = 9;
+
+const BOARD_SIZE_MAX: usize = 8;
+
+#[derive(Debug, Clone)]
+struct Board {
+    squares: [u8; BOARD_SIZE_MAX * BOARD_SIZE_MAX], // y * BOARD_SIZE_MAX + x
+    unmoved: u64,                                   // pieces that may still castle or double step
+}
+
+impl Board {
+    fn at(&self, x: i64, y: i64) -> u8 {
+        self.squares[y as usize * BOARD_SIZE_MAX + x as usize]
+    }
+
+    fn set(&mut self, x: i64, y: i64, square: u8) {
+        let i = y as usize * BOARD_SIZE_MAX + x as usize;
+        self.squares[i] = square;
+        self.unmoved &= !(1 << i);
+    }
+
+    fn is_unmoved(&self, x: i64, y: i64) -> bool {
+        self.unmoved & (1 << (y as usize * BOARD_SIZE_MAX + x as usize)) != 0
+    }
+}
+
+#[derive(Debug, Clone)]
+struct Timeline {
+    start: i64, // half turn of its first board
+    boards: Vec<Board>,
+}
+
+impl Timeline {
+    fn get(&self, h: i64) -> Option<&Board> {
+        self.boards
+            .get(usize::try_from(h.checked_sub(self.start)?).ok()?)
+    }
+
+    fn present(&self) -> i64 {
+        self.start + self.boards.len() as i64 - 1
+    }
+}
+
+// what a move appended, undone in reverse order
+#[derive(Debug, Copy, Clone)]
+enum Change {
+    Appended(i64), // a board to the timeline L
+    Created(i64),  // the timeline L
+}
+
+#[derive(Debug, Copy, Clone)]
+struct Position {
+    x: i64,
+    y: i64,
+    t: i64,
+    l: i64,
+}
+
+#[derive(Debug, Clone)]
+pub struct Game {
+    width: i64,
+    height: i64,
+    first: Board, // starting board of white on L = 0
+    start: i64,   // half turn of the starting board
+    timelines: VecDeque<Timeline>,
+    min_l: i64,    // L of timelines[0]
+    player: Color, // of our client
+    to_move: Color,
+    moves: Vec<Vec<Change>>, // moves of the current turn
+}
+
+// back rank of white from the a-file, black mirrors it
+const STANDARD_BACK_RANK: [u8; 8] = [ROOK, KNIGHT, BISHOP, QUEEN, KING, BISHOP, KNIGHT, ROOK];
+
+impl Game {
+    // starting position of a variant, None when it isn't known and the match is not checked
+    pub fn new(variant: Variant, player: Color) -> Option<Self> {
+        let (width, height, back_rank) = match variant {
+            Variant::Standard => (8, 8, STANDARD_BACK_RANK),
+            _ => return None,
+        };
+        let mut first = Board {
+            squares: [EMPTY; BOARD_SIZE_MAX * BOARD_SIZE_MAX],
+            unmoved: 0,
+        };
+        for x in 0..width {
+            first.set(x, 0, back_rank[x as usize]);
+            first.set(x, 1, PAWN);
+            first.set(x, height - 2, PAWN | BLACK);
+            first.set(x, height - 1, back_rank[x as usize] | BLACK);
+        }
+        first.unmoved = (0..width)
+            .flat_map(|x| [(x, 0), (x, 1), (x, height - 2), (x, height - 1)])
+            .fold(0, |unmoved, (x, y)| {
+                unmoved | 1 << (y as usize * BOARD_SIZE_MAX + x as usize)
+            });
+        let start = 2; // T = 1, white
+        Some(Game {
+            width,
+            height,
+            first: first.clone(),
+            start,
+            timelines: VecDeque::from([Timeline {
+                start,
+                boards: vec![first],
+            }]),
+            min_l: 0,
+            player,
+            to_move: Color::White,
+            moves: Vec::new(),
+        })
+    }
+
+    fn reset(&mut self) {
+        self.timelines = VecDeque::from([Timeline {
+            start: self.start,
+            boards: vec![self.first.clone()],
+        }]);
+        self.min_l = 0;
+        self.to_move = Color::White;
+        self.moves.clear();
+    }
+
+    fn max_l(&self) -> i64 {
+        self.min_l + self.timelines.len() as i64 - 1
+    }
+
+    fn timeline(&self, l: i64) -> Option<&Timeline> {
+        self.timelines
+            .get(usize::try_from(l.checked_sub(self.min_l)?).ok()?)
+    }
+
+    fn timeline_mut(&mut self, l: i64) -> &mut Timeline {
+        &mut self.timelines[(l - self.min_l) as usize]
+    }
+
+    fn board(&self, l: i64, t: i64, color: Color) -> Option<&Board> {
+        self.timeline(l)?.get(t.checked_mul(2)? + color as i64)
+    }
+
+    fn in_bounds(&self, x: i64, y: i64) -> bool {
+        x >= 0 && x < self.width && y >= 0 && y < self.height
+    }
+
+    // square at a 4D position on a board of the given color, None if there is no such board
+    fn square(&self, p: Position, color: Color) -> Option<u8> {
+        if !self.in_bounds(p.x, p.y) {
+            return None;
+        }
+        Some(self.board(p.l, p.t, color)?.at(p.x, p.y))
+    }
+
+    /* apply an action, checked if it comes from our client.
+    Actions that don't change the multiverse always pass. */
+    pub fn apply(&mut self, a: &C2SOrS2CActionBody, check: bool) -> Result<()> {
+        let changes = matches!(
+            a.action_type,
+            ActionType::Move | ActionType::UndoMove | ActionType::SubmitMoves
+        );
+        if check && changes && a.color != self.player {
+            return err_invalid_data!("Action for {:?} sent by {:?}.", a.color, self.player);
+        }
+        match a.action_type {
+            ActionType::Move => self.apply_move(a, check),
+            ActionType::UndoMove => {
+                if check && a.color != self.to_move {
+                    return err_invalid_data!("{:?} undid a move out of turn.", a.color);
+                }
+                match self.moves.pop() {
+                    Some(changes) => {
+                        self.undo(&changes);
+                        Ok(())
+                    }
+                    None if check => err_invalid_data!("No move to undo."),
+                    None => Ok(()),
+                }
+            }
+            ActionType::SubmitMoves => {
+                if check && a.color != self.to_move {
+                    return err_invalid_data!("{:?} submitted out of turn.", a.color);
+                }
+                self.to_move = other(self.to_move);
+                self.moves.clear();
+                Ok(())
+            }
+            ActionType::ResetPuzzle => {
+                self.reset();
+                Ok(())
+            }
+            ActionType::DisplayCheckReason | ActionType::Header => Ok(()),
+        }
+    }
+
+    fn undo(&mut self, changes: &[Change]) {
+        for change in changes.iter().rev() {
+            match *change {
+                Change::Appended(l) => {
+                    self.timeline_mut(l).boards.pop();
+                }
+                Change::Created(l) if l == self.min_l => {
+                    self.timelines.pop_front();
+                    self.min_l += 1;
+                }
+                Change::Created(_) => {
+                    self.timelines.pop_back();
+                }
+            }
+        }
+    }
+
+    fn apply_move(&mut self, a: &C2SOrS2CActionBody, check: bool) -> Result<()> {
+        let color = a.color;
+        let src = Position {
+            x: a.src_x,
+            y: a.src_y,
+            t: a.src_t,
+            l: a.src_l,
+        };
+        let dst = Position {
+            x: a.dst_x,
+            y: a.dst_y,
+            t: a.dst_t,
+            l: a.dst_l,
+        };
+        if check {
+            self.check_move(a, src, dst)?;
+        }
+        // relayed moves are not checked, but never index outside of the boards
+        if !self.in_bounds(src.x, src.y) || !self.in_bounds(dst.x, dst.y) {
+            return err_invalid_data!("Move off the board.");
+        }
+        let (src_board, dst_board) = match (
+            self.board(src.l, src.t, color),
+            self.board(dst.l, dst.t, color),
+        ) {
+            (Some(src_board), Some(dst_board)) => (src_board, dst_board),
+            _ => return err_invalid_data!("Move between missing boards."),
+        };
+        let dst_h = 2 * dst.t + color as i64;
+        let piece = src_board.at(src.x, src.y);
+        let forward = if color == Color::White { 1 } else { -1 };
+        let last_rank = if color == Color::White {
+            self.height - 1
+        } else {
+            0
+        };
+        let arrived = if piece & !BLACK == PAWN && dst.y == last_rank {
+            QUEEN | (piece & BLACK)
+        } else {
+            piece
+        };
+
+        let mut changes = Vec::with_capacity(2);
+        if src.l == dst.l && src.t == dst.t {
+            let mut board = src_board.clone();
+            board.set(src.x, src.y, EMPTY);
+            if piece & !BLACK == PAWN
+                && src.x != dst.x
+                && src_board.at(dst.x, dst.y) == EMPTY
+                && self.in_bounds(dst.x, dst.y - forward)
+            {
+                // en passant
+                board.set(dst.x, dst.y - forward, EMPTY);
+            }
+            if piece & !BLACK == KING && (dst.x - src.x).abs() == 2 {
+                // castling, the rook lands on the square the king passed
+                let rook_x = if dst.x > src.x { self.width - 1 } else { 0 };
+                let rook = board.at(rook_x, src.y);
+                board.set(rook_x, src.y, EMPTY);
+                board.set((src.x + dst.x) / 2, src.y, rook);
+            }
+            board.set(dst.x, dst.y, arrived);
+            self.timeline_mut(src.l).boards.push(board);
+            changes.push(Change::Appended(src.l));
+        } else {
+            let mut left = src_board.clone();
+            left.set(src.x, src.y, EMPTY);
+            let mut board = dst_board.clone();
+            board.set(dst.x, dst.y, arrived);
+            let dst_present = self.timeline(dst.l).unwrap().present();
+            self.timeline_mut(src.l).boards.push(left);
+            changes.push(Change::Appended(src.l));
+            if dst_h == dst_present && src.l != dst.l {
+                // the piece jumps to the present of another timeline
+                self.timeline_mut(dst.l).boards.push(board);
+                changes.push(Change::Appended(dst.l));
+            } else {
+                // travelling into the past branches a new timeline off the arrival board
+                let timeline = Timeline {
+                    start: dst_h + 1,
+                    boards: vec![board],
+                };
+                let l = if color == Color::White {
+                    self.timelines.push_back(timeline);
+                    self.max_l()
+                } else {
+                    self.timelines.push_front(timeline);
+                    self.min_l -= 1;
+                    self.min_l
+                };
+                changes.push(Change::Created(l));
+            }
+        }
+        self.moves.push(changes);
+        Ok(())
+    }
+
+    fn check_move(&self, a: &C2SOrS2CActionBody, src: Position, dst: Position) -> Result<()> {
+        let color = a.color;
+        if color != self.to_move {
+            return err_invalid_data!("{:?} moved out of turn.", color);
+        }
+        if a.src_board_color != color || a.dst_board_color != color {
+            return err_invalid_data!("{:?} moved on a board of the opponent.", color);
+        }
+        let timeline = match self.timeline(src.l) {
+            Some(timeline) => timeline,
+            None => return err_invalid_data!("Timeline {} doesn't exist.", src.l),
+        };
+        if src.t.checked_mul(2).map(|h| h + color as i64) != Some(timeline.present()) {
+            return err_invalid_data!("Board (L{} T{}) is not playable.", src.l, src.t);
+        }
+        let piece = match self.square(src, color) {
+            Some(piece) if piece != EMPTY && is_black(piece) == (color == Color::Black) => piece,
+            _ => {
+                return err_invalid_data!(
+                    "No piece of {:?} at (L{} T{} {} {}).",
+                    color,
+                    src.l,
+                    src.t,
+                    src.x,
+                    src.y
+                )
+            }
+        };
+        let target = match self.square(dst, color) {
+            Some(target) => target,
+            None => {
+                return err_invalid_data!(
+                    "(L{} T{} {} {}) is not on a board.",
+                    dst.l,
+                    dst.t,
+                    dst.x,
+                    dst.y
+                )
+            }
+        };
+        if target != EMPTY && is_black(target) == is_black(piece) {
+            return err_invalid_data!("{:?} captured its own piece.", color);
+        }
+        if self.reachable(piece, src, dst, target, color) {
+            Ok(())
+        } else {
+            err_invalid_data!(
+                "{} can't move from (L{} T{} {} {}) to (L{} T{} {} {}).",
+                name(piece),
+                src.l,
+                src.t,
+                src.x,
+                src.y,
+                dst.l,
+                dst.t,
+                dst.x,
+                dst.y
+            )
+        }
+    }
+
+    fn reachable(&self, piece: u8, src: Position, dst: Position, target: u8, color: Color) -> bool {
+        let d = [dst.x - src.x, dst.y - src.y, dst.t - src.t, dst.l - src.l];
+        if d == [0; 4] {
+            return false;
+        }
+        let axes = d.iter().filter(|c| **c != 0).count();
+        let steps = d.iter().map(|c| c.abs()).max().unwrap();
+        let straight = d.iter().all(|c| *c == 0 || c.abs() == steps);
+        match piece & !BLACK {
+            KNIGHT => {
+                let mut m = d.map(|c| c.abs());
+                m.sort_unstable();
+                m == [0, 0, 1, 2]
+            }
+            KING => {
+                if steps == 1 {
+                    return true;
+                }
+                self.castling(src, d, color)
+            }
+            ROOK => straight && axes == 1 && self.clear(src, d, steps, color),
+            BISHOP => straight && axes == 2 && self.clear(src, d, steps, color),
+            UNICORN => straight && axes == 3 && self.clear(src, d, steps, color),
+            DRAGON => straight && axes == 4 && self.clear(src, d, steps, color),
+            PRINCESS => straight && axes <= 2 && self.clear(src, d, steps, color),
+            QUEEN => straight && self.clear(src, d, steps, color),
+            PAWN => self.pawn(src, d, target, color),
+            _ => false,
+        }
+    }
+
+    // squares strictly between src and src + steps * direction are on boards and empty
+    fn clear(&self, src: Position, d: [i64; 4], steps: i64, color: Color) -> bool {
+        let u = d.map(|c| c.signum());
+        (1..steps).all(|k| {
+            let p = Position {
+                x: src.x + k * u[0],
+                y: src.y + k * u[1],
+                t: src.t + k * u[2],
+                l: src.l + k * u[3],
+            };
+            self.square(p, color) == Some(EMPTY)
+        })
+    }
+
+    fn pawn(&self, src: Position, d: [i64; 4], target: u8, color: Color) -> bool {
+        let forward = if color == Color::White { 1 } else { -1 };
+        let forward_l = -forward; // towards the timelines of the opponent
+        let board = self.board(src.l, src.t, color).unwrap();
+        let unmoved = board.is_unmoved(src.x, src.y);
+        let empty = target == EMPTY;
+        match d {
+            [0, y, 0, 0] if y == forward => empty,
+            [0, y, 0, 0] if y == 2 * forward => {
+                empty && unmoved && board.at(src.x, src.y + forward) == EMPTY
+            }
+            [0, 0, 0, l] if l == forward_l => empty,
+            [0, 0, 0, l] if l == 2 * forward_l => {
+                let passed = Position {
+                    l: src.l + forward_l,
+                    ..src
+                };
+                empty && unmoved && self.square(passed, color) == Some(EMPTY)
+            }
+            [x, y, 0, 0] if x.abs() == 1 && y == forward => {
+                !empty || self.en_passant(src, src.x + x, color)
+            }
+            [0, 0, t, l] if t.abs() == 1 && l == forward_l => !empty,
+            _ => false,
+        }
+    }
+
+    // the opponent pawn beside src double stepped on the previous half turn
+    fn en_passant(&self, src: Position, x: i64, color: Color) -> bool {
+        let forward = if color == Color::White { 1 } else { -1 };
+        let timeline = self.timeline(src.l).unwrap();
+        let h = 2 * src.t + color as i64;
+        let (now, before) = match (timeline.get(h), timeline.get(h - 1)) {
+            (Some(now), Some(before)) => (now, before),
+            _ => return false,
+        };
+        let pawn = PAWN | if color == Color::White { BLACK } else { 0 };
+        let from = src.y + 2 * forward;
+        self.in_bounds(x, from)
+            && now.at(x, src.y) == pawn
+            && now.at(x, from) == EMPTY
+            && before.at(x, from) == pawn
+            && before.at(x, src.y) == EMPTY
+            && before.is_unmoved(x, from)
+    }
+
+    // king steps two files towards an unmoved rook with nothing in between
+    fn castling(&self, src: Position, d: [i64; 4], color: Color) -> bool {
+        if d[1] != 0 || d[2] != 0 || d[3] != 0 || d[0].abs() != 2 {
+            return false;
+        }
+        let board = self.board(src.l, src.t, color).unwrap();
+        let rook_x = if d[0] > 0 { self.width - 1 } else { 0 };
+        let rook = ROOK | if color == Color::White { 0 } else { BLACK };
+        board.is_unmoved(src.x, src.y)
+            && board.at(rook_x, src.y) == rook
+            && board.is_unmoved(rook_x, src.y)
+            && (src.x.min(rook_x) + 1..src.x.max(rook_x)).all(|x| board.at(x, src.y) == EMPTY)
+    }
+}
+
+fn name(square: u8) -> &'static str {
+    const NAMES: [&str; 10] = [
+        "Empty", "Pawn", "Knight", "Bishop", "Rook", "Queen", "King", "Unicorn", "Dragon",
+        "Princess",
+    ];
+    NAMES.get((square & !BLACK) as usize).unwrap_or(&"Piece")
+}
+
+fn is_black(square: u8) -> bool {
+    square & BLACK != 0
+}
+
+fn other(color: Color) -> Color {
+    match color {
+        Color::White => Color::Black,
+        Color::Black => Color::White,
+    }
+}
@@ -0,0 +1,195 @@
+use std::io::{Error, ErrorKind, Result};
+use std::mem::{size_of, zeroed};
+use std::os::unix::io::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::io::{AsyncReadExt, AsyncWriteExt, Interest};
+use tokio::net::{UnixListener, UnixStream};
+use tokio::select;
+use tokio::sync::watch;
+use tokio::time::timeout;
+use tracing::{error, info};
+
+use crate::server::{advance, RunState};
+
+/* handover of the listeners to a successor process.
+A server started while another one with the same handover path runs receives the listening
+sockets of the running one over that unix socket instead of binding them,
+so both accept from the same queues and no connection is refused meanwhile.
+Once the successor is ready to accept it acknowledges, the running server drains then:
+it closes its listeners and the connections outside of a match and exits after the last match. */
+
+const LISTENERS_MAX: usize = 256; // one per shard
+const ACKNOWLEDGE_TIMEOUT: Duration = Duration::from_secs(10);
+
+// the running server, drains once it is released
+#[derive(Debug)]
+pub struct Predecessor {
+    stream: UnixStream,
+}
+
+impl Predecessor {
+    pub async fn release(mut self) -> Result<()> {
+        self.stream.write_all(&[1]).await
+    }
+}
+
+// listeners of the server running at path, None if no server runs there
+pub async fn take(path: &str) -> Result<Option<(Vec<std::net::TcpListener>, Predecessor)>> {
+    let stream = match UnixStream::connect(path).await {
+        Ok(stream) => stream,
+        Err(e) if matches!(e.kind(), ErrorKind::NotFound | ErrorKind::ConnectionRefused) => {
+            return Ok(None)
+        }
+        Err(e) => return Err(e),
+    };
+    let fd = stream.as_raw_fd();
+    let fds = loop {
+        stream.readable().await?;
+        match stream.try_io(Interest::READABLE, || unsafe { recv_fds(fd) }) {
+            Err(e) if e.kind() == ErrorKind::WouldBlock => continue,
+            result => break result?,
+        }
+    };
+    let listeners = fds.into_iter().map(std::net::TcpListener::from).collect();
+    Ok(Some((listeners, Predecessor { stream })))
+}
+
+// pass the listeners to the first successor acknowledging them and start draining,
+// or stop offering them once draining for another reason
+pub async fn serve(path: String, fds: Vec<RawFd>, running: Arc<watch::Sender<RunState>>) {
+    // left behind by a server that is gone, or by the predecessor, which has its listeners already
+    let _ = std::fs::remove_file(&path);
+    let listener = match UnixListener::bind(&path) {
+        Ok(listener) => listener,
+        Err(e) => {
+            error!("Failed to bind handover socket {}: {}", path, e);
+            return;
+        }
+    };
+    info!("handing over on {} ...", path);
+    let mut changed = running.subscribe();
+    loop {
+        let stream = select! {
+            result = listener.accept() => match result {
+                Ok((stream, _)) => stream,
+                Err(e) => {
+                    error!("Failed to accept handover: {}", e);
+                    continue;
+                }
+            },
+            _ = changed.changed() => {
+                let _ = std::fs::remove_file(&path);
+                return;
+            }
+        };
+        // the listeners are closed once draining
+        if *running.borrow() != RunState::Running {
+            return;
+        }
+        match hand_over(stream, &fds).await {
+            Ok(()) => {
+                if advance(&running, RunState::Draining) {
+                    info!("Handed over to a successor, draining ...");
+                }
+                return;
+            }
+            Err(e) => error!("Handover failed, still serving: {}", e),
+        }
+    }
+}
+
+async fn hand_over(mut stream: UnixStream, fds: &[RawFd]) -> Result<()> {
+    let fd = stream.as_raw_fd();
+    loop {
+        stream.writable().await?;
+        match stream.try_io(Interest::WRITABLE, || unsafe { send_fds(fd, fds) }) {
+            Err(e) if e.kind() == ErrorKind::WouldBlock => continue,
+            result => break result?,
+        }
+    }
+    // the successor closes without acknowledging if it can't use them
+    let mut acknowledge = [0];
+    match timeout(ACKNOWLEDGE_TIMEOUT, stream.read(&mut acknowledge)).await {
+        Ok(Ok(1)) => Ok(()),
+        Ok(Ok(_)) => Err(Error::new(
+            ErrorKind::UnexpectedEof,
+            "The successor closed without taking over.",
+        )),
+        Ok(Err(e)) => Err(e),
+        Err(_) => Err(Error::new(
+            ErrorKind::TimedOut,
+            "The successor did not take over in time.",
+        )),
+    }
+}
+
+// number of fds as a u32 with the fds themselves as SCM_RIGHTS
+unsafe fn send_fds(socket: RawFd, fds: &[RawFd]) -> Result<()> {
+    let mut count = (fds.len() as u32).to_le_bytes();
+    let mut iov = libc::iovec {
+        iov_base: count.as_mut_ptr() as *mut libc::c_void,
+        iov_len: count.len(),
+    };
+    let length = libc::CMSG_SPACE((fds.len() * size_of::<RawFd>()) as u32) as usize;
+    let mut control = vec![0u64; (length + 7) / 8]; // aligned for cmsghdr
+    let mut msg: libc::msghdr = zeroed();
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = length as _;
+    let cmsg = libc::CMSG_FIRSTHDR(&msg);
+    (*cmsg).cmsg_level = libc::SOL_SOCKET;
+    (*cmsg).cmsg_type = libc::SCM_RIGHTS;
+    (*cmsg).cmsg_len = libc::CMSG_LEN((fds.len() * size_of::<RawFd>()) as u32) as _;
+    std::ptr::copy_nonoverlapping(fds.as_ptr(), libc::CMSG_DATA(cmsg) as *mut RawFd, fds.len());
+    if libc::sendmsg(socket, &msg, 0) < 0 {
+        return Err(Error::last_os_error());
+    }
+    Ok(())
+}
+
+unsafe fn recv_fds(socket: RawFd) -> Result<Vec<OwnedFd>> {
+    let mut count = [0; 4];
+    let mut iov = libc::iovec {
+        iov_base: count.as_mut_ptr() as *mut libc::c_void,
+        iov_len: count.len(),
+    };
+    let length = libc::CMSG_SPACE((LISTENERS_MAX * size_of::<RawFd>()) as u32) as usize;
+    let mut control = vec![0u64; (length + 7) / 8];
+    let mut msg: libc::msghdr = zeroed();
+    msg.msg_iov = &mut iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.as_mut_ptr() as *mut libc::c_void;
+    msg.msg_controllen = length as _;
+    let received = libc::recvmsg(socket, &mut msg, 0);
+    if received < 0 {
+        return Err(Error::last_os_error());
+    }
+    // owned at once, so they are closed on any error below
+    let mut fds = Vec::new();
+    let mut cmsg = libc::CMSG_FIRSTHDR(&msg);
+    while !cmsg.is_null() {
+        if (*cmsg).cmsg_level == libc::SOL_SOCKET && (*cmsg).cmsg_type == libc::SCM_RIGHTS {
+            let data = libc::CMSG_DATA(cmsg) as *const RawFd;
+            let n = ((*cmsg).cmsg_len as usize - libc::CMSG_LEN(0) as usize) / size_of::<RawFd>();
+            for i in 0..n {
+                fds.push(OwnedFd::from_raw_fd(data.add(i).read_unaligned()));
+            }
+        }
+        cmsg = libc::CMSG_NXTHDR(&msg, cmsg);
+    }
+    if received != count.len() as isize {
+        return Err(Error::new(
+            ErrorKind::UnexpectedEof,
+            "The running server closed the handover.",
+        ));
+    }
+    if msg.msg_flags & libc::MSG_CTRUNC != 0 || fds.len() != u32::from_le_bytes(count) as usize {
+        return Err(Error::new(
+            ErrorKind::InvalidData,
+            "The running server handed over too many listeners.",
+        ));
+    }
+    Ok(fds)
+}
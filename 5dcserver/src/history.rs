@@ -0,0 +1,155 @@
+use std::hint::spin_loop;
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::time::Duration;
+use tokio::time::Instant;
+
+use crate::datatype::*;
+
+pub const HISTORY_LISTED: usize = 13; // server history matches in S2CMatchList
+
+const READ_RETRIES: usize = 64;
+
+// one entry of the ring, every field is an atomic so that torn reads are only ever stale
+#[derive(Debug)]
+struct Slot {
+    seq: AtomicU64,        // odd while the slot is written
+    entry: AtomicU64,      // ticket << 1 | completed, ticket 0 means never written
+    settings: AtomicU64,   // clock | variant << 16 | visibility << 32
+    time_start: AtomicU64, // nanoseconds since the epoch of the ring
+}
+
+/* server history matches, newest last, in a ring of fixed capacity.
+Tickets count inserted matches from 1, ticket t lives in slot t % capacity until capacity
+newer matches overwrite it. Writers take a slot with a per-slot seqlock, readers copy it
+and retry when the sequence changed meanwhile, so neither ever waits for a lock.
+Completion flips one bit of the entry with a single compare-and-swap on the ticket,
+which does nothing once the slot holds another match. */
+#[derive(Debug)]
+pub struct HistoryRing {
+    epoch: Instant,
+    head: AtomicU64, // ticket of the next insert
+    slots: Box<[Slot]>,
+}
+
+impl HistoryRing {
+    // at least the matches of one S2CMatchList are kept
+    pub fn new(capacity: usize) -> Self {
+        HistoryRing {
+            epoch: Instant::now(),
+            head: AtomicU64::new(1),
+            slots: (0..capacity.max(HISTORY_LISTED))
+                .map(|_| Slot {
+                    seq: AtomicU64::new(0),
+                    entry: AtomicU64::new(0),
+                    settings: AtomicU64::new(0),
+                    time_start: AtomicU64::new(0),
+                })
+                .collect(),
+        }
+    }
+
+    pub fn capacity(&self) -> usize {
+        self.slots.len()
+    }
+
+    fn slot(&self, ticket: HistoryTicket) -> &Slot {
+        &self.slots[(ticket % self.slots.len() as u64) as usize]
+    }
+
+    pub fn insert(&self, m: ServerHistoryMatch) -> HistoryTicket {
+        let ticket = self.head.fetch_add(1, Ordering::Relaxed);
+        let slot = self.slot(ticket);
+        // a writer a whole ring behind may still hold the slot
+        let mut seq = slot.seq.load(Ordering::Relaxed);
+        loop {
+            if seq & 1 == 1 {
+                spin_loop();
+                seq = slot.seq.load(Ordering::Relaxed);
+                continue;
+            }
+            match slot
+                .seq
+                .compare_exchange_weak(seq, seq + 1, Ordering::Relaxed, Ordering::Relaxed)
+            {
+                Ok(_) => break,
+                Err(actual) => seq = actual,
+            }
+        }
+        fence(Ordering::Release);
+        let completed = (m.state == HistoryMatchState::Completed) as u64;
+        slot.entry.store(ticket << 1 | completed, Ordering::Relaxed);
+        slot.settings.store(
+            m.clock as u64 | (m.variant as u64) << 16 | (m.visibility as u64) << 32,
+            Ordering::Relaxed,
+        );
+        slot.time_start.store(
+            m.time_start
+                .saturating_duration_since(self.epoch)
+                .as_nanos() as u64,
+            Ordering::Relaxed,
+        );
+        slot.seq.store(seq + 2, Ordering::Release);
+        ticket
+    }
+
+    // true if the match was in progress and still in the ring
+    pub fn complete(&self, ticket: HistoryTicket) -> bool {
+        self.slot(ticket)
+            .entry
+            .compare_exchange(
+                ticket << 1,
+                ticket << 1 | 1,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            )
+            .is_ok()
+    }
+
+    // None if the slot no longer or not yet holds the match, or kept changing while read
+    fn read(&self, ticket: HistoryTicket) -> Option<ServerHistoryMatch> {
+        let slot = self.slot(ticket);
+        for _ in 0..READ_RETRIES {
+            let seq = slot.seq.load(Ordering::Acquire);
+            if seq & 1 == 1 {
+                spin_loop();
+                continue;
+            }
+            let entry = slot.entry.load(Ordering::Relaxed);
+            let settings = slot.settings.load(Ordering::Relaxed);
+            let time_start = slot.time_start.load(Ordering::Relaxed);
+            fence(Ordering::Acquire);
+            if slot.seq.load(Ordering::Relaxed) != seq {
+                continue;
+            }
+            if entry >> 1 != ticket {
+                return None;
+            }
+            return Some(ServerHistoryMatch {
+                state: if entry & 1 == 1 {
+                    HistoryMatchState::Completed
+                } else {
+                    HistoryMatchState::InProgress
+                },
+                clock: try_i64_to_enum((settings & 0xffff) as i64).ok()?,
+                variant: try_i64_to_enum((settings >> 16 & 0xffff) as i64).ok()?,
+                visibility: try_i64_to_enum((settings >> 32 & 0xffff) as i64).ok()?,
+                time_start: self.epoch + Duration::from_nanos(time_start),
+            });
+        }
+        None
+    }
+
+    // at most n matches with their tickets, newest first, matches being written are left out
+    pub fn latest(&self, n: usize) -> Vec<(HistoryTicket, ServerHistoryMatch)> {
+        let head = self.head.load(Ordering::Acquire);
+        let oldest = head.saturating_sub(self.slots.len() as u64).max(1);
+        let mut matches = Vec::with_capacity(n.min(self.slots.len()));
+        for ticket in (oldest..head).rev() {
+            if matches.len() >= n {
+                break;
+            }
+            matches.extend(self.read(ticket).map(|m| (ticket, m)));
+        }
+        matches
+    }
+}
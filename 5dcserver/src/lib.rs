@@ -0,0 +1,19 @@
+pub mod capture;
+#[macro_use]
+pub mod datatype;
+pub mod cluster;
+pub mod config;
+pub mod engine;
+#[cfg(unix)]
+pub mod handover;
+pub mod history;
+pub mod limit;
+pub mod metrics;
+pub mod passcode;
+pub mod registry;
+pub mod server;
+pub mod shard;
+pub mod spectate;
+pub mod timer;
+#[cfg(target_os = "linux")]
+pub mod uring;
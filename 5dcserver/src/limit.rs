@@ -0,0 +1,250 @@
+use std::fmt::Write as _;
+use std::hint::spin_loop;
+use std::io::Result;
+use std::net::{IpAddr, Ipv6Addr, SocketAddr};
+use std::sync::atomic::{fence, AtomicU64, Ordering};
+use std::time::Duration;
+use tokio::time::Instant;
+
+use crate::datatype::*;
+use crate::metrics::METRICS;
+
+/* rate limits of what a client sends, one token bucket per connection and message type.
+A frame over its limit stays in the read buffer until it is due, so the client is throttled
+before its frame is unpacked and TCP pushes back on it. The time a client is throttled drains
+at 1 / THROTTLED_DRAIN of the time passing, so only a client held back for most of the time,
+a flood rather than a burst or a steady rate just above the limit, eventually has more than
+SHED_AFTER of it and is disconnected like one sending illegal messages.
+The buckets are kept as the time the next frame of a type is due (GCRA),
+a frame may come up to BURST before it, which is the credit a quiet connection saves up. */
+
+const BURST: Duration = Duration::from_secs(2);
+const SHED_AFTER: Duration = Duration::from_secs(10);
+const THROTTLED_DRAIN: u64 = 2; // a client held back all the time is shed after 20 seconds
+const LIMITED_KINDS: usize = 6;
+const OFFENDERS_LISTED: usize = 16; // connections throttled most, listed by the metrics endpoint
+const READ_RETRIES: usize = 64;
+
+// bucket of a message kind a client may send
+fn bucket(kind: usize) -> Option<usize> {
+    match kind {
+        1 => Some(0),  // C2SGreet
+        3 => Some(1),  // C2SMatchCreateOrJoin
+        5 => Some(2),  // C2SMatchCancel
+        10 => Some(3), // C2SForfeit
+        11 => Some(4), // C2SOrS2CAction
+        12 => Some(5), // C2SMatchListRequest
+        _ => None,     // refused when unpacked anyway
+    }
+}
+
+// messages per second of every type, 0 means no limit
+#[derive(Debug, Clone, Copy, Default)]
+pub struct RateLimits {
+    pub lobby: u32, // greets, creates or joins, cancels and match list requests
+    pub game: u32,  // actions and forfeits
+}
+
+impl RateLimits {
+    pub fn enabled(&self) -> bool {
+        self.lobby != 0 || self.game != 0
+    }
+
+    // nanoseconds between frames of a kind at its rate, None if unlimited
+    fn interval(&self, kind: usize) -> Option<u64> {
+        let rate = match kind {
+            10 | 11 => self.game,
+            _ => self.lobby,
+        };
+        (rate != 0).then(|| 1_000_000_000 / rate as u64)
+    }
+}
+
+// buckets of one connection, times are nanoseconds since it started
+#[derive(Debug)]
+pub struct Limiter {
+    limits: RateLimits,
+    connection: u32,
+    addr: SocketAddr,
+    start: Instant,
+    due: [u64; LIMITED_KINDS],
+    throttled: u64,         // minus what drained since
+    checked: u64,           // time throttled drained to
+    waiting: Option<usize>, // bucket of the frame held back, charged once
+}
+
+impl Limiter {
+    pub fn new(limits: RateLimits, connection: u32, addr: SocketAddr) -> Self {
+        Limiter {
+            limits,
+            connection,
+            addr,
+            start: Instant::now(),
+            due: [0; LIMITED_KINDS],
+            throttled: 0,
+            checked: 0,
+            waiting: None,
+        }
+    }
+
+    // None takes the frame, otherwise it is held back until the instant, an error sheds the client
+    pub fn check(&mut self, kind: usize) -> Result<Option<Instant>> {
+        let (i, interval) = match (bucket(kind), self.limits.interval(kind)) {
+            (Some(i), Some(interval)) => (i, interval),
+            _ => return Ok(None),
+        };
+        let now = self.start.elapsed().as_nanos() as u64;
+        self.throttled = self
+            .throttled
+            .saturating_sub((now - self.checked) / THROTTLED_DRAIN);
+        self.checked = now;
+        let due = self.due[i].max(now);
+        let burst = BURST.as_nanos() as u64;
+        if due <= now + burst {
+            self.due[i] = due + interval;
+            self.waiting = None;
+            return Ok(None);
+        }
+        let wait = due - burst - now;
+        // polled again until it is due, only the first poll of a frame counts
+        if self.waiting != Some(i) {
+            self.waiting = Some(i);
+            self.throttled += wait;
+            METRICS.throttled(kind);
+            OFFENDERS.record(self.connection, self.addr, self.throttled);
+            if self.throttled > SHED_AFTER.as_nanos() as u64 {
+                METRICS.shed();
+                return err_invalid_data!(
+                    "Sent {:?} too often, throttled for {:?}.",
+                    try_i64_to_enum::<MessageType>(kind as i64)?,
+                    Duration::from_nanos(self.throttled)
+                );
+            }
+        }
+        Ok(Some(Instant::now() + Duration::from_nanos(wait)))
+    }
+}
+
+// one offender, every field is an atomic so that torn reads are only ever stale
+#[derive(Debug)]
+struct Slot {
+    seq: AtomicU64,     // odd while the slot is written
+    key: AtomicU64,     // throttled milliseconds << 32 | connection, 0 means empty
+    ip: [AtomicU64; 2], // IPv6 or IPv4-mapped address in big-endian halves
+    port: AtomicU64,
+}
+
+/* connections throttled most lately, never waiting for a lock.
+A connection raises its own slot or takes the one of the least throttled other connection,
+writers take a slot with a seqlock like the server history and skip a slot taken meanwhile,
+as the table only has to be roughly right. */
+#[derive(Debug)]
+pub struct Offenders {
+    slots: [Slot; OFFENDERS_LISTED],
+}
+
+pub static OFFENDERS: Offenders = Offenders::new();
+
+impl Offenders {
+    const fn new() -> Self {
+        Offenders {
+            slots: [const {
+                Slot {
+                    seq: AtomicU64::new(0),
+                    key: AtomicU64::new(0),
+                    ip: [const { AtomicU64::new(0) }; 2],
+                    port: AtomicU64::new(0),
+                }
+            }; OFFENDERS_LISTED],
+        }
+    }
+
+    fn record(&self, connection: u32, addr: SocketAddr, throttled: u64) {
+        let ms = ((throttled + 999_999) / 1_000_000).min(u32::MAX as u64); // rounded up, 0 is empty
+        let mut target = 0;
+        let mut least = u64::MAX;
+        for (i, slot) in self.slots.iter().enumerate() {
+            let key = slot.key.load(Ordering::Relaxed);
+            if key != 0 && key as u32 == connection {
+                (target, least) = (i, 0);
+                break;
+            }
+            if key >> 32 < least {
+                (target, least) = (i, key >> 32);
+            }
+        }
+        if least >= ms && least != 0 {
+            return;
+        }
+        let slot = &self.slots[target];
+        let seq = slot.seq.load(Ordering::Relaxed);
+        if seq & 1 == 1
+            || slot
+                .seq
+                .compare_exchange(seq, seq + 1, Ordering::Relaxed, Ordering::Relaxed)
+                .is_err()
+        {
+            return;
+        }
+        fence(Ordering::Release);
+        // another connection throttled more may have taken it meanwhile
+        let key = slot.key.load(Ordering::Relaxed);
+        if key as u32 == connection || key >> 32 < ms {
+            let ip = match addr.ip() {
+                IpAddr::V4(ip) => ip.to_ipv6_mapped(),
+                IpAddr::V6(ip) => ip,
+            };
+            let ip = u128::from(ip);
+            slot.ip[0].store((ip >> 64) as u64, Ordering::Relaxed);
+            slot.ip[1].store(ip as u64, Ordering::Relaxed);
+            slot.port.store(addr.port() as u64, Ordering::Relaxed);
+            slot.key
+                .store(ms << 32 | connection as u64, Ordering::Relaxed);
+        }
+        slot.seq.store(seq + 2, Ordering::Release);
+    }
+
+    // throttled milliseconds, connection and address of a slot, None if empty or kept changing
+    fn read(slot: &Slot) -> Option<(u64, u32, SocketAddr)> {
+        for _ in 0..READ_RETRIES {
+            let seq = slot.seq.load(Ordering::Acquire);
+            if seq & 1 == 1 {
+                spin_loop();
+                continue;
+            }
+            let key = slot.key.load(Ordering::Relaxed);
+            let ip = (slot.ip[0].load(Ordering::Relaxed) as u128) << 64
+                | slot.ip[1].load(Ordering::Relaxed) as u128;
+            let port = slot.port.load(Ordering::Relaxed);
+            fence(Ordering::Acquire);
+            if slot.seq.load(Ordering::Relaxed) != seq {
+                continue;
+            }
+            if key == 0 {
+                return None;
+            }
+            let ip = Ipv6Addr::from(ip);
+            let ip = match ip.to_ipv4_mapped() {
+                Some(ip) => IpAddr::V4(ip),
+                None => IpAddr::V6(ip),
+            };
+            return Some((key >> 32, key as u32, SocketAddr::new(ip, port as u16)));
+        }
+        None
+    }
+
+    pub fn write(&self, out: &mut String) {
+        let mut offenders: Vec<_> = self.slots.iter().filter_map(Self::read).collect();
+        offenders.sort_unstable_by(|a, b| b.0.cmp(&a.0));
+        let _ = writeln!(out, "# TYPE fivedc_throttled_seconds gauge");
+        for (ms, connection, addr) in offenders {
+            let _ = writeln!(
+                out,
+                "fivedc_throttled_seconds{{connection=\"{}\",addr=\"{}\"}} {:.3}",
+                connection,
+                addr,
+                ms as f64 / 1e3
+            );
+        }
+    }
+}
@@ -1,42 +1,38 @@
-use futures::future::join_all;
-use std::collections::{HashSet, VecDeque};
 use std::env;
 use std::error::Error;
 use std::io::ErrorKind;
+#[cfg(unix)]
+use std::os::unix::io::AsRawFd;
 use std::process::exit;
 use std::sync::Arc;
+use std::thread;
+use std::time::Duration;
 use tokio::fs;
+use tokio::net::TcpListener;
+#[cfg(unix)]
+use tokio::signal::unix::{signal, SignalKind};
 use tokio::sync::watch;
-use tokio::{net::TcpListener, select};
-use tracing::{info, subscriber, Level};
+use tokio::task::spawn_blocking;
+use tracing::{error, info, subscriber, Level};
 use tracing_subscriber::FmtSubscriber;
 
-#[macro_use]
-pub mod datatype;
-pub mod server;
-
-use server::{handle_connection, ServerState};
-use datatype::*;
+use fivedcserver::capture;
+use fivedcserver::cluster::{self, Cluster, ClusterNode};
+use fivedcserver::config::{self, get_config, LiveConfig};
+#[cfg(unix)]
+use fivedcserver::handover;
+use fivedcserver::limit::RateLimits;
+use fivedcserver::metrics;
+use fivedcserver::server::{advance, ConnectionOptions, RunState, ServerState};
+use fivedcserver::shard;
+use fivedcserver::spectate;
+use fivedcserver::timer::{self, Timeouts};
 
 fn print_usage(arg0: &String) {
     println!();
     println!("usage: {} <CONFIG FILE>", arg0);
 }
 
-fn get_config<'a, T: toml::macros::Deserialize<'a>>(
-    config: &toml::value::Map<String, toml::Value>,
-    name: &str,
-    default: T,
-) -> T {
-    match config.get(name) {
-        Some(value) => match value.clone().try_into() {
-            Ok(value) => value,
-            _ => default,
-        },
-        None => default,
-    }
-}
-
 #[tokio::main]
 async fn main() -> Result<(), Box<dyn Error>> {
     // banner
@@ -62,9 +58,29 @@ async fn main() -> Result<(), Box<dyn Error>> {
             let config = toml::toml! {
                 addr = "0.0.0.0"
                 allow_reset_puzzle = false
+                capture = ""
+                clock_budgets_s = [0, 0, 0]
+                cluster_node = 0
+                cluster_nodes = []
+                handover = ""
+                history_capacity = 1024
+                idle_timeout_s = 0
+                io_uring = false
+                lobby_flush_us = 0
+                metrics_addr = ""
                 port = 39005
+                quick_play = false
+                rate_limit_lobby = 0
+                rate_limit_match = 0
+                shards = 0
+                socket_receive_buffer = 0
+                socket_send_buffer = 0
+                spectate_addr = ""
+                tcp_nodelay = true
                 trace = false
+                validate_moves = false
                 variants = []
+                waiting_timeout_s = 0
             };
             fs::write(&args[1], config.to_string()).await?;
             config
@@ -86,56 +102,229 @@ async fn main() -> Result<(), Box<dyn Error>> {
     subscriber::set_global_default(sub)?;
 
     // init server state
-    let allow_reset_puzzle = get_config(&config, "allow_reset_puzzle", false);
-    let variants = get_config(&config, "variants", toml::value::Array::new());
-    let variants = {
-        let mut variants_set = HashSet::new();
-        if variants.len() == 0 {
-            for i in 1..46 {
-                variants_set.insert(try_i64_to_enum(i)?);
-            }
-        } else {
-            for i in variants {
-                variants_set.insert(try_i64_to_enum(i.as_integer().unwrap())?);
-            }
+    let live_config = LiveConfig::new(&config)?;
+    let shards = get_config(&config, "shards", 0usize);
+    let history_capacity = get_config(&config, "history_capacity", 1024usize);
+    let quick_play = get_config(&config, "quick_play", false);
+    let spectate_addr = get_config(&config, "spectate_addr", String::new());
+    let cluster_nodes = get_config(&config, "cluster_nodes", toml::value::Array::new());
+    let cluster = if cluster_nodes.is_empty() {
+        None
+    } else {
+        let mut nodes = Vec::with_capacity(cluster_nodes.len());
+        for node in cluster_nodes {
+            let (addr, link) = match (node.get("addr"), node.get("link")) {
+                (Some(toml::Value::String(addr)), Some(toml::Value::String(link))) => {
+                    (addr.clone(), link.clone())
+                }
+                _ => Err("Every node of cluster_nodes needs an addr and a link.")?,
+            };
+            nodes.push(ClusterNode { addr, link });
         }
-        variants_set
+        let node = get_config(&config, "cluster_node", 0usize);
+        if node >= nodes.len() {
+            Err("cluster_node is not an index of cluster_nodes.")?;
+        }
+        Some(Cluster::new(node, nodes))
+    };
+    let connection = ConnectionOptions {
+        nodelay: get_config(&config, "tcp_nodelay", true),
+        send_buffer: get_config(&config, "socket_send_buffer", 0usize),
+        receive_buffer: get_config(&config, "socket_receive_buffer", 0usize),
+        lobby_flush: Duration::from_micros(get_config(&config, "lobby_flush_us", 0u64)),
+        io_uring: get_config(&config, "io_uring", false),
+        rate_limits: RateLimits {
+            lobby: get_config(&config, "rate_limit_lobby", 0u32),
+            game: get_config(&config, "rate_limit_match", 0u32),
+        },
+        timeouts: Timeouts {
+            idle: Duration::from_secs(get_config(&config, "idle_timeout_s", 0u64)),
+            waiting: Duration::from_secs(get_config(&config, "waiting_timeout_s", 0u64)),
+            clocks: match get_config(&config, "clock_budgets_s", vec![0u64; 3])[..] {
+                [short, medium, long] => [short, medium, long].map(Duration::from_secs),
+                _ => Err("clock_budgets_s needs seconds for Short, Medium and Long.")?,
+            },
+        },
+    };
+    // rings belong to the thread of a shard
+    let shards = match (connection.io_uring, shards) {
+        (true, 0) => 1,
+        _ => shards,
     };
-    let state = Arc::new(ServerState::new(allow_reset_puzzle, variants));
+    let state = Arc::new(ServerState::new(
+        live_config,
+        shards,
+        history_capacity,
+        quick_play,
+        cluster,
+        connection,
+        !spectate_addr.is_empty(),
+    ));
 
-    // handle ctrl-c
-    let (running_tx, mut running_rx) = watch::channel(true);
-    ctrlc::set_handler(move || {
-        running_tx.send_if_modified(|running| {
-            if *running {
+    // ctrl-c or SIGTERM drains, another ctrl-c stops at once
+    let (running_tx, running_rx) = watch::channel(RunState::Running);
+    let running_tx = Arc::new(running_tx);
+    {
+        let running_tx = running_tx.clone();
+        ctrlc::set_handler(move || {
+            if advance(&running_tx, RunState::Draining) {
+                info!("Draining, ctrl-c again stops at once ...");
+            } else if advance(&running_tx, RunState::Stopped) {
                 info!("Stopping ...");
-                *running = false;
-                true
-            } else {
-                false
+            }
+        })?;
+    }
+    #[cfg(unix)]
+    {
+        let running_tx = running_tx.clone();
+        let mut terminate = signal(SignalKind::terminate())?;
+        tokio::spawn(async move {
+            while terminate.recv().await.is_some() {
+                if advance(&running_tx, RunState::Draining) {
+                    info!("Draining ...");
+                }
             }
         });
-    })?;
+    }
 
-    // bind and listen for connections
-    let addr = get_config(&config, "addr", "0.0.0.0");
+    // capture frames
+    let capture_path = get_config(&config, "capture", String::new());
+    if !capture_path.is_empty() {
+        capture::start(&capture_path)?;
+    }
+
+    // reload live settings on SIGHUP or POST /-/reload to the metrics endpoint
+    let reload: metrics::Reload = {
+        let state = state.clone();
+        let path = args[1].clone();
+        Arc::new(move || config::reload(&path, &state).map_err(|e| e.to_string()))
+    };
+    #[cfg(unix)]
+    {
+        let reload = reload.clone();
+        let mut hangup = signal(SignalKind::hangup())?;
+        tokio::spawn(async move {
+            while hangup.recv().await.is_some() {
+                if let Err(e) = reload() {
+                    error!("Failed to reload config: {}", e);
+                }
+            }
+        });
+    }
+
+    // expire idle connections, waiting matches and clocks
+    if state.connection.timeouts.enabled() {
+        timer::start();
+    }
+
+    // serve metrics
+    let metrics_addr = get_config(&config, "metrics_addr", String::new());
+    if !metrics_addr.is_empty() {
+        let history: metrics::History = {
+            let state = state.clone();
+            Arc::new(move || metrics::render_history(&state.registry.history_kept()))
+        };
+        tokio::spawn(metrics::serve(metrics_addr, reload, history));
+    }
+
+    // serve spectators
+    if !spectate_addr.is_empty() {
+        tokio::spawn(spectate::serve(state.clone(), spectate_addr));
+    }
+
+    // link to the other nodes
+    if state.cluster.is_some() {
+        tokio::spawn(cluster::serve(state.clone()));
+    }
+
+    // take over the listeners of a server being replaced, or bind them
+    shard::raise_fd_limit();
+    let addr = get_config(&config, "addr", String::from("0.0.0.0"));
     let port = get_config(&config, "port", 39005);
-    let bind_addr = (addr, port);
-    let listener = TcpListener::bind(bind_addr).await?;
-    info!("listening on {}:{} ...", bind_addr.0, bind_addr.1);
-
-    let mut handles = VecDeque::new();
-    loop {
-        select! {
-            result = listener.accept() => {
-                let (stream, addr) = result?;
-                handles.push_back(tokio::spawn(handle_connection(state.clone(), stream, addr, running_rx.clone())));
-            },
-            result = running_rx.changed() => {
-                join_all(handles).await;
-                info!("Stopped.");
-                break Ok(result?);
+    let handover_path = get_config(&config, "handover", String::new());
+    #[cfg(unix)]
+    let (inherited, predecessor) = match handover_path.is_empty() {
+        true => (None, None),
+        false => match handover::take(&handover_path).await? {
+            Some((listeners, predecessor)) => {
+                if listeners.len() != shards.max(1) {
+                    Err(format!(
+                        "The running server has {} listeners, start this one with as many shards.",
+                        listeners.len()
+                    ))?;
+                }
+                info!("taking over {} listeners ...", listeners.len());
+                (Some(listeners), Some(predecessor))
             }
+            None => (None, None),
+        },
+    };
+    #[cfg(not(unix))]
+    let inherited: Option<Vec<std::net::TcpListener>> = {
+        if !handover_path.is_empty() {
+            error!("Handover is unix only.");
         }
+        None
+    };
+    let mut listeners = match inherited {
+        Some(listeners) => listeners,
+        None if shards == 0 => {
+            let listener = TcpListener::bind((addr.as_str(), port)).await?;
+            info!("listening on {}:{} ...", addr, port);
+            vec![listener.into_std()?]
+        }
+        None => {
+            // bind every shard first so that a taken address fails before any shard runs
+            let bind_addr = shard::resolve(&addr, port)?;
+            info!("listening on {} with {} shards ...", bind_addr, shards);
+            (0..shards)
+                .map(|_| shard::bind_reuse_port(bind_addr))
+                .collect::<Result<Vec<_>, _>>()?
+        }
+    };
+
+    // offer the listeners to the next successor, the predecessor drains once they are ready here
+    #[cfg(unix)]
+    if !handover_path.is_empty() {
+        let fds = listeners.iter().map(|l| l.as_raw_fd()).collect();
+        if let Some(predecessor) = predecessor {
+            predecessor.release().await?;
+        }
+        tokio::spawn(handover::serve(handover_path, fds, running_tx.clone()));
+    }
+
+    // accept connections
+    if shards == 0 {
+        let listener = listeners.pop().unwrap();
+        listener.set_nonblocking(true)?;
+        shard::serve(
+            state,
+            TcpListener::from_std(listener)?.into(),
+            0,
+            running_rx,
+        )
+        .await?;
+    } else {
+        let mut threads = Vec::with_capacity(shards);
+        for (i, listener) in listeners.into_iter().enumerate() {
+            listener.set_nonblocking(true)?;
+            let state = state.clone();
+            let running_rx = running_rx.clone();
+            threads.push(
+                thread::Builder::new()
+                    .name(format!("shard-{}", i))
+                    .spawn(move || shard::run(state, listener, i, running_rx))?,
+            );
+        }
+        spawn_blocking(move || {
+            for (i, thread) in threads.into_iter().enumerate() {
+                if let Ok(Err(e)) = thread.join() {
+                    error!("Shard {} failed: {}", i, e);
+                }
+            }
+        })
+        .await?;
     }
+    info!("Stopped.");
+    Ok(())
 }
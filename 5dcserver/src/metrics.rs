@@ -0,0 +1,468 @@
+use std::fmt::Write as _;
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::time::Instant;
+use tracing::{error, info};
+
+use crate::datatype::*;
+use crate::limit::OFFENDERS;
+use crate::shard::bind_when_free;
+
+/* counters and histograms of the server, exposed in the prometheus text format.
+Everything is a relaxed atomic so that recording never blocks the relay path. */
+
+// 8 sub-buckets per power of two, values are nanoseconds
+const HISTOGRAM_SUB_BITS: u32 = 3;
+const HISTOGRAM_SUB_BUCKETS: usize = 1 << HISTOGRAM_SUB_BITS;
+const HISTOGRAM_BUCKETS: usize = (64 - HISTOGRAM_SUB_BITS as usize + 1) * HISTOGRAM_SUB_BUCKETS;
+
+// HDR-style log-linear histogram, relative error of a bucket is below 12.5%
+#[derive(Debug)]
+pub struct Histogram {
+    buckets: [AtomicU64; HISTOGRAM_BUCKETS],
+    count: AtomicU64,
+    sum: AtomicU64,
+}
+
+impl Histogram {
+    pub const fn new() -> Self {
+        Histogram {
+            buckets: [const { AtomicU64::new(0) }; HISTOGRAM_BUCKETS],
+            count: AtomicU64::new(0),
+            sum: AtomicU64::new(0),
+        }
+    }
+
+    fn index(v: u64) -> usize {
+        if v < HISTOGRAM_SUB_BUCKETS as u64 {
+            return v as usize;
+        }
+        let e = 63 - v.leading_zeros();
+        let m = (v >> (e - HISTOGRAM_SUB_BITS)) as usize & (HISTOGRAM_SUB_BUCKETS - 1);
+        (e - HISTOGRAM_SUB_BITS + 1) as usize * HISTOGRAM_SUB_BUCKETS + m
+    }
+
+    // upper bound of the values in a bucket
+    fn value(i: usize) -> u64 {
+        if i < HISTOGRAM_SUB_BUCKETS {
+            return i as u64;
+        }
+        let e = (i / HISTOGRAM_SUB_BUCKETS) as u32 + HISTOGRAM_SUB_BITS - 1;
+        let m = (i % HISTOGRAM_SUB_BUCKETS) as u64;
+        let low = (HISTOGRAM_SUB_BUCKETS as u64 | m) << (e - HISTOGRAM_SUB_BITS);
+        low + ((1 << (e - HISTOGRAM_SUB_BITS)) - 1)
+    }
+
+    pub fn record(&self, d: Duration) {
+        let v = d.as_nanos().min(u64::MAX as u128) as u64;
+        self.buckets[Self::index(v)].fetch_add(1, Ordering::Relaxed);
+        self.count.fetch_add(1, Ordering::Relaxed);
+        self.sum.fetch_add(v, Ordering::Relaxed);
+    }
+
+    pub fn count(&self) -> u64 {
+        self.count.load(Ordering::Relaxed)
+    }
+
+    // values at the given quantiles, in nanoseconds
+    pub fn quantiles<const N: usize>(&self, qs: [f64; N]) -> [u64; N] {
+        let counts: Vec<u64> = self
+            .buckets
+            .iter()
+            .map(|b| b.load(Ordering::Relaxed))
+            .collect();
+        let total: u64 = counts.iter().sum();
+        let mut result = [0; N];
+        for (q, r) in qs.iter().zip(result.iter_mut()) {
+            let rank = ((total as f64) * q).ceil().max(1.0) as u64;
+            let mut seen = 0;
+            for (i, c) in counts.iter().enumerate() {
+                seen += c;
+                if seen >= rank {
+                    *r = Self::value(i);
+                    break;
+                }
+            }
+        }
+        result
+    }
+
+    fn write(&self, out: &mut String, name: &str, labels: &str) {
+        if self.count() == 0 {
+            return;
+        }
+        let sep = if labels.is_empty() { "" } else { "," };
+        let qs = [0.5, 0.9, 0.99, 0.999];
+        for (q, v) in qs.iter().zip(self.quantiles(qs)) {
+            let _ = writeln!(
+                out,
+                "{}{{{}{}quantile=\"{}\"}} {:.9}",
+                name,
+                labels,
+                sep,
+                q,
+                v as f64 / 1e9
+            );
+        }
+        let _ = writeln!(
+            out,
+            "{}_sum{{{}}} {:.9}",
+            name,
+            labels,
+            self.sum.load(Ordering::Relaxed) as f64 / 1e9
+        );
+        let _ = writeln!(out, "{}_count{{{}}} {}", name, labels, self.count());
+    }
+}
+
+// message kinds: MessageType values, 0 for unknown, then internal messages
+pub const MESSAGE_KINDS: usize = 19;
+const MESSAGE_KIND_NAMES: [&str; MESSAGE_KINDS] = [
+    "Unknown",
+    "C2SGreet",
+    "S2CGreet",
+    "C2SMatchCreateOrJoin",
+    "S2CMatchCreateOrJoinResult",
+    "C2SMatchCancel",
+    "S2CMatchCancelResult",
+    "S2CMatchStart",
+    "Unknown8",
+    "S2COpponentLeft",
+    "C2SForfeit",
+    "C2SOrS2CAction",
+    "C2SMatchListRequest",
+    "S2CMatchList",
+    "InternalJoin",
+    "InternalMatchStart",
+    "InternalForfeit",
+    "InternalAction",
+    "InternalTimeout",
+];
+
+pub fn message_kind(msg: &Message) -> usize {
+    match msg {
+        Message::InternalJoin(_) => 14,
+        Message::InternalMatchStart(..) => 15,
+        Message::InternalForfeit => 16,
+        Message::InternalAction(..) => 17,
+        Message::InternalTimeout => 18,
+        msg => msg.message_type() as usize,
+    }
+}
+
+// message kind of raw bytes starting with the type field
+pub fn type_kind(bytes: &[u8]) -> usize {
+    match bytes.get(0..8) {
+        Some(t) => match i64::from_le_bytes(t.try_into().unwrap()) {
+            t @ 1..=13 => t as usize,
+            _ => 0,
+        },
+        None => 0,
+    }
+}
+
+#[derive(Debug, Copy, Clone)]
+pub enum Lock {
+    Matches,
+    PublicMatches,
+    MatchListCache,
+    QuickPlayQueues,
+    ClusterNodes,
+    Config,
+    Spectated,
+    ActionLog,
+    Timers,
+}
+const LOCKS: usize = 9;
+const LOCK_NAMES: [&str; LOCKS] = [
+    "matches",
+    "public_matches",
+    "match_list_cache",
+    "quick_play_queues",
+    "cluster_nodes",
+    "config",
+    "spectated",
+    "action_log",
+    "timers",
+];
+
+// connection states, in the order of ConnectionStateEnum
+pub const STATES: usize = 3;
+const STATE_NAMES: [&str; STATES] = ["idle", "waiting", "playing"];
+
+#[derive(Debug)]
+pub struct Metrics {
+    frames_in: [AtomicU64; MESSAGE_KINDS],
+    frames_out: [AtomicU64; MESSAGE_KINDS],
+    bytes_in: [AtomicU64; MESSAGE_KINDS],
+    bytes_out: [AtomicU64; MESSAGE_KINDS],
+    frames_throttled: [AtomicU64; MESSAGE_KINDS],
+    handler_time: [[Histogram; MESSAGE_KINDS]; STATES],
+    lock_wait: [Histogram; LOCKS],
+    relay_time: Histogram, // from reading an action to queueing it on the peer socket
+    flush_time: Histogram,
+    connections_total: AtomicU64,
+    connections_active: AtomicU64,
+    capture_dropped: AtomicU64,
+    moves_rejected: AtomicU64,
+    connections_shed: AtomicU64,
+    spectators: AtomicU64,
+    timed_out: [AtomicU64; STATES],
+}
+
+pub static METRICS: Metrics = Metrics::new();
+
+impl Metrics {
+    const fn new() -> Self {
+        Metrics {
+            frames_in: [const { AtomicU64::new(0) }; MESSAGE_KINDS],
+            frames_out: [const { AtomicU64::new(0) }; MESSAGE_KINDS],
+            bytes_in: [const { AtomicU64::new(0) }; MESSAGE_KINDS],
+            bytes_out: [const { AtomicU64::new(0) }; MESSAGE_KINDS],
+            frames_throttled: [const { AtomicU64::new(0) }; MESSAGE_KINDS],
+            handler_time: [const { [const { Histogram::new() }; MESSAGE_KINDS] }; STATES],
+            lock_wait: [const { Histogram::new() }; LOCKS],
+            relay_time: Histogram::new(),
+            flush_time: Histogram::new(),
+            connections_total: AtomicU64::new(0),
+            connections_active: AtomicU64::new(0),
+            capture_dropped: AtomicU64::new(0),
+            moves_rejected: AtomicU64::new(0),
+            connections_shed: AtomicU64::new(0),
+            spectators: AtomicU64::new(0),
+            timed_out: [const { AtomicU64::new(0) }; STATES],
+        }
+    }
+
+    // frame including the length field
+    pub fn frame_in(&self, kind: usize, length: usize) {
+        self.frames_in[kind].fetch_add(1, Ordering::Relaxed);
+        self.bytes_in[kind].fetch_add(length as u64, Ordering::Relaxed);
+    }
+
+    pub fn frame_out(&self, kind: usize, length: usize) {
+        self.frames_out[kind].fetch_add(1, Ordering::Relaxed);
+        self.bytes_out[kind].fetch_add(length as u64, Ordering::Relaxed);
+    }
+
+    pub fn handler_time(&self, state: usize, kind: usize, d: Duration) {
+        self.handler_time[state][kind].record(d);
+    }
+
+    pub fn lock_wait(&self, lock: Lock, d: Duration) {
+        self.lock_wait[lock as usize].record(d);
+    }
+
+    pub fn relay_time(&self, d: Duration) {
+        self.relay_time.record(d);
+    }
+
+    pub fn flush_time(&self, d: Duration) {
+        self.flush_time.record(d);
+    }
+
+    pub fn connected(&self) {
+        self.connections_total.fetch_add(1, Ordering::Relaxed);
+        self.connections_active.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn disconnected(&self) {
+        self.connections_active.fetch_sub(1, Ordering::Relaxed);
+    }
+
+    // capture queue was full
+    pub fn capture_dropped(&self) {
+        self.capture_dropped.fetch_add(1, Ordering::Relaxed);
+    }
+
+    // action refused by the game engine
+    pub fn move_rejected(&self) {
+        self.moves_rejected.fetch_add(1, Ordering::Relaxed);
+    }
+
+    // frame held back by the rate limits
+    pub fn throttled(&self, kind: usize) {
+        self.frames_throttled[kind].fetch_add(1, Ordering::Relaxed);
+    }
+
+    // client disconnected for flooding
+    pub fn shed(&self) {
+        self.connections_shed.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn spectator_joined(&self) {
+        self.spectators.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn spectator_left(&self) {
+        self.spectators.fetch_sub(1, Ordering::Relaxed);
+    }
+
+    // connection closed by its deadline in a state
+    pub fn timed_out(&self, state: usize) {
+        self.timed_out[state].fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn render(&self) -> String {
+        let mut out = String::new();
+        let counters = [
+            ("fivedc_frames_in_total", &self.frames_in),
+            ("fivedc_frames_out_total", &self.frames_out),
+            ("fivedc_bytes_in_total", &self.bytes_in),
+            ("fivedc_bytes_out_total", &self.bytes_out),
+            ("fivedc_frames_throttled_total", &self.frames_throttled),
+        ];
+        for (name, values) in counters {
+            let _ = writeln!(out, "# TYPE {} counter", name);
+            for (kind, v) in values.iter().enumerate() {
+                let v = v.load(Ordering::Relaxed);
+                if v != 0 {
+                    let _ = writeln!(
+                        out,
+                        "{}{{type=\"{}\"}} {}",
+                        name, MESSAGE_KIND_NAMES[kind], v
+                    );
+                }
+            }
+        }
+        let _ = writeln!(out, "# TYPE fivedc_connections_total counter");
+        let _ = writeln!(
+            out,
+            "fivedc_connections_total {}",
+            self.connections_total.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_connections gauge");
+        let _ = writeln!(
+            out,
+            "fivedc_connections {}",
+            self.connections_active.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_spectators gauge");
+        let _ = writeln!(
+            out,
+            "fivedc_spectators {}",
+            self.spectators.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_capture_dropped_total counter");
+        let _ = writeln!(
+            out,
+            "fivedc_capture_dropped_total {}",
+            self.capture_dropped.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_moves_rejected_total counter");
+        let _ = writeln!(
+            out,
+            "fivedc_moves_rejected_total {}",
+            self.moves_rejected.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_connections_shed_total counter");
+        let _ = writeln!(
+            out,
+            "fivedc_connections_shed_total {}",
+            self.connections_shed.load(Ordering::Relaxed)
+        );
+        let _ = writeln!(out, "# TYPE fivedc_timeouts_total counter");
+        for (state, v) in self.timed_out.iter().enumerate() {
+            let _ = writeln!(
+                out,
+                "fivedc_timeouts_total{{state=\"{}\"}} {}",
+                STATE_NAMES[state],
+                v.load(Ordering::Relaxed)
+            );
+        }
+        OFFENDERS.write(&mut out);
+        let _ = writeln!(out, "# TYPE fivedc_handler_seconds summary");
+        for (state, histograms) in self.handler_time.iter().enumerate() {
+            for (kind, h) in histograms.iter().enumerate() {
+                let labels = format!(
+                    "state=\"{}\",type=\"{}\"",
+                    STATE_NAMES[state], MESSAGE_KIND_NAMES[kind]
+                );
+                h.write(&mut out, "fivedc_handler_seconds", &labels);
+            }
+        }
+        let _ = writeln!(out, "# TYPE fivedc_lock_wait_seconds summary");
+        for (lock, h) in self.lock_wait.iter().enumerate() {
+            let labels = format!("lock=\"{}\"", LOCK_NAMES[lock]);
+            h.write(&mut out, "fivedc_lock_wait_seconds", &labels);
+        }
+        let _ = writeln!(out, "# TYPE fivedc_relay_seconds summary");
+        self.relay_time.write(&mut out, "fivedc_relay_seconds", "");
+        let _ = writeln!(out, "# TYPE fivedc_flush_seconds summary");
+        self.flush_time.write(&mut out, "fivedc_flush_seconds", "");
+        out
+    }
+}
+
+// newest first, with the seconds since each match started
+pub fn render_history(matches: &[ServerHistoryMatch]) -> String {
+    let now = Instant::now();
+    let mut out = String::new();
+    for m in matches {
+        let _ = writeln!(
+            out,
+            "{:?} {:?} {:?} {:?} {}",
+            m.state,
+            m.clock,
+            m.variant,
+            m.visibility,
+            now.saturating_duration_since(m.time_start).as_secs()
+        );
+    }
+    out
+}
+
+// reloads the live settings, the error is sent back as the response
+pub type Reload = Arc<dyn Fn() -> Result<(), String> + Send + Sync>;
+
+// the matches kept in the server history, one line each
+pub type History = Arc<dyn Fn() -> String + Send + Sync>;
+
+/* answer POST /-/reload with a reload, GET /history with the server history
+and every other HTTP request on addr with the current metrics */
+pub async fn serve(addr: String, reload: Reload, history: History) {
+    let listener = match bind_when_free(&addr).await {
+        Ok(listener) => listener,
+        Err(e) => {
+            error!("Failed to bind metrics endpoint {}: {}", addr, e);
+            return;
+        }
+    };
+    info!("metrics on http://{}/metrics ...", addr);
+    loop {
+        let mut stream = match listener.accept().await {
+            Ok((stream, _addr)) => stream,
+            Err(_) => continue,
+        };
+        let (reload, history) = (reload.clone(), history.clone());
+        tokio::spawn(async move {
+            // only the request line matters
+            let mut request = [0; 1024];
+            let _ = stream.read(&mut request).await;
+            let (status, content_type, body) = if request.starts_with(b"POST /-/reload ") {
+                match reload() {
+                    Ok(()) => ("200 OK", "text/plain", String::from("reloaded\n")),
+                    Err(e) => {
+                        error!("Failed to reload config: {}", e);
+                        ("500 Internal Server Error", "text/plain", e + "\n")
+                    }
+                }
+            } else if request.starts_with(b"GET /history ") {
+                ("200 OK", "text/plain", history())
+            } else {
+                ("200 OK", "text/plain; version=0.0.4", METRICS.render())
+            };
+            let response = format!(
+                "HTTP/1.1 {}\r\nContent-Type: {}\r\nContent-Length: {}\r\nConnection: close\r\n\r\n{}",
+                status,
+                content_type,
+                body.len(),
+                body
+            );
+            let _ = stream.write_all(response.as_bytes()).await;
+            let _ = stream.shutdown().await;
+        });
+    }
+}
@@ -0,0 +1,70 @@
+use rand::Rng;
+use std::sync::atomic::{AtomicU64, Ordering};
+
+use crate::datatype::Passcode;
+
+pub const PASSCODE_SPACE: u64 = 2985984; // 12^6, kkkkkk = 2985983
+
+const ROUNDS: usize = 4;
+
+/* passcodes that look random but cost O(1) to allocate.
+A counter walks the passcode space through a keyed Feistel permutation,
+so a passcode comes back only after every other one in the range was handed out.
+The domain is half * half (1728 * 1728 = 12^6), values outside the range are
+skipped by cycle walking, which never happens when the range is a perfect square. */
+#[derive(Debug)]
+pub struct PasscodeAllocator {
+    start: Passcode,
+    len: u64,
+    half: u64,
+    keys: [u64; ROUNDS],
+    counter: AtomicU64,
+}
+
+impl PasscodeAllocator {
+    pub fn new() -> Self {
+        Self::with_range(0, PASSCODE_SPACE)
+    }
+
+    // allocate from start..start + len
+    pub fn with_range(start: Passcode, len: u64) -> Self {
+        let mut rng = rand::thread_rng();
+        let mut half = (len as f64).sqrt() as u64;
+        while half * half < len {
+            half += 1;
+        }
+        PasscodeAllocator {
+            start,
+            len,
+            half,
+            keys: [rng.gen(), rng.gen(), rng.gen(), rng.gen()],
+            counter: AtomicU64::new(rng.gen_range(0..len)),
+        }
+    }
+
+    fn round(&self, r: u64, key: u64) -> u64 {
+        // splitmix64 finalizer
+        let mut x = r ^ key;
+        x = (x ^ (x >> 30)).wrapping_mul(0xbf58476d1ce4e5b9);
+        x = (x ^ (x >> 27)).wrapping_mul(0x94d049bb133111eb);
+        (x ^ (x >> 31)) % self.half
+    }
+
+    fn permute(&self, mut i: u64) -> u64 {
+        loop {
+            let (mut l, mut r) = (i / self.half, i % self.half);
+            for key in self.keys {
+                (l, r) = (r, (l + self.round(r, key)) % self.half);
+            }
+            i = l * self.half + r;
+            if i < self.len {
+                return i;
+            }
+        }
+    }
+
+    pub fn next(&self) -> Passcode {
+        let i = self.counter.fetch_add(1, Ordering::Relaxed) % self.len;
+        self.start + self.permute(i) as Passcode
+    }
+}
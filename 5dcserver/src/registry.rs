@@ -0,0 +1,489 @@
+use std::collections::hash_map::RandomState;
+use std::collections::{HashMap, VecDeque};
+use std::hash::{BuildHasher, Hash};
+use std::sync::atomic::{AtomicU64, Ordering};
+use std::sync::{Mutex, MutexGuard};
+use std::time::Instant;
+use tokio::sync::broadcast;
+
+use crate::cluster::{Cluster, ClusterEvent};
+use crate::datatype::*;
+use crate::history::{HistoryRing, HISTORY_LISTED};
+use crate::metrics::{Lock, METRICS};
+use crate::passcode::{PasscodeAllocator, PASSCODE_SPACE};
+
+const SHARDS: usize = 64; // power of two
+
+// lock and record the wait
+pub fn lock<T>(mutex: &Mutex<T>, lock: Lock) -> MutexGuard<'_, T> {
+    let start = Instant::now();
+    let guard = mutex.lock().unwrap();
+    METRICS.lock_wait(lock, start.elapsed());
+    guard
+}
+
+// hash map split into independently locked shards, locks are never held across await
+#[derive(Debug)]
+pub struct ShardedMap<K, V> {
+    lock: Lock,
+    hasher: RandomState,
+    shards: Box<[Mutex<HashMap<K, V>>]>,
+}
+
+impl<K: Hash + Eq, V> ShardedMap<K, V> {
+    pub fn new(lock: Lock) -> Self {
+        ShardedMap {
+            lock,
+            hasher: RandomState::new(),
+            shards: (0..SHARDS).map(|_| Mutex::new(HashMap::new())).collect(),
+        }
+    }
+
+    fn shard(&self, key: &K) -> MutexGuard<'_, HashMap<K, V>> {
+        lock(
+            &self.shards[self.hasher.hash_one(key) as usize & (SHARDS - 1)],
+            self.lock,
+        )
+    }
+
+    // insert only if absent, the value is given back if the key is taken
+    pub fn try_insert(&self, key: K, value: V) -> Result<(), V> {
+        let mut shard = self.shard(&key);
+        if shard.contains_key(&key) {
+            Err(value)
+        } else {
+            shard.insert(key, value);
+            Ok(())
+        }
+    }
+
+    pub fn insert(&self, key: K, value: V) -> Option<V> {
+        self.shard(&key).insert(key, value)
+    }
+
+    pub fn get(&self, key: &K) -> Option<V>
+    where
+        V: Clone,
+    {
+        self.shard(key).get(key).cloned()
+    }
+
+    pub fn remove(&self, key: &K) -> Option<V> {
+        self.shard(key).remove(key)
+    }
+
+    // remove only if the value passes the check
+    pub fn remove_if(&self, key: &K, check: impl FnOnce(&V) -> bool) -> Option<V> {
+        let mut shard = self.shard(key);
+        match shard.get(key) {
+            Some(value) if check(value) => shard.remove(key),
+            _ => None,
+        }
+    }
+
+    // run f on the value of key, a default value is inserted if absent
+    pub fn update<R>(&self, key: K, f: impl FnOnce(&mut V) -> R) -> R
+    where
+        V: Default,
+    {
+        f(self.shard(&key).entry(key).or_default())
+    }
+
+    // collect at most n values, one shard locked at a time
+    pub fn values(&self, n: usize) -> Vec<V>
+    where
+        V: Clone,
+    {
+        let mut values = Vec::new();
+        for shard in self.shards.iter() {
+            if values.len() >= n {
+                break;
+            }
+            let shard = lock(shard, self.lock);
+            values.extend(shard.values().take(n - values.len()).cloned());
+        }
+        values
+    }
+}
+
+// match list of another node of the cluster, as pushed by it
+#[derive(Debug, Default)]
+struct RemoteNode {
+    public_matches: HashMap<Passcode, MatchSettingsWithoutVisibility>,
+    history: VecDeque<(HistoryTicket, ServerHistoryMatch)>, // newest last
+    link: u64, // generation of the link it is pushed over, a link replaced meanwhile changes nothing
+}
+
+// a created match waiting for its opponent, holds the joiner ends of the match pipe
+#[derive(Debug)]
+pub struct PendingMatch {
+    pub tx: PeerSender,
+    pub rx: PeerReceiver,
+    pub visibility: Visibility,
+    queued: Option<Bucket>, // quick play queue holding the passcode
+}
+
+// quick play queue of a match: clock, variant and color requested by its creator
+type Bucket = (i64, i64, i64);
+
+fn bucket(clock: OptionalClock, variant: Variant, color: OptionalColorWithRandom) -> Bucket {
+    (clock as i64, variant as i64, color as i64)
+}
+
+// colors of waiting matches whose creators can play against a request, best first
+fn compatible_colors(color: OptionalColorWithRandom) -> &'static [OptionalColorWithRandom] {
+    use OptionalColorWithRandom::*;
+    match color {
+        White => &[Black, Random],
+        Black => &[White, Random],
+        Random => &[White, Black, Random],
+        None => &[],
+    }
+}
+
+// waiting matches of one server shard, their passcodes come from the range of the shard
+#[derive(Debug)]
+struct RegistryShard {
+    passcodes: PasscodeAllocator,
+    matches: ShardedMap<Passcode, PendingMatch>,
+    public_matches: ShardedMap<Passcode, MatchSettingsWithoutVisibility>,
+}
+
+/* waiting matches by passcode, public ones also in a secondary index.
+A match is placed on the server shard of its creator, the passcodes of the node
+(all of them outside a cluster) are split into one contiguous range per server shard,
+so a join finds the match from its passcode alone.
+In a cluster, public matches and history changes are published to the other nodes,
+and the match lists they push are merged after the local one.
+With quick play, public matches are also queued by their settings in creation order,
+a public create takes the oldest compatible match instead of waiting for a join.
+Queues only ever hold waiting matches, a match leaves its queue when it is taken.
+Every change visible in S2CMatchList bumps the version,
+list snapshots built at a version are valid until it changes. */
+#[derive(Debug)]
+pub struct MatchRegistry {
+    shards: Box<[RegistryShard]>,
+    start: Passcode, // first passcode of this node
+    len: u64,
+    shard_len: u64,
+    history: HistoryRing,
+    queues: Option<ShardedMap<Bucket, VecDeque<Passcode>>>, // None without quick play
+    events: Option<broadcast::Sender<ClusterEvent>>,        // None outside a cluster
+    remote: Box<[Mutex<RemoteNode>]>,                       // by node, empty outside a cluster
+    version: AtomicU64,
+}
+
+impl MatchRegistry {
+    pub fn new(
+        shards: usize,
+        history_capacity: usize,
+        quick_play: bool,
+        cluster: Option<&Cluster>,
+    ) -> Self {
+        let (start, len) = match cluster {
+            Some(cluster) => cluster.range(cluster.node),
+            None => (0, PASSCODE_SPACE),
+        };
+        let shards = shards.max(1) as u64;
+        let shard_len = len / shards;
+        MatchRegistry {
+            shards: (0..shards)
+                .map(|i| {
+                    // the last shard also takes the remainder
+                    let shard_start = start + (i * shard_len) as Passcode;
+                    let len = if i == shards - 1 {
+                        len - i * shard_len
+                    } else {
+                        shard_len
+                    };
+                    RegistryShard {
+                        passcodes: PasscodeAllocator::with_range(shard_start, len),
+                        matches: ShardedMap::new(Lock::Matches),
+                        public_matches: ShardedMap::new(Lock::PublicMatches),
+                    }
+                })
+                .collect(),
+            start,
+            len,
+            shard_len,
+            history: HistoryRing::new(history_capacity),
+            queues: quick_play.then(|| ShardedMap::new(Lock::QuickPlayQueues)),
+            events: cluster.map(|cluster| cluster.events.clone()),
+            remote: match cluster {
+                Some(cluster) => (0..cluster.nodes.len())
+                    .map(|_| Mutex::new(RemoteNode::default()))
+                    .collect(),
+                None => Box::new([]),
+            },
+            version: AtomicU64::new(0),
+        }
+    }
+
+    // shard owning a passcode, None if no shard of this node hands it out
+    fn owner(&self, passcode: Passcode) -> Option<&RegistryShard> {
+        if passcode < self.start || (passcode - self.start) as u64 >= self.len {
+            return None;
+        }
+        let i = ((passcode - self.start) as u64 / self.shard_len) as usize;
+        self.shards.get(i.min(self.shards.len() - 1))
+    }
+
+    fn publish(&self, event: ClusterEvent) {
+        if let Some(events) = &self.events {
+            let _ = events.send(event);
+        }
+    }
+
+    pub fn version(&self) -> u64 {
+        self.version.load(Ordering::Acquire)
+    }
+
+    fn changed(&self) {
+        self.version.fetch_add(1, Ordering::Release);
+    }
+
+    /* register a waiting match on a shard under an unused passcode, returns the passcode.
+    A passcode is only taken when a match waited for a whole cycle of the allocator,
+    so the loop runs once in practice. */
+    pub fn create(
+        &self,
+        shard: usize,
+        m: &MatchSettings,
+        tx: PeerSender,
+        rx: PeerReceiver,
+    ) -> Passcode {
+        let shard = &self.shards[shard % self.shards.len()];
+        let mut pending = PendingMatch {
+            tx,
+            rx,
+            visibility: m.visibility,
+            queued: None,
+        };
+        if m.visibility == Visibility::Public && self.queues.is_some() {
+            pending.queued = Some(bucket(m.clock, m.variant, m.color));
+        }
+        let queued = pending.queued;
+        let public = m.visibility == Visibility::Public;
+        let passcode = loop {
+            let passcode = shard.passcodes.next();
+            /* listed and published before the match can be taken, so that a take racing
+            with the create always finds the entry it removes, withdrawn again if the
+            passcode turns out to be held by a private match */
+            if public {
+                let mut m: MatchSettingsWithoutVisibility = m.clone().into();
+                m.passcode = passcode;
+                if shard.public_matches.try_insert(passcode, m).is_err() {
+                    continue;
+                }
+                self.publish(ClusterEvent::PublicAdd(m));
+            }
+            // passcode is checked and taken under the same shard lock
+            match shard.matches.try_insert(passcode, pending) {
+                Ok(()) => break passcode,
+                Err(value) => pending = value,
+            }
+            if public {
+                shard.public_matches.remove(&passcode);
+                self.publish(ClusterEvent::PublicRemove(passcode));
+            }
+        };
+        if public {
+            self.changed();
+        }
+        if let (Some(queues), Some(queued)) = (&self.queues, queued) {
+            queues.update(queued, |queue| queue.push_back(passcode));
+        }
+        passcode
+    }
+
+    // remove a waiting match from any shard, Some for exactly one caller when several race for it
+    pub fn take(&self, passcode: Passcode) -> Option<PendingMatch> {
+        let shard = self.owner(passcode)?;
+        let pending = shard.matches.remove(&passcode)?;
+        self.taken(shard, passcode, &pending);
+        Some(pending)
+    }
+
+    fn taken(&self, shard: &RegistryShard, passcode: Passcode, pending: &PendingMatch) {
+        if let (Some(queues), Some(queued)) = (&self.queues, pending.queued) {
+            queues.update(queued, |queue| {
+                if let Some(i) = queue.iter().position(|&p| p == passcode) {
+                    queue.remove(i);
+                }
+            });
+        }
+        if pending.visibility == Visibility::Public {
+            shard.public_matches.remove(&passcode);
+            self.publish(ClusterEvent::PublicRemove(passcode));
+            self.changed();
+        }
+    }
+
+    /* take the oldest waiting public match a public create can join instead, None without quick play.
+    A passcode taken from a queue is checked against the queue again,
+    it may have been taken or even handed out anew meanwhile. */
+    pub fn take_compatible(&self, m: &MatchSettings) -> Option<PendingMatch> {
+        let queues = self.queues.as_ref()?;
+        if m.visibility != Visibility::Public {
+            return None;
+        }
+        for &color in compatible_colors(m.color) {
+            let queued = bucket(m.clock, m.variant, color);
+            while let Some(passcode) = queues.update(queued, |queue| queue.pop_front()) {
+                let Some(shard) = self.owner(passcode) else {
+                    continue;
+                };
+                if let Some(pending) = shard
+                    .matches
+                    .remove_if(&passcode, |pending| pending.queued == Some(queued))
+                {
+                    self.taken(shard, passcode, &pending);
+                    return Some(pending);
+                }
+            }
+        }
+        None
+    }
+
+    // at most n public matches, taken from the shards in order, then from the other nodes
+    pub fn public_matches(&self, n: usize) -> Vec<MatchSettingsWithoutVisibility> {
+        let mut values = self.local_public_matches(n);
+        for node in self.remote.iter() {
+            if values.len() >= n {
+                break;
+            }
+            let node = lock(node, Lock::ClusterNodes);
+            values.extend(node.public_matches.values().take(n - values.len()).cloned());
+        }
+        values
+    }
+
+    fn local_public_matches(&self, n: usize) -> Vec<MatchSettingsWithoutVisibility> {
+        let mut values = Vec::with_capacity(n.min(HISTORY_LISTED + 1));
+        for shard in self.shards.iter() {
+            if values.len() >= n {
+                break;
+            }
+            values.extend(shard.public_matches.values(n - values.len()));
+        }
+        values
+    }
+
+    pub fn history_insert(&self, m: ServerHistoryMatch) -> HistoryTicket {
+        let ticket = self.history.insert(m.clone());
+        self.publish(ClusterEvent::HistoryInsert(ticket, m));
+        self.changed();
+        ticket
+    }
+
+    // both players complete their match, only the first one changes the list
+    pub fn history_complete(&self, ticket: HistoryTicket) {
+        if self.history.complete(ticket) {
+            self.publish(ClusterEvent::HistoryComplete(ticket));
+            self.changed();
+        }
+    }
+
+    // newest first, at most the capacity of the history, merged with the other nodes by start
+    pub fn history(&self, n: usize) -> Vec<ServerHistoryMatch> {
+        let mut matches: Vec<ServerHistoryMatch> =
+            self.history.latest(n).into_iter().map(|(_, m)| m).collect();
+        if self.remote.is_empty() {
+            return matches;
+        }
+        for node in self.remote.iter() {
+            let node = lock(node, Lock::ClusterNodes);
+            matches.extend(node.history.iter().rev().take(n).map(|(_, m)| m.clone()));
+        }
+        matches.sort_by(|a, b| b.time_start.cmp(&a.time_start));
+        matches.truncate(n);
+        matches
+    }
+
+    // every match the history of this node still keeps, newest first
+    pub fn history_kept(&self) -> Vec<ServerHistoryMatch> {
+        let matches = self.history.latest(self.history.capacity());
+        matches.into_iter().map(|(_, m)| m).collect()
+    }
+
+    // public matches and newest history of this node, as changes from an empty list
+    pub fn local_state(&self) -> Vec<ClusterEvent> {
+        let mut events: Vec<ClusterEvent> = self
+            .local_public_matches(usize::MAX)
+            .into_iter()
+            .map(ClusterEvent::PublicAdd)
+            .collect();
+        let history = self.history.latest(HISTORY_LISTED);
+        events.extend(
+            history
+                .into_iter()
+                .rev()
+                .map(|(ticket, m)| ClusterEvent::HistoryInsert(ticket, m)),
+        );
+        events
+    }
+
+    // a new link of another node replaces its previous one, returns its generation
+    pub fn remote_link(&self, node: usize) -> u64 {
+        let Some(node) = self.remote.get(node) else {
+            return 0;
+        };
+        let mut node = lock(node, Lock::ClusterNodes);
+        node.link += 1;
+        node.link
+    }
+
+    // change pushed by another node
+    pub fn remote_apply(&self, node: usize, link: u64, event: ClusterEvent) {
+        let Some(node) = self.remote.get(node) else {
+            return;
+        };
+        let mut node = lock(node, Lock::ClusterNodes);
+        if node.link != link {
+            return;
+        }
+        match event {
+            ClusterEvent::PublicAdd(m) => {
+                node.public_matches.insert(m.passcode, m);
+            }
+            ClusterEvent::PublicRemove(passcode) => {
+                node.public_matches.remove(&passcode);
+            }
+            ClusterEvent::HistoryInsert(ticket, m) => {
+                // a full state sent again may repeat entries, kept ordered by ticket
+                let i = node.history.partition_point(|&(t, _)| t < ticket);
+                match node.history.get_mut(i) {
+                    Some(entry) if entry.0 == ticket => entry.1 = m,
+                    _ => node.history.insert(i, (ticket, m)),
+                }
+                while node.history.len() > HISTORY_LISTED {
+                    node.history.pop_front();
+                }
+            }
+            ClusterEvent::HistoryComplete(ticket) => {
+                if let Some(entry) = node.history.iter_mut().find(|(t, _)| *t == ticket) {
+                    entry.1.state = HistoryMatchState::Completed;
+                }
+            }
+        }
+        drop(node);
+        self.changed();
+    }
+
+    // another node reset its link or lost it
+    pub fn remote_reset(&self, node: usize, link: u64) {
+        let Some(node) = self.remote.get(node) else {
+            return;
+        };
+        let mut node = lock(node, Lock::ClusterNodes);
+        if node.link != link {
+            return;
+        }
+        *node = RemoteNode {
+            link,
+            ..Default::default()
+        };
+        drop(node);
+        self.changed();
+    }
+}
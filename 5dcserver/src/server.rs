@@ -1,47 +1,233 @@
-use indexmap::IndexMap;
-use std::collections::{HashMap, HashSet};
+use byteorder::{ByteOrder, LittleEndian};
+use bytes::{Bytes, BytesMut};
 use std::error::Error;
 use std::io::ErrorKind;
 use std::net::SocketAddr;
 use std::sync::atomic::{AtomicI64, Ordering};
 use std::sync::Arc;
-use tokio::net::TcpStream;
+use std::time::Duration;
 use tokio::select;
-use tokio::sync::{broadcast, watch, Mutex};
+use tokio::sync::{mpsc, watch};
+use tokio::task::yield_now;
 use tokio::time::Instant;
 use tracing::{error, info, trace};
 
+use crate::cluster::{self, Cluster};
+use crate::config::{Live, LiveConfig, Snapshot};
 use crate::datatype::*;
+use crate::engine::Game;
+use crate::history::HISTORY_LISTED;
+use crate::limit::RateLimits;
+use crate::metrics::{message_kind, Lock, METRICS};
+use crate::registry::{lock, MatchRegistry, PendingMatch, ShardedMap};
+use crate::spectate::Spectated;
+use crate::timer::{Timeouts, Timer};
+
+// socket options and flush policy of client connections
+#[derive(Debug, Clone)]
+pub struct ConnectionOptions {
+    pub nodelay: bool,
+    pub send_buffer: usize,    // 0 keeps the kernel default
+    pub receive_buffer: usize, // 0 keeps the kernel default
+    pub lobby_flush: Duration, // longest wait of lobby replies for more frames, zero flushes at once
+    pub io_uring: bool,        // accept, read and write through the io_uring of every shard
+    pub rate_limits: RateLimits,
+    pub timeouts: Timeouts,
+}
+
+impl ConnectionOptions {
+    pub fn apply(&self, socket: socket2::SockRef) -> std::io::Result<()> {
+        socket.set_nodelay(self.nodelay)?;
+        if self.send_buffer != 0 {
+            socket.set_send_buffer_size(self.send_buffer)?;
+        }
+        if self.receive_buffer != 0 {
+            socket.set_recv_buffer_size(self.receive_buffer)?;
+        }
+        Ok(())
+    }
+}
 
 #[derive(Debug)]
 pub struct ServerState {
     pub match_id: AtomicI64,
-    pub matches: Mutex<HashMap<Passcode, broadcast::Receiver<Message>>>,
-    pub public_matches: Mutex<HashMap<Passcode, MatchSettingsWithoutVisibility>>,
-    pub server_history_matches: Mutex<IndexMap<MatchId, ServerHistoryMatch>>,
+    pub registry: MatchRegistry,
+    pub match_list_cache: std::sync::Mutex<Option<Arc<MatchListSnapshot>>>,
     pub instant_start: Instant,
-    pub allow_reset_puzzle: bool,
-    pub variants: HashSet<Variant>,
-    pub variants_without_random: Vec<Variant>,
+    pub config: Live<LiveConfig>, // reloaded while running
+    pub cluster: Option<Cluster>,
+    pub connection: ConnectionOptions,
+    pub spectated: Option<ShardedMap<MatchId, Arc<Spectated>>>, // running matches if spectated
 }
 
 impl ServerState {
-    pub fn new(allow_reset_puzzle: bool, variants: HashSet<Variant>) -> Self {
-        let mut variants_without_random = variants.clone();
-        variants_without_random.remove(&Variant::Random);
+    pub fn new(
+        config: LiveConfig,
+        shards: usize,
+        history_capacity: usize,
+        quick_play: bool,
+        cluster: Option<Cluster>,
+        connection: ConnectionOptions,
+        spectate: bool,
+    ) -> Self {
         ServerState {
             match_id: AtomicI64::new(1),
-            matches: Mutex::new(HashMap::new()),
-            public_matches: Mutex::new(HashMap::new()),
-            server_history_matches: Mutex::new(IndexMap::new()),
+            registry: MatchRegistry::new(shards, history_capacity, quick_play, cluster.as_ref()),
+            match_list_cache: std::sync::Mutex::new(None),
             instant_start: Instant::now(),
-            allow_reset_puzzle,
-            variants,
-            variants_without_random: Vec::from_iter(variants_without_random)
+            config: Live::new(config),
+            cluster,
+            connection,
+            spectated: spectate.then(|| ShardedMap::new(Lock::Spectated)),
+        }
+    }
+
+    // cached match list, rebuilt only when a public match or a history entry changed
+    // or when seconds passed of history entries ticked since it was built
+    pub fn match_list_snapshot(&self) -> Result<Arc<MatchListSnapshot>, Box<dyn Error>> {
+        let version = self.registry.version();
+        let seconds = Instant::now().duration_since(self.instant_start).as_secs();
+        if let Some(snapshot) = lock(&self.match_list_cache, Lock::MatchListCache).as_ref() {
+            if snapshot.version == version && snapshot.seconds == seconds {
+                return Ok(snapshot.clone());
+            }
+        }
+        let snapshot = Arc::new(MatchListSnapshot::build(self, version, seconds)?);
+        let mut cache = lock(&self.match_list_cache, Lock::MatchListCache);
+        match cache.as_ref() {
+            // keep a newer snapshot built concurrently
+            Some(cached) if (cached.version, cached.seconds) > (version, seconds) => {}
+            _ => *cache = Some(snapshot.clone()),
+        }
+        Ok(snapshot)
+    }
+}
+
+// offset of the action type in a packed C2SOrS2CAction frame
+const ACTION_TYPE_OFFSET: usize = 16;
+
+// offsets in a packed S2CMatchList frame
+const MATCH_LIST_HOST_OFFSET: usize = 24;
+const MATCH_LIST_PUBLIC_MATCHES_OFFSET: usize = 64;
+const MATCH_LIST_PUBLIC_MATCH_LENGTH: usize = 32;
+const MATCH_LIST_PUBLIC_MATCHES_COUNT_OFFSET: usize = 480;
+const MATCH_LIST_PUBLIC_MATCHES_KEPT: usize = 5 * 13;
+
+// S2CMatchList packed for non-hosts, patched per request for hosts
+#[derive(Debug)]
+pub struct MatchListSnapshot {
+    pub version: u64,
+    pub seconds: u64,
+    pub bytes: Bytes,
+    // the first public matches, more than are listed so that clients can page through them
+    pub public_matches: Vec<MatchSettingsWithoutVisibility>,
+}
+
+impl MatchListSnapshot {
+    fn build(ss: &ServerState, version: u64, seconds: u64) -> Result<Self, Box<dyn Error>> {
+        let public_matches = ss.registry.public_matches(MATCH_LIST_PUBLIC_MATCHES_KEPT);
+        let mut body = S2CMatchListNonhostBody {
+            public_matches: [MatchSettingsWithoutVisibility {
+                color: OptionalColorWithRandom::None,
+                clock: OptionalClock::None,
+                variant: Variant::Standard,
+                passcode: 0,
+                match_id: -1,
+            }; 13],
+            public_matches_count: public_matches.len().min(13),
+            server_history_matches: [S2CMatchListServerHistoryMatch {
+                state: HistoryMatchState::Completed,
+                clock: OptionalClock::None,
+                variant: Variant::Standard,
+                visibility: Visibility::Public,
+                seconds_passed: 0,
+            }; 13],
+            server_history_matches_count: 0,
+        };
+        for (i, public_match) in public_matches.iter().take(13).enumerate() {
+            body.public_matches[i] = public_match.clone();
+        }
+        let server_history_matches = ss.registry.history(HISTORY_LISTED);
+        for (i, server_history_match) in server_history_matches.iter().enumerate() {
+            body.server_history_matches[i] = server_history_match.clone().into();
+        }
+        body.server_history_matches_count = server_history_matches.len();
+        Ok(MatchListSnapshot {
+            version,
+            seconds,
+            bytes: Message::S2CMatchList(Box::new(S2CMatchListBody::Nonhost(body))).pack_frame()?,
+            public_matches,
+        })
+    }
+
+    /* copy for one client with the host header filled for hosts and their own match left out.
+    With more public matches than fit, the list is the page-th window of 13 of them,
+    so clients paging through see different matches instead of all racing for the first 13. */
+    pub fn packed_for(&self, host: Option<&MatchSettings>, page: usize) -> Bytes {
+        let listed = |public_match: &&MatchSettingsWithoutVisibility| {
+            host.map_or(true, |m| m.passcode != public_match.passcode)
+        };
+        let count = self.public_matches.iter().filter(listed).count();
+        if host.is_none() && count <= 13 {
+            return self.bytes.clone();
         }
+        let mut bytes = BytesMut::from(&self.bytes[..]);
+        if let Some(m) = host {
+            let header = &mut bytes[MATCH_LIST_HOST_OFFSET..MATCH_LIST_PUBLIC_MATCHES_OFFSET];
+            LittleEndian::write_i64(&mut header[0..8], m.color as i64);
+            LittleEndian::write_i64(&mut header[8..16], m.clock as i64);
+            LittleEndian::write_i64(&mut header[16..24], m.variant as i64);
+            LittleEndian::write_i64(&mut header[24..32], m.passcode);
+            LittleEndian::write_i64(&mut header[32..40], 1); // is_host
+        }
+        let offset =
+            |i: usize| MATCH_LIST_PUBLIC_MATCHES_OFFSET + i * MATCH_LIST_PUBLIC_MATCH_LENGTH;
+        let start = if count > 13 { page * 13 % count } else { 0 };
+        bytes[offset(0)..offset(13)].fill(0);
+        for (i, public_match) in self
+            .public_matches
+            .iter()
+            .filter(listed)
+            .cycle()
+            .skip(start)
+            .take(count.min(13))
+            .enumerate()
+        {
+            let entry = &mut bytes[offset(i)..offset(i + 1)];
+            LittleEndian::write_i64(&mut entry[0..8], public_match.color as i64);
+            LittleEndian::write_i64(&mut entry[8..16], public_match.clock as i64);
+            LittleEndian::write_i64(&mut entry[16..24], public_match.variant as i64);
+            LittleEndian::write_i64(&mut entry[24..32], public_match.passcode);
+        }
+        LittleEndian::write_u64(
+            &mut bytes[MATCH_LIST_PUBLIC_MATCHES_COUNT_OFFSET
+                ..MATCH_LIST_PUBLIC_MATCHES_COUNT_OFFSET + 8],
+            count.min(13) as u64,
+        );
+        bytes.freeze()
     }
 }
 
+// state of the whole server, only ever advances
+#[derive(Debug, Copy, Clone, PartialEq, PartialOrd)]
+pub enum RunState {
+    Running,
+    Draining, // no new connections or matches, running matches are played to the end
+    Stopped,
+}
+
+// advance the state of the server, false if it was already that far
+pub fn advance(running: &watch::Sender<RunState>, to: RunState) -> bool {
+    running.send_if_modified(|state| {
+        if *state < to {
+            *state = to;
+            true
+        } else {
+            false
+        }
+    })
+}
+
 /* state machine of one connection:
 Idle -> PublicWaiting -> Playing -> Idle
 Idle -> PrivateWaiting -> Playing -> Idle
@@ -53,34 +239,65 @@ pub enum ConnectionStateEnum {
     Playing,
 }
 
+// thinking time a player has left, and when its turn started if it is on
+#[derive(Debug, Copy, Clone)]
+pub struct Clock {
+    pub color: Color,
+    pub remaining: Duration,
+    pub turn: Option<Instant>,
+}
+
 #[derive(Debug)]
 pub struct ConnectionState {
     pub state: ConnectionStateEnum,
     pub ss: Arc<ServerState>,
+    pub shard: usize, // server shard running this connection
     pub addr: SocketAddr,
     pub io: MessageIO,
-    pub tx: Option<broadcast::Sender<Message>>,
-    pub rx: Option<broadcast::Receiver<Message>>,
+    pub tx: Option<PeerSender>,
+    pub rx: Option<PeerReceiver>,
     pub m: Option<MatchSettings>, // match is reserved as a key word
-    pub running: watch::Receiver<bool>,
+    pub game: Option<Box<Game>>,  // replica of the match when moves are validated
+    pub history: HistoryTicket,   // entry of the match in the server history
+    pub spectated: Option<Arc<Spectated>>, // log of the match read by spectators
+    pub list_page: usize,         // window of the public matches in the next match list
+    pub config: Snapshot<LiveConfig>, // settings as of the last message
+    pub proxy: Option<(usize, Passcode)>, // join to splice to another node of the cluster
+    pub running: watch::Receiver<RunState>,
+    pub timer: Option<Timer>, // deadline of the state, if any timeout is set
+    pub entered: Instant,     // when the state was entered
+    pub clock: Option<Clock>, // own clock of the match if enforced
 }
 
 impl ConnectionState {
     pub fn new(
         ss: Arc<ServerState>,
+        shard: usize,
         addr: SocketAddr,
-        stream: TcpStream,
-        running: watch::Receiver<bool>,
+        io: MessageIO,
+        running: watch::Receiver<RunState>,
     ) -> Self {
+        let config = ss.config.load();
+        let timer = ss.connection.timeouts.enabled().then(Timer::new);
         ConnectionState {
             state: ConnectionStateEnum::Idle,
             ss,
+            shard,
             addr,
-            io: MessageIO::new(stream),
+            io,
             tx: None,
             rx: None,
             m: None,
+            game: None,
+            history: 0,
+            spectated: None,
+            list_page: 0,
+            config,
+            proxy: None,
             running,
+            timer,
+            entered: Instant::now(),
+            clock: None,
         }
     }
 }
@@ -91,155 +308,332 @@ fn trace_error(cs: &mut ConnectionState, e: Box<dyn Error>) {
 
 pub async fn handle_connection(
     ss: Arc<ServerState>,
-    stream: TcpStream,
+    mut io: MessageIO,
     addr: SocketAddr,
-    running: watch::Receiver<bool>,
+    shard: usize,
+    running: watch::Receiver<RunState>,
 ) {
     info!("[{}:{}] Connected.", addr.ip(), addr.port());
-    let mut cs = ConnectionState::new(ss, addr, stream, running);
+    io.limit(ss.connection.rate_limits, addr);
+    METRICS.connected();
+    let mut cs = ConnectionState::new(ss, shard, addr, io, running);
+    rearm(&cs, Instant::now());
     match handle_connection_main_loop(&mut cs).await {
         Ok(()) => {}
         Err(e) => match e.downcast::<std::io::Error>() {
             Ok(e) if e.kind() == ErrorKind::ConnectionAborted => {}
             Ok(e) => trace_error(&mut cs, e),
-            Err(e) => match e.downcast::<broadcast::error::RecvError>() {
-                Ok(e) if e.as_ref() == &broadcast::error::RecvError::Closed => {}
-                Ok(e) => trace_error(&mut cs, e),
-                Err(e) => trace_error(&mut cs, e),
-            },
+            Err(e) => trace_error(&mut cs, e),
         },
     };
 
+    /* the rest of the connection goes to the node owning the passcode it joined.
+    That node runs its state and timeouts and closes it when done, so a draining server
+    keeps relaying its match, the connection is only cut once the server stops. */
+    if let Some((node, passcode)) = cs.proxy.take() {
+        let node = &cs.ss.cluster.as_ref().unwrap().nodes[node];
+        let result = select! {
+            result = cluster::splice(&mut cs.io, node, passcode) => result,
+            _ = stopped(&mut cs.running) => Ok(()),
+        };
+        if let Err(e) = result {
+            trace_error(&mut cs, e.into());
+        }
+    }
+
     // clean resources, remove match from public match list, etc.
     match cs.state {
         ConnectionStateEnum::Idle => {}
         ConnectionStateEnum::Waiting => {
-            let m = cs.m.unwrap();
-            if m.visibility == Visibility::Public {
-                cs.ss.public_matches.lock().await.remove(&m.passcode);
-            }
-            cs.ss.matches.lock().await.remove(&m.passcode);
-        }
-        ConnectionStateEnum::Playing => {
-            let match_id = cs.m.unwrap().match_id;
-            let mut server_history_matches = cs.ss.server_history_matches.lock().await;
-            match server_history_matches.get_mut(&match_id) {
-                Some(v) => {
-                    v.state = HistoryMatchState::Completed;
-                }
-                None => {}
-            }
+            cs.ss.registry.take(cs.m.unwrap().passcode);
         }
+        ConnectionStateEnum::Playing => end_match(&mut cs),
     }
     let _ = cs.io.close().await;
+    METRICS.disconnected();
     info!("[{}:{}] Disconnected.", cs.addr.ip(), cs.addr.port());
 }
 
+// number of already buffered messages handled before replies are flushed
+const MESSAGE_BATCH_MAX: usize = 16;
+
+// wakes once the server stops
+async fn stopped(running: &mut watch::Receiver<RunState>) {
+    while *running.borrow_and_update() != RunState::Stopped {
+        if running.changed().await.is_err() {
+            return;
+        }
+    }
+}
+
+// connections close when stopped, and when draining unless they are in a match
+fn stopping(cs: &ConnectionState) -> bool {
+    match *cs.running.borrow() {
+        RunState::Running => false,
+        RunState::Draining => cs.state != ConnectionStateEnum::Playing,
+        RunState::Stopped => true,
+    }
+}
+
 async fn handle_connection_main_loop(cs: &mut ConnectionState) -> Result<(), Box<dyn Error>> {
     loop {
-        match cs.state {
+        if stopping(cs) {
+            break;
+        }
+        // a single await of the handlers keeps the future of an idle connection small
+        let msg = match cs.state {
             ConnectionStateEnum::Idle => select! {
-                result = cs.io.get() => handle_connection_idle(cs, result?).await?,
-                result = cs.running.changed() => break result?
+                result = cs.io.get() => result?,
+                _ = expired(&cs.timer) => match due(cs) {
+                    true => Message::InternalTimeout,
+                    false => continue,
+                },
+                result = cs.running.changed() => {
+                    result?;
+                    continue;
+                }
             },
             ConnectionStateEnum::Waiting => select! {
-                result = cs.io.get() => handle_connection_waiting(cs, result?).await?,
-                result = cs.rx.as_mut().unwrap().recv() => handle_connection_waiting(cs, result?).await?,
-                result = cs.running.changed() => break result?
+                result = cs.io.get() => result?,
+                result = cs.rx.as_mut().unwrap().recv() => match result {
+                    Some(msg) => msg,
+                    None => err_disconnected!()?,
+                },
+                _ = expired(&cs.timer) => match due(cs) {
+                    true => Message::InternalTimeout,
+                    false => continue,
+                },
+                result = cs.running.changed() => {
+                    result?;
+                    continue;
+                }
             },
             ConnectionStateEnum::Playing => select! {
-                result = cs.io.get() => handle_connection_playing(cs, result?).await?,
-                result = cs.rx.as_mut().unwrap().recv() => {
-                    match result {
-                        Ok(msg) => handle_connection_playing(cs, msg).await?,
-                        Err(e) => {
-                            if e == broadcast::error::RecvError::Closed {
-                                // handle unexpected opponent disconnect
-                                handle_connection_playing(cs, Message::InternalForfeit).await?;
-                            } else {
-                                Err(e)?
-                            }
-                        },
-                    };
+                result = cs.io.get() => result?,
+                result = cs.rx.as_mut().unwrap().recv() => match result {
+                    Some(msg) => msg,
+                    // handle unexpected opponent disconnect
+                    None => Message::InternalForfeit,
                 },
-                result = cs.running.changed() => break result?
+                _ = expired(&cs.timer) => match due(cs) {
+                    true => Message::InternalTimeout,
+                    false => continue,
+                },
+                result = cs.running.changed() => {
+                    result?;
+                    continue;
+                }
             },
+        };
+        handle_message(cs, msg).await?;
+        // batch frames that are ready into the same write
+        for _ in 0..MESSAGE_BATCH_MAX {
+            if cs.proxy.is_some() {
+                break;
+            }
+            match try_next(cs) {
+                Some(msg) => handle_message(cs, msg?).await?,
+                None => break,
+            }
+        }
+        if cs.io.queued() && !cs.io.urgent() && !cs.ss.connection.lobby_flush.is_zero() {
+            coalesce(cs).await?;
         }
         cs.io.flush().await?;
+        if cs.proxy.is_some() {
+            break;
+        }
     }
     Ok(())
 }
 
-fn peer_send(cs: &mut ConnectionState, msg: Message) -> Result<(), Box<dyn Error>> {
-    trace!("Internal {:?}", msg);
-    cs.tx.as_mut().unwrap().send(msg)?;
+// wakes once the deadline of the connection passed, never without a timer
+async fn expired(timer: &Option<Timer>) {
+    match timer {
+        Some(timer) => timer.expired().await,
+        None => std::future::pending().await,
+    }
+}
+
+fn due(cs: &ConnectionState) -> bool {
+    cs.timer.as_ref().map_or(false, Timer::due)
+}
+
+// message from the peer or the client that is ready without waiting
+fn try_next(cs: &mut ConnectionState) -> Option<std::io::Result<Message>> {
+    if let Some(Ok(msg)) = cs.rx.as_mut().map(|rx| rx.try_recv()) {
+        Some(Ok(msg))
+    } else {
+        cs.io.try_get()
+    }
+}
+
+/* hold lobby replies so that frames arriving meanwhile share their write.
+Timers only tick in milliseconds, so the connection yields to the others instead of sleeping,
+but only once: yielding until the flush budget ran out would spin a core on every idle
+connection. Frames ready after that round are handled until the budget is spent,
+and it stops waiting as soon as a frame of a match is queued. */
+async fn coalesce(cs: &mut ConnectionState) -> Result<(), Box<dyn Error>> {
+    let deadline = Instant::now() + cs.ss.connection.lobby_flush;
+    let mut yielded = false;
+    while !cs.io.urgent() && cs.proxy.is_none() && Instant::now() < deadline {
+        match try_next(cs) {
+            Some(msg) => handle_message(cs, msg?).await?,
+            None if yielded => break,
+            None => {
+                yield_now().await;
+                yielded = true;
+            }
+        }
+    }
     Ok(())
 }
 
-async fn handle_match_list_request(
-    cs: &mut ConnectionState,
-    m: Option<MatchSettings>,
-) -> Result<(), Box<dyn Error>> {
-    let mut public_matches_count = 0;
-    let server_history_matches_count = cs.ss.server_history_matches.lock().await.len();
-    let mut body = S2CMatchListNonhostBody {
-        public_matches: [MatchSettingsWithoutVisibility {
-            color: OptionalColorWithRandom::None,
-            clock: OptionalClock::None,
-            variant: Variant::Standard,
-            passcode: 0,
-            match_id: -1,
-        }; 13],
-        public_matches_count,
-        server_history_matches: [S2CMatchListServerHistoryMatch {
-            state: HistoryMatchState::Completed,
-            clock: OptionalClock::None,
-            variant: Variant::Standard,
-            visibility: Visibility::Public,
-            seconds_passed: 0,
-        }; 13],
-        server_history_matches_count,
+async fn handle_message(cs: &mut ConnectionState, msg: Message) -> Result<(), Box<dyn Error>> {
+    let start = Instant::now();
+    cs.ss.config.refresh(&mut cs.config);
+    let state = cs.state;
+    let kind = message_kind(&msg);
+    let result = match state {
+        ConnectionStateEnum::Idle => handle_connection_idle(cs, msg).await,
+        ConnectionStateEnum::Waiting => handle_connection_waiting(cs, msg).await,
+        ConnectionStateEnum::Playing => handle_connection_playing(cs, msg).await,
     };
-    for (_i, (_passcode, public_match)) in cs.ss.public_matches.lock().await.iter().enumerate() {
-        match m {
-            // skip host match
-            Some(m) if m.match_id == public_match.match_id => {}
-            _ => {
-                if public_matches_count >= 13 {
-                    break;
-                }
-                body.public_matches[public_matches_count] = public_match.clone();
-                public_matches_count += 1;
+    if cs.state != state {
+        cs.entered = start;
+    }
+    rearm(cs, start);
+    METRICS.handler_time(state as usize, kind, start.elapsed());
+    result
+}
+
+/* deadline of the connection in its state: the last message plus the idle timeout,
+the creation plus the waiting timeout, or the end of its own clock while on turn.
+A deadline pushed back is only stored, so this is cheap to do for every message. */
+fn rearm(cs: &ConnectionState, now: Instant) {
+    let timer = match cs.timer.as_ref() {
+        Some(timer) => timer,
+        None => return,
+    };
+    let timeouts = &cs.ss.connection.timeouts;
+    let after = |since: Instant, timeout: Duration| (!timeout.is_zero()).then(|| since + timeout);
+    timer.set(match cs.state {
+        ConnectionStateEnum::Idle => after(now, timeouts.idle),
+        ConnectionStateEnum::Waiting => after(cs.entered, timeouts.waiting),
+        ConnectionStateEnum::Playing => cs
+            .clock
+            .and_then(|clock| clock.turn.map(|turn| turn + clock.remaining)),
+    });
+}
+
+// own clock of a starting match, white is on turn first
+fn new_clock(cs: &ConnectionState, m: &MatchSettingsWithoutVisibility) -> Option<Clock> {
+    let remaining = cs.ss.connection.timeouts.clock(m.clock)?;
+    let color = m.color.try_into().ok()?;
+    Some(Clock {
+        color,
+        remaining,
+        turn: (color == Color::White).then(Instant::now),
+    })
+}
+
+// submitting moves ends the turn of a player and starts the one of its opponent
+fn next_turn(cs: &mut ConnectionState, own: bool) {
+    if let Some(clock) = cs.clock.as_mut() {
+        match (own, clock.turn) {
+            (true, Some(turn)) => {
+                clock.remaining = clock.remaining.saturating_sub(turn.elapsed());
+                clock.turn = None;
             }
+            (false, None) => clock.turn = Some(Instant::now()),
+            _ => {}
         }
     }
-    body.public_matches_count = public_matches_count;
-    for (i, (_match_id, server_history_match)) in
-        cs.ss.server_history_matches.lock().await.iter().enumerate()
-    {
-        body.server_history_matches[server_history_matches_count - i - 1] =
-            server_history_match.clone().into();
+}
+
+/* replica of a starting match when moves are validated, None for variants without a known layout.
+The creator decides for both ends, so a reload between them never leaves one side unchecked. */
+fn new_game(m: &MatchSettingsWithoutVisibility, validate: bool) -> Option<Box<Game>> {
+    if !validate {
+        return None;
     }
-    match m {
-        Some(m) => {
-            cs.io
-                .put(Message::S2CMatchList(S2CMatchListBody::Host(
-                    S2CMatchListHostBody {
-                        color: m.color,
-                        clock: m.clock,
-                        variant: m.variant,
-                        passcode: m.passcode,
-                        body,
-                    },
-                )))
-                .await?;
-        }
-        None => {
-            cs.io
-                .put(Message::S2CMatchList(S2CMatchListBody::Nonhost(body)))
-                .await?;
+    Game::new(m.variant, m.color.try_into().ok()?).map(Box::new)
+}
+
+// completed in the server history, spectators get the rest of the log and are closed
+fn end_match(cs: &mut ConnectionState) {
+    cs.ss.registry.history_complete(cs.history);
+    cs.clock = None;
+    if let Some(log) = cs.spectated.take() {
+        log.end();
+        if let Some(spectated) = cs.ss.spectated.as_ref() {
+            spectated.remove_if(&log.start.match_id, |other| Arc::ptr_eq(other, &log));
         }
     }
+}
+
+fn peer_send(cs: &mut ConnectionState, msg: Message) -> Result<(), Box<dyn Error>> {
+    trace!("Internal {:?}", msg);
+    match cs.tx.as_mut().unwrap().try_send(msg) {
+        Ok(()) => Ok(()),
+        Err(mpsc::error::TrySendError::Full(_)) => {
+            METRICS.shed();
+            err_invalid_data!(
+                "Sent {} frames ahead of the opponent reading them.",
+                PEER_PIPE_CAPACITY
+            )?
+        }
+        Err(e) => Err(e)?,
+    }
+}
+
+async fn handle_match_list_request(
+    cs: &mut ConnectionState,
+    m: Option<MatchSettings>,
+) -> Result<(), Box<dyn Error>> {
+    let snapshot = cs.ss.match_list_snapshot()?;
+    cs.io
+        .put_packed(snapshot.packed_for(m.as_ref(), cs.list_page))?;
+    cs.list_page = cs.list_page.wrapping_add(1);
+    Ok(())
+}
+
+// join a waiting match, the creator picks the opposite color if it asked for none in particular
+async fn join(
+    cs: &mut ConnectionState,
+    pending: PendingMatch,
+    color: OptionalColorWithRandom,
+) -> Result<(), Box<dyn Error>> {
+    let visibility = pending.visibility;
+    let mut rx = pending.rx;
+    cs.tx = Some(pending.tx);
+    // notify peer
+    peer_send(cs, Message::InternalJoin(color))?;
+    // receive match information from peer
+    let (body, history, validate) = match rx.recv().await {
+        Some(Message::InternalMatchStart(body, history, validate)) => (body, history, validate),
+        Some(_) => unreachable!(),
+        None => err_disconnected!()?,
+    };
+    cs.rx = Some(rx);
+    cs.history = history;
+    cs.spectated = cs
+        .ss
+        .spectated
+        .as_ref()
+        .and_then(|spectated| spectated.get(&body.match_id));
+    cs.m = Some(MatchSettings::new(body.m, visibility));
+    cs.game = new_game(&body.m, validate);
+    cs.clock = new_clock(cs, &body.m);
+    cs.state = ConnectionStateEnum::Playing;
+    cs.io.put(Message::S2CMatchCreateOrJoinResult(
+        S2CMatchCreateOrJoinResultBody::Success(MatchSettings::new(body.m, visibility)),
+    ))?;
+    cs.io.put(Message::S2CMatchStart(S2CMatchStartBody {
+        m: body.m,
+        match_id: body.match_id,
+        seconds_passed: body.seconds_passed,
+    }))?;
     Ok(())
 }
 
@@ -249,118 +643,64 @@ async fn handle_connection_idle(
 ) -> Result<(), Box<dyn Error>> {
     match msg {
         Message::C2SGreet(_body) => {
-            cs.io.put(Message::S2CGreet).await?;
+            cs.io.put(Message::S2CGreet)?;
         }
         Message::C2SMatchCreateOrJoin(C2SMatchCreateOrJoinBody::Create(mut m)) => {
             // create match
-            if !cs.ss.variants.contains(&m.variant) {
+            if !cs.config.allows(m.variant) {
                 err_invalid_data!("Variant {:?} is not allowed.", m.variant)?;
             }
-            m.passcode = generate_random_passcode_internal_with_exceptions(&cs.ss.matches).await;
-            let (tx, rx_peer) = broadcast::channel(8);
-            let (tx_peer, rx) = broadcast::channel(8);
+            // quick play, join a compatible public match instead
+            if let Some(pending) = cs.ss.registry.take_compatible(&m) {
+                return join(cs, pending, m.color).await;
+            }
+            let (tx, rx_peer) = mpsc::channel(PEER_PIPE_CAPACITY);
+            let (tx_peer, rx) = mpsc::channel(PEER_PIPE_CAPACITY);
             cs.tx = Some(tx);
             cs.rx = Some(rx);
-            // store tx_peer in rx_peer
-            peer_send(cs, Message::InternalInitialize(tx_peer))?;
-            // add to match list
-            cs.ss.matches.lock().await.insert(m.passcode, rx_peer);
+            // add to match list and public match list on our shard, the peer ends wait for the joiner
             m.match_id = cs.ss.match_id.fetch_add(1, Ordering::Relaxed);
-            if m.visibility == Visibility::Public {
-                // add to public match list
-                cs.ss
-                    .public_matches
-                    .lock()
-                    .await
-                    .insert(m.passcode, m.clone().into());
-                // TODO: limit number of public matches
-            }
+            m.passcode = cs.ss.registry.create(cs.shard, &m, tx_peer, rx_peer);
+            // TODO: limit number of public matches
             cs.m = Some(m);
             cs.state = ConnectionStateEnum::Waiting;
-            cs.io
-                .put(Message::S2CMatchCreateOrJoinResult(
-                    S2CMatchCreateOrJoinResultBody::Success(m.clone()),
-                ))
-                .await?;
+            cs.io.put(Message::S2CMatchCreateOrJoinResult(
+                S2CMatchCreateOrJoinResultBody::Success(m.clone()),
+            ))?;
         }
         Message::C2SMatchCreateOrJoin(C2SMatchCreateOrJoinBody::Join(passcode)) => {
             // join match
-            // remove from match list
-            let rx = cs.ss.matches.lock().await.remove(&passcode);
-            match rx {
-                Some(mut rx) => {
-                    // match found
-                    // remove from public match list
-                    let visibility = if cs
-                        .ss
-                        .public_matches
-                        .lock()
-                        .await
-                        .remove(&passcode)
-                        .is_some()
-                    {
-                        Visibility::Public
-                    } else {
-                        Visibility::Private
-                    };
-                    // receive sender from peer
-                    let tx = match rx.recv().await? {
-                        Message::InternalInitialize(tx) => tx,
-                        _ => unreachable!(),
-                    };
-                    cs.tx = Some(tx);
-                    // notify peer
-                    peer_send(cs, Message::InternalJoin)?;
-                    // receive match information from peer
-                    let body = match rx.recv().await? {
-                        Message::InternalMatchStart(body) => body,
-                        _ => unreachable!(),
-                    };
-                    cs.rx = Some(rx);
-                    let mut server_history_matches = cs.ss.server_history_matches.lock().await;
-                    server_history_matches.insert(
-                        body.match_id,
-                        ServerHistoryMatch::new(MatchSettings::new(body.m, visibility)),
-                    );
-                    if server_history_matches.len() > 13 {
-                        server_history_matches.shift_remove_index(0);
-                    }
-                    cs.m = Some(MatchSettings::new(body.m, visibility));
-                    cs.state = ConnectionStateEnum::Playing;
-                    cs.io
-                        .put(Message::S2CMatchCreateOrJoinResult(
-                            S2CMatchCreateOrJoinResultBody::Success(MatchSettings::new(
-                                body.m, visibility,
-                            )),
-                        ))
-                        .await?;
-                    cs.io
-                        .put(Message::S2CMatchStart(S2CMatchStartBody {
-                            m: body.m,
-                            match_id: body.match_id,
-                            seconds_passed: body.seconds_passed,
-                        }))
-                        .await?;
-                }
-                None => {
-                    // match not found
-                    cs.io
-                        .put(Message::S2CMatchCreateOrJoinResult(
+            // remove from match list and public match list of the shard owning the passcode
+            match cs.ss.registry.take(passcode) {
+                Some(pending) => join(cs, pending, OptionalColorWithRandom::Random).await?,
+                None => match cs
+                    .ss
+                    .cluster
+                    .as_ref()
+                    .and_then(|c| c.remote_owner(passcode))
+                {
+                    // joined on the owning node once this connection is spliced to it
+                    Some(node) => cs.proxy = Some((node, passcode)),
+                    None => {
+                        // match not found
+                        cs.io.put(Message::S2CMatchCreateOrJoinResult(
                             S2CMatchCreateOrJoinResultBody::Failed,
-                        ))
-                        .await?;
-                }
+                        ))?;
+                    }
+                },
             }
         }
         Message::C2SMatchCancel => {
-            cs.io
-                .put(Message::S2CMatchCancelResult(
-                    S2CMatchCancelResultBody::Failed,
-                ))
-                .await?;
+            cs.io.put(Message::S2CMatchCancelResult(
+                S2CMatchCancelResultBody::Failed,
+            ))?;
         }
         Message::C2SForfeit => {}
         Message::C2SMatchListRequest => handle_match_list_request(cs, None).await?,
+        Message::InternalTimeout => {
+            METRICS.timed_out(ConnectionStateEnum::Idle as usize);
+            err_timed_out!("Idle for {:?}.", cs.ss.connection.timeouts.idle)?;
+        }
         other => err_invalid_data!("Invalid message {:?} at state Idle.", other)?,
     }
     Ok(())
@@ -372,32 +712,59 @@ async fn handle_connection_waiting(
 ) -> Result<(), Box<dyn Error>> {
     match msg {
         Message::C2SMatchCancel => {
-            let passcode = cs.m.unwrap().passcode;
-            cs.ss.public_matches.lock().await.remove(&passcode);
-            cs.ss.matches.lock().await.remove(&passcode);
+            cs.ss.registry.take(cs.m.unwrap().passcode);
             cs.tx = None;
             cs.rx = None;
             cs.m = None;
             cs.state = ConnectionStateEnum::Idle;
-            cs.io
-                .put(Message::S2CMatchCancelResult(
-                    S2CMatchCancelResultBody::Success,
-                ))
-                .await?;
+            cs.io.put(Message::S2CMatchCancelResult(
+                S2CMatchCancelResultBody::Success,
+            ))?;
         }
         Message::C2SMatchListRequest => handle_match_list_request(cs, cs.m).await?,
-        Message::InternalJoin => {
+        Message::InternalJoin(color) => {
             let mut body = S2CMatchStartBody {
                 m: cs.m.unwrap().into(),
                 match_id: cs.m.unwrap().match_id,
                 seconds_passed: Instant::now().duration_since(cs.ss.instant_start).as_secs(),
             };
             cs.state = ConnectionStateEnum::Playing;
-            body.m.variant = body.m.variant.determined(&cs.ss.variants_without_random);
-            body.m.color = body.m.color.determined();
-            cs.io.put(Message::S2CMatchStart(body)).await?;
+            body.m.variant = cs.config.determined(body.m.variant);
+            body.m.color = match (body.m.color, color) {
+                (
+                    OptionalColorWithRandom::Random,
+                    OptionalColorWithRandom::White | OptionalColorWithRandom::Black,
+                ) => color.reversed(),
+                (color, _) => color.determined(),
+            };
+            let validate = cs.config.validate_moves;
+            cs.game = new_game(&body.m, validate);
+            cs.clock = new_clock(cs, &body.m);
+            // recorded by the creator, the joiner completes it with the ticket it is sent
+            cs.history =
+                cs.ss
+                    .registry
+                    .history_insert(ServerHistoryMatch::new(MatchSettings::new(
+                        body.m,
+                        cs.m.unwrap().visibility,
+                    )));
+            // shared with the joiner through the registry before it is told the match started
+            if let Some(spectated) = cs.ss.spectated.as_ref() {
+                let log = Arc::new(Spectated::new(body));
+                spectated.insert(body.match_id, log.clone());
+                cs.spectated = Some(log);
+            }
+            cs.io.put(Message::S2CMatchStart(body))?;
             body.m.color = body.m.color.reversed();
-            peer_send(cs, Message::InternalMatchStart(body))?;
+            peer_send(cs, Message::InternalMatchStart(body, cs.history, validate))?;
+        }
+        // taken off the public matches as the connection closes
+        Message::InternalTimeout => {
+            METRICS.timed_out(ConnectionStateEnum::Waiting as usize);
+            err_timed_out!(
+                "No opponent joined in {:?}.",
+                cs.ss.connection.timeouts.waiting
+            )?;
         }
         other => err_invalid_data!("Invalid message {:?} at state Waiting.", other)?,
     }
@@ -411,45 +778,100 @@ async fn handle_connection_playing(
     match msg {
         Message::C2SForfeit => {
             peer_send(cs, Message::InternalForfeit)?;
-            let match_id = cs.m.unwrap().match_id;
-            let mut server_history_matches = cs.ss.server_history_matches.lock().await;
-            match server_history_matches.get_mut(&match_id) {
-                Some(v) => {
-                    v.state = HistoryMatchState::Completed;
-                }
-                None => {}
-            }
+            end_match(cs);
             cs.tx = None;
             cs.rx = None;
             cs.m = None;
+            cs.game = None;
             cs.state = ConnectionStateEnum::Idle;
         }
         Message::C2SOrS2CAction(mut body) => {
-            if (!cs.ss.allow_reset_puzzle) && body.action_type == ActionType::ResetPuzzle {
+            if (!cs.config.allow_reset_puzzle) && body.action_type == ActionType::ResetPuzzle {
                 err_invalid_data!("Action type of {:?} is not allowed.", body.action_type)?;
             }
-            body.seconds_passed = Instant::now().duration_since(cs.ss.instant_start).as_secs();
-            peer_send(cs, Message::InternalAction(body))?;
-            cs.io.put(Message::C2SOrS2CAction(body)).await?;
+            if let Some(game) = cs.game.as_mut() {
+                if let Err(e) = game.apply(&body, true) {
+                    METRICS.move_rejected();
+                    Err(e)?;
+                }
+            }
+            let start = Instant::now();
+            body.seconds_passed = start.duration_since(cs.ss.instant_start).as_secs();
+            // packed once, the same frame is forwarded to the peer and echoed back
+            let frame = Message::C2SOrS2CAction(body).pack_frame()?;
+            peer_send(cs, Message::InternalAction(frame.clone(), start))?;
+            if let Some(spectated) = cs.spectated.as_ref() {
+                spectated.push(frame.clone());
+            }
+            if body.action_type == ActionType::SubmitMoves {
+                next_turn(cs, true);
+            }
+            cs.io.put_packed(frame)?;
         }
         Message::C2SMatchListRequest => handle_match_list_request(cs, None).await?,
         Message::InternalForfeit => {
-            let match_id = cs.m.unwrap().match_id;
-            let mut server_history_matches = cs.ss.server_history_matches.lock().await;
-            match server_history_matches.get_mut(&match_id) {
-                Some(v) => {
-                    v.state = HistoryMatchState::Completed;
-                }
-                None => {}
-            }
+            end_match(cs);
             cs.tx = None;
             cs.rx = None;
             cs.m = None;
+            cs.game = None;
             cs.state = ConnectionStateEnum::Idle;
-            cs.io.put(Message::S2COpponentLeft).await?;
+            cs.io.put(Message::S2COpponentLeft)?;
         }
-        Message::InternalAction(body) => {
-            cs.io.put(Message::C2SOrS2CAction(body)).await?;
+        Message::InternalAction(frame, start) => {
+            // checked by the peer, a replica that can't follow stops checking the match
+            if let Some(game) = cs.game.as_mut() {
+                let applied = match Message::unpack(&frame[8..]) {
+                    Ok(Message::C2SOrS2CAction(body)) => game.apply(&body, false),
+                    Ok(_) => unreachable!(),
+                    Err(e) => Err(e),
+                };
+                if let Err(e) = applied {
+                    error!(
+                        "[{}:{}] Stopped validating moves: {}",
+                        cs.addr.ip(),
+                        cs.addr.port(),
+                        e
+                    );
+                    cs.game = None;
+                }
+            }
+            if cs.clock.is_some()
+                && LittleEndian::read_i64(&frame[ACTION_TYPE_OFFSET..ACTION_TYPE_OFFSET + 8])
+                    == ActionType::SubmitMoves as i64
+            {
+                next_turn(cs, false);
+            }
+            cs.io.put_packed(frame)?;
+            METRICS.relay_time(start.elapsed());
+        }
+        /* out of thinking time, judged by the clients but enforced for one that never ends its
+        turn. A bare header tells the opponent this player timed out, then the connection closes
+        and the opponent is told it left, which ends the match like a disconnect. */
+        Message::InternalTimeout => {
+            METRICS.timed_out(ConnectionStateEnum::Playing as usize);
+            let color = cs.clock.unwrap().color;
+            let body = C2SOrS2CActionBody {
+                action_type: ActionType::Header,
+                color,
+                seconds_passed: Instant::now().duration_since(cs.ss.instant_start).as_secs(),
+                src_l: 0,
+                src_t: 0,
+                src_board_color: color,
+                src_y: 0,
+                src_x: 0,
+                dst_l: 0,
+                dst_t: 0,
+                dst_board_color: color,
+                dst_y: 0,
+                dst_x: 0,
+            };
+            let frame = Message::C2SOrS2CAction(body).pack_frame()?;
+            peer_send(cs, Message::InternalAction(frame.clone(), Instant::now()))?;
+            if let Some(spectated) = cs.spectated.as_ref() {
+                spectated.push(frame);
+            }
+            err_timed_out!("Ran out of time on the clock.")?;
         }
         other => err_invalid_data!("Invalid message {:?} at state Playing.", other)?,
     }
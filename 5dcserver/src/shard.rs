@@ -0,0 +1,227 @@
+use socket2::{Domain, Protocol, SockRef, Socket, Type};
+use std::io::{Error, ErrorKind, Result};
+use std::net::{SocketAddr, ToSocketAddrs};
+use std::sync::Arc;
+use std::time::Duration;
+use tokio::net::TcpListener;
+use tokio::select;
+use tokio::sync::watch;
+use tokio::task::JoinSet;
+use tokio::time::sleep;
+use tracing::{error, info};
+
+use crate::datatype::MessageIO;
+use crate::server::{handle_connection, RunState, ServerState};
+#[cfg(target_os = "linux")]
+use crate::uring;
+
+/* accept loops of the server.
+Without shards a single listener runs on the default multi-threaded runtime.
+With N shards every shard is a thread pinned to a core running its own current-thread runtime
+and its own SO_REUSEPORT listener on the same address, the kernel spreads connections over them.
+Connections stay on the runtime of the shard that accepted them.
+With io_uring every shard accepts, reads and writes through a ring of its own,
+shards lacking one fall back to the reactor. */
+
+const LISTEN_BACKLOG: i32 = 1024;
+const ACCEPT_RETRY_DELAY: Duration = Duration::from_millis(50); // e.g. when out of file descriptors
+const BIND_RETRY_DELAY: Duration = Duration::from_secs(1);
+
+pub fn resolve(addr: &str, port: u16) -> Result<SocketAddr> {
+    (addr, port).to_socket_addrs()?.next().ok_or_else(|| {
+        Error::new(
+            ErrorKind::AddrNotAvailable,
+            format!("{}:{} resolves to no address.", addr, port),
+        )
+    })
+}
+
+// nonblocking listener sharing its address with the other shards
+pub fn bind_reuse_port(addr: SocketAddr) -> Result<std::net::TcpListener> {
+    let socket = Socket::new(Domain::for_address(addr), Type::STREAM, Some(Protocol::TCP))?;
+    socket.set_reuse_address(true)?;
+    socket.set_reuse_port(true)?;
+    socket.set_nonblocking(true)?;
+    socket.bind(&addr.into())?;
+    socket.listen(LISTEN_BACKLOG)?;
+    Ok(socket.into())
+}
+
+// bind addr once it is free, a server being taken over keeps its other ports until it exits
+pub async fn bind_when_free(addr: &str) -> Result<TcpListener> {
+    let mut waiting = false;
+    loop {
+        match TcpListener::bind(addr).await {
+            Err(e) if e.kind() == ErrorKind::AddrInUse => {
+                if !waiting {
+                    info!("{} is in use, waiting for it ...", addr);
+                    waiting = true;
+                }
+                sleep(BIND_RETRY_DELAY).await;
+            }
+            result => return result,
+        }
+    }
+}
+
+// raise the soft limit of open files to the hard limit, every connection holds one
+#[cfg(unix)]
+pub fn raise_fd_limit() {
+    unsafe {
+        let mut limit: libc::rlimit = std::mem::zeroed();
+        if libc::getrlimit(libc::RLIMIT_NOFILE, &mut limit) == 0 && limit.rlim_cur < limit.rlim_max
+        {
+            limit.rlim_cur = limit.rlim_max;
+            if libc::setrlimit(libc::RLIMIT_NOFILE, &limit) != 0 {
+                error!("Failed to raise the limit of open files.");
+            }
+        }
+    }
+}
+
+#[cfg(not(unix))]
+pub fn raise_fd_limit() {}
+
+// pin the calling thread to the i-th core it is allowed to run on
+#[cfg(target_os = "linux")]
+pub fn pin_to_core(i: usize) {
+    unsafe {
+        let mut allowed: libc::cpu_set_t = std::mem::zeroed();
+        if libc::sched_getaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &mut allowed) != 0 {
+            return;
+        }
+        let cores: Vec<usize> = (0..libc::CPU_SETSIZE as usize)
+            .filter(|&core| libc::CPU_ISSET(core, &allowed))
+            .collect();
+        if cores.is_empty() {
+            return;
+        }
+        let mut set: libc::cpu_set_t = std::mem::zeroed();
+        libc::CPU_SET(cores[i % cores.len()], &mut set);
+        if libc::sched_setaffinity(0, std::mem::size_of::<libc::cpu_set_t>(), &set) != 0 {
+            error!(
+                "Failed to pin shard {} to core {}.",
+                i,
+                cores[i % cores.len()]
+            );
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+pub fn pin_to_core(_i: usize) {}
+
+#[derive(Debug)]
+pub enum Listener {
+    Tokio(TcpListener),
+    #[cfg(target_os = "linux")]
+    Uring(uring::Listener),
+}
+
+impl From<TcpListener> for Listener {
+    fn from(listener: TcpListener) -> Self {
+        Listener::Tokio(listener)
+    }
+}
+
+impl Listener {
+    // cancel safe, as both listeners queue accepted connections
+    async fn accept(&self, state: &ServerState) -> Result<(MessageIO, SocketAddr)> {
+        match self {
+            Listener::Tokio(listener) => {
+                let (stream, addr) = listener.accept().await?;
+                apply_options(state, SockRef::from(&stream), addr);
+                Ok((MessageIO::new(stream), addr))
+            }
+            #[cfg(target_os = "linux")]
+            Listener::Uring(listener) => {
+                let (stream, addr) = listener.accept().await?;
+                apply_options(state, SockRef::from(&stream), addr);
+                Ok((MessageIO::new_uring(uring::Socket::new(stream)?), addr))
+            }
+        }
+    }
+}
+
+fn apply_options(state: &ServerState, socket: SockRef, addr: SocketAddr) {
+    if let Err(e) = state.connection.apply(socket) {
+        error!(
+            "[{}:{}] Failed to set socket options: {}",
+            addr.ip(),
+            addr.port(),
+            e
+        );
+    }
+}
+
+// accept connections until draining or stopped, then wait for them to finish
+pub async fn serve(
+    state: Arc<ServerState>,
+    listener: Listener,
+    shard: usize,
+    mut running: watch::Receiver<RunState>,
+) -> Result<()> {
+    // finished connections are reaped as they end, so the set only holds live ones
+    let mut connections = JoinSet::new();
+    loop {
+        select! {
+            result = listener.accept(&state) => match result {
+                Ok((io, addr)) => {
+                    connections.spawn(handle_connection(state.clone(), io, addr, shard, running.clone()));
+                }
+                // the listener stays usable, live connections keep being served
+                Err(e) => {
+                    error!("Failed to accept connection: {}", e);
+                    sleep(ACCEPT_RETRY_DELAY).await;
+                }
+            },
+            Some(_) = connections.join_next(), if !connections.is_empty() => {},
+            _ = running.changed() => break,
+        }
+    }
+    // new connections go to the successor taking over the listener, or are refused
+    drop(listener);
+    while connections.join_next().await.is_some() {}
+    Ok(())
+}
+
+// run one shard on the calling thread until stopped
+pub fn run(
+    state: Arc<ServerState>,
+    listener: std::net::TcpListener,
+    shard: usize,
+    running: watch::Receiver<RunState>,
+) -> Result<()> {
+    pin_to_core(shard);
+    let runtime = tokio::runtime::Builder::new_current_thread()
+        .enable_all()
+        .build()?;
+    let result = runtime.block_on(async {
+        let listener = match state.connection.io_uring {
+            true => uring_listener(listener, shard)?,
+            false => TcpListener::from_std(listener)?.into(),
+        };
+        info!("shard {} listening ...", shard);
+        serve(state, listener, shard, running).await
+    });
+    #[cfg(target_os = "linux")]
+    uring::stop();
+    result
+}
+
+#[cfg(target_os = "linux")]
+fn uring_listener(listener: std::net::TcpListener, shard: usize) -> Result<Listener> {
+    match uring::start() {
+        Ok(()) => Ok(Listener::Uring(uring::Listener::new(listener)?)),
+        Err(e) => {
+            error!("Shard {} has no io_uring, using epoll: {}", shard, e);
+            Ok(TcpListener::from_std(listener)?.into())
+        }
+    }
+}
+
+#[cfg(not(target_os = "linux"))]
+fn uring_listener(listener: std::net::TcpListener, shard: usize) -> Result<Listener> {
+    error!("Shard {} has no io_uring, which is linux only.", shard);
+    Ok(TcpListener::from_std(listener)?.into())
+}
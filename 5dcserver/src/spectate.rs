@@ -0,0 +1,191 @@
+use bytes::{Bytes, BytesMut};
+use std::collections::VecDeque;
+use std::io::{Error, ErrorKind, Result};
+use std::sync::{Arc, Mutex};
+use std::time::Duration;
+use tokio::io::{AsyncReadExt, AsyncWriteExt};
+use tokio::net::TcpStream;
+use tokio::sync::watch;
+use tokio::time::timeout;
+use tracing::{error, info, trace};
+
+use crate::datatype::*;
+use crate::metrics::{Lock, METRICS};
+use crate::registry::lock;
+use crate::server::ServerState;
+use crate::shard::bind_when_free;
+
+/* spectators of running matches, served on a port of their own.
+A spectator sends a match id as 8 little-endian bytes and is sent the S2CMatchStart of the match
+as its creator got it, every action so far and then each new one as it is played,
+the connection closes once the match ends. Match id 0 lists the running matches instead,
+as one S2CMatchStart frame each.
+Actions are appended once to an append-only log of the match, the packed frame relayed to the
+peer is the one kept, and every spectator reads the log at its own pace with a cursor,
+waking up on a watch of its length. A slow spectator only falls behind in the log,
+it never holds up the players or the other spectators. */
+
+const CHUNK_FRAMES: usize = 256; // logged frames merged into one buffer
+const REQUEST_TIMEOUT: Duration = Duration::from_secs(10);
+
+// frames logged so far, and whether the match ended
+#[derive(Debug, Clone, Copy, Default)]
+struct Progress {
+    frames: usize,
+    ended: bool,
+}
+
+// packed action frames of a match, in chunks of CHUNK_FRAMES frames and the frames after them
+#[derive(Debug, Default)]
+struct ActionLog {
+    chunks: Vec<Bytes>,
+    tail: Vec<Bytes>,
+}
+
+impl ActionLog {
+    fn len(&self) -> usize {
+        self.chunks.len() * CHUNK_FRAMES + self.tail.len()
+    }
+
+    fn push(&mut self, frame: Bytes) {
+        self.tail.push(frame);
+        if self.tail.len() == CHUNK_FRAMES {
+            let mut chunk = BytesMut::with_capacity(self.tail.iter().map(Bytes::len).sum());
+            for frame in self.tail.drain(..) {
+                chunk.extend_from_slice(&frame);
+            }
+            self.chunks.push(chunk.freeze());
+        }
+    }
+
+    // frames from the cursor on, shared with the log, returns the cursor after them
+    fn since(&self, cursor: usize, frames: &mut VecDeque<Bytes>) -> usize {
+        let mut i = cursor;
+        while i / CHUNK_FRAMES < self.chunks.len() {
+            let chunk = &self.chunks[i / CHUNK_FRAMES];
+            let length = chunk.len() / CHUNK_FRAMES;
+            frames.push_back(chunk.slice(i % CHUNK_FRAMES * length..));
+            i = (i / CHUNK_FRAMES + 1) * CHUNK_FRAMES;
+        }
+        frames.extend(
+            self.tail
+                .iter()
+                .skip(i - self.chunks.len() * CHUNK_FRAMES)
+                .cloned(),
+        );
+        self.len()
+    }
+}
+
+// a running match as spectators see it
+#[derive(Debug)]
+pub struct Spectated {
+    pub start: S2CMatchStartBody, // as sent to its creator
+    log: Mutex<ActionLog>,
+    progress: watch::Sender<Progress>,
+}
+
+impl Spectated {
+    pub fn new(start: S2CMatchStartBody) -> Self {
+        Spectated {
+            start,
+            log: Mutex::new(ActionLog::default()),
+            progress: watch::channel(Progress::default()).0,
+        }
+    }
+
+    pub fn push(&self, frame: Bytes) {
+        let mut log = lock(&self.log, Lock::ActionLog);
+        log.push(frame);
+        // under the lock, so the length never goes back
+        let frames = log.len();
+        self.progress
+            .send_modify(|progress| progress.frames = frames);
+    }
+
+    // spectators get the rest of the log and are closed
+    pub fn end(&self) {
+        self.progress.send_modify(|progress| progress.ended = true);
+    }
+
+    fn start_frame(&self) -> Result<Bytes> {
+        Message::S2CMatchStart(self.start).pack_frame()
+    }
+}
+
+// serve spectators on addr
+pub async fn serve(state: Arc<ServerState>, addr: String) {
+    let listener = match bind_when_free(&addr).await {
+        Ok(listener) => listener,
+        Err(e) => {
+            error!("Failed to bind spectators {}: {}", addr, e);
+            return;
+        }
+    };
+    info!("spectators on {} ...", addr);
+    loop {
+        let (stream, addr) = match listener.accept().await {
+            Ok(accepted) => accepted,
+            Err(e) => {
+                error!("Failed to accept spectator: {}", e);
+                continue;
+            }
+        };
+        let _ = stream.set_nodelay(true);
+        let state = state.clone();
+        tokio::spawn(async move {
+            if let Err(e) = spectate(&state, stream).await {
+                trace!("[{}:{}] Spectator left: {}", addr.ip(), addr.port(), e);
+            }
+        });
+    }
+}
+
+async fn spectate(state: &ServerState, mut stream: TcpStream) -> Result<()> {
+    let mut request = [0; 8];
+    timeout(REQUEST_TIMEOUT, stream.read_exact(&mut request))
+        .await
+        .map_err(|_| Error::new(ErrorKind::TimedOut, "No match id sent."))??;
+    let matches = state.spectated.as_ref().unwrap();
+    let mut frames = VecDeque::new();
+    let spectated = match i64::from_le_bytes(request) {
+        0 => {
+            for spectated in matches.values(usize::MAX) {
+                frames.push_back(spectated.start_frame()?);
+            }
+            write_frames(&mut stream, &mut frames).await?;
+            return stream.shutdown().await;
+        }
+        match_id => match matches.get(&match_id) {
+            Some(spectated) => spectated,
+            None => return stream.shutdown().await,
+        },
+    };
+    METRICS.spectator_joined();
+    let mut progress = spectated.progress.subscribe();
+    frames.push_back(spectated.start_frame()?);
+    let mut cursor = 0;
+    let result = async {
+        loop {
+            let Progress {
+                frames: logged,
+                ended,
+            } = *progress.borrow_and_update();
+            if cursor < logged {
+                cursor = lock(&spectated.log, Lock::ActionLog).since(cursor, &mut frames);
+            }
+            if !frames.is_empty() {
+                write_frames(&mut stream, &mut frames).await?;
+                continue;
+            }
+            if ended {
+                break stream.shutdown().await;
+            }
+            // the sender lives as long as the match it belongs to
+            let _ = progress.changed().await;
+        }
+    }
+    .await;
+    METRICS.spectator_left();
+    result
+}
@@ -0,0 +1,292 @@
+use std::sync::atomic::{AtomicU32, AtomicU64, Ordering};
+use std::sync::{Arc, Mutex, OnceLock};
+use std::time::Duration;
+use tokio::sync::Notify;
+use tokio::time::{interval, Instant, MissedTickBehavior};
+
+use crate::datatype::*;
+use crate::metrics::Lock;
+use crate::registry::lock;
+
+/* deadlines of every connection in one hierarchical timer wheel, instead of a sleep each.
+Deadlines are rounded up to ticks of TICK, level l of the wheel has SLOTS slots of SLOTS^l ticks,
+a deadline is kept in the lowest level spanning it and moves down a level as the wheel reaches
+its slot, so inserting and cancelling are O(1) and a tick visits one slot of each level at most.
+A connection pushing its deadline back only stores the new tick, its entry is moved once the
+old tick comes up, the wheel is only locked for a deadline earlier than the one it holds. */
+
+const TICK: Duration = Duration::from_millis(100);
+const LEVEL_BITS: u32 = 6;
+const SLOTS: usize = 1 << LEVEL_BITS;
+const LEVELS: usize = 4; // SLOTS^LEVELS ticks span 19 days, later deadlines are moved until due
+const NONE: u32 = u32::MAX;
+const NEVER: u64 = u64::MAX;
+
+// timeouts of client connections, zero disables one
+#[derive(Debug, Clone, Copy, Default)]
+pub struct Timeouts {
+    pub idle: Duration,        // without a message outside of a match
+    pub waiting: Duration,     // for an opponent after creating a match
+    pub clocks: [Duration; 3], // thinking time of a player in Short, Medium and Long matches
+}
+
+impl Timeouts {
+    pub fn enabled(&self) -> bool {
+        !self.idle.is_zero() || !self.waiting.is_zero() || self.clocks.iter().any(|c| !c.is_zero())
+    }
+
+    // budget of a player in matches with the clock, None if not enforced
+    pub fn clock(&self, clock: OptionalClock) -> Option<Duration> {
+        let budget = match clock {
+            OptionalClock::Short => self.clocks[0],
+            OptionalClock::Medium => self.clocks[1],
+            OptionalClock::Long => self.clocks[2],
+            OptionalClock::None | OptionalClock::NoClock => return None,
+        };
+        (!budget.is_zero()).then_some(budget)
+    }
+}
+
+// shared by a connection and its entry in the wheel
+#[derive(Debug)]
+struct Deadline {
+    at: AtomicU64,        // tick it expires at, NEVER when disarmed
+    scheduled: AtomicU64, // tick its entry is due at, NEVER without one, written under the lock
+    entry: AtomicU32,     // its entry, NONE without one, written under the lock
+    expired: Notify,
+}
+
+#[derive(Debug)]
+struct Entry {
+    deadline: Option<Arc<Deadline>>, // None once freed
+    slot: usize,
+    prev: u32,
+    next: u32,
+}
+
+// entries in a slab, each slot is a doubly linked list of them
+#[derive(Debug)]
+struct Wheel {
+    now: u64, // last tick handled
+    heads: Vec<u32>,
+    entries: Vec<Entry>,
+    free: Vec<u32>,
+}
+
+impl Wheel {
+    fn new() -> Self {
+        Wheel {
+            now: 0,
+            heads: vec![NONE; LEVELS * SLOTS],
+            entries: Vec::new(),
+            free: Vec::new(),
+        }
+    }
+
+    // lowest level spanning the tick, a tick already passed is handled with the next one
+    fn slot(&self, tick: u64) -> usize {
+        let tick = tick.clamp(
+            self.now + 1,
+            self.now + (1 << (LEVEL_BITS * LEVELS as u32)) - 1,
+        );
+        let delta = tick - self.now;
+        let mut level = 0;
+        while delta >> (LEVEL_BITS * (level as u32 + 1)) != 0 {
+            level += 1;
+        }
+        level * SLOTS + (tick >> (LEVEL_BITS * level as u32)) as usize % SLOTS
+    }
+
+    fn link(&mut self, i: u32, tick: u64) {
+        let slot = self.slot(tick);
+        let next = self.heads[slot];
+        if next != NONE {
+            self.entries[next as usize].prev = i;
+        }
+        self.heads[slot] = i;
+        let entry = &mut self.entries[i as usize];
+        (entry.slot, entry.prev, entry.next) = (slot, NONE, next);
+        let deadline = entry.deadline.as_ref().unwrap();
+        deadline.scheduled.store(tick, Ordering::SeqCst);
+    }
+
+    fn unlink(&mut self, i: u32) {
+        let Entry {
+            slot, prev, next, ..
+        } = self.entries[i as usize];
+        match prev {
+            NONE => self.heads[slot] = next,
+            prev => self.entries[prev as usize].next = next,
+        }
+        if next != NONE {
+            self.entries[next as usize].prev = prev;
+        }
+    }
+
+    fn release(&mut self, i: u32) {
+        if let Some(deadline) = self.entries[i as usize].deadline.take() {
+            deadline.entry.store(NONE, Ordering::Relaxed);
+            deadline.scheduled.store(NEVER, Ordering::SeqCst);
+        }
+        self.free.push(i);
+    }
+
+    fn schedule(&mut self, deadline: &Arc<Deadline>, tick: u64) {
+        let i = match deadline.entry.load(Ordering::Relaxed) {
+            NONE => {
+                let entry = Entry {
+                    deadline: Some(deadline.clone()),
+                    slot: 0,
+                    prev: NONE,
+                    next: NONE,
+                };
+                let i = match self.free.pop() {
+                    Some(i) => {
+                        self.entries[i as usize] = entry;
+                        i
+                    }
+                    None => {
+                        self.entries.push(entry);
+                        (self.entries.len() - 1) as u32
+                    }
+                };
+                deadline.entry.store(i, Ordering::Relaxed);
+                i
+            }
+            i => {
+                self.unlink(i);
+                i
+            }
+        };
+        self.link(i, tick);
+    }
+
+    fn cancel(&mut self, deadline: &Deadline) {
+        let i = deadline.entry.load(Ordering::Relaxed);
+        if i != NONE {
+            self.unlink(i);
+            self.release(i);
+        }
+    }
+
+    // entries of a slot come up, each moves to its current deadline or expires
+    fn visit(&mut self, slot: usize) {
+        let mut i = std::mem::replace(&mut self.heads[slot], NONE);
+        while i != NONE {
+            let next = self.entries[i as usize].next;
+            let deadline = self.entries[i as usize].deadline.clone().unwrap();
+            // a connection storing a later tick meanwhile either sees NEVER and schedules it
+            // or has its tick seen here
+            deadline.scheduled.store(NEVER, Ordering::SeqCst);
+            match deadline.at.load(Ordering::SeqCst) {
+                NEVER => self.release(i),
+                at if at > self.now => self.link(i, at),
+                _ => {
+                    self.release(i);
+                    deadline.expired.notify_one();
+                }
+            }
+            i = next;
+        }
+    }
+
+    fn advance(&mut self) {
+        self.now += 1;
+        for level in (1..LEVELS).rev() {
+            let shift = LEVEL_BITS * level as u32;
+            if self.now & ((1 << shift) - 1) == 0 {
+                self.visit(level * SLOTS + (self.now >> shift) as usize % SLOTS);
+            }
+        }
+        self.visit(self.now as usize % SLOTS);
+    }
+}
+
+#[derive(Debug)]
+struct Timers {
+    start: Instant,
+    wheel: Mutex<Wheel>,
+}
+
+static TIMERS: OnceLock<Timers> = OnceLock::new();
+
+fn timers() -> &'static Timers {
+    TIMERS.get_or_init(|| Timers {
+        start: Instant::now(),
+        wheel: Mutex::new(Wheel::new()),
+    })
+}
+
+impl Timers {
+    fn ticks(&self, at: Instant) -> u64 {
+        (at.saturating_duration_since(self.start).as_nanos() / TICK.as_nanos()) as u64
+    }
+}
+
+// turn the wheel on the calling runtime
+pub fn start() {
+    let timers = timers();
+    tokio::spawn(async move {
+        let mut ticks = interval(TICK);
+        ticks.set_missed_tick_behavior(MissedTickBehavior::Delay);
+        loop {
+            ticks.tick().await;
+            let now = timers.ticks(Instant::now());
+            let mut wheel = lock(&timers.wheel, Lock::Timers);
+            while wheel.now < now {
+                wheel.advance();
+            }
+        }
+    });
+}
+
+// deadline of one connection, cancelled when dropped
+#[derive(Debug)]
+pub struct Timer {
+    deadline: Arc<Deadline>,
+}
+
+impl Timer {
+    pub fn new() -> Self {
+        Timer {
+            deadline: Arc::new(Deadline {
+                at: AtomicU64::new(NEVER),
+                scheduled: AtomicU64::new(NEVER),
+                entry: AtomicU32::new(NONE),
+                expired: Notify::new(),
+            }),
+        }
+    }
+
+    // expire at the instant, None disarms
+    pub fn set(&self, at: Option<Instant>) {
+        let timers = timers();
+        // rounded up, so it never expires early
+        let tick = at.map_or(NEVER, |at| {
+            timers.ticks(at + TICK - Duration::from_nanos(1))
+        });
+        if self.deadline.at.swap(tick, Ordering::SeqCst) == tick {
+            return;
+        }
+        if tick < self.deadline.scheduled.load(Ordering::SeqCst) {
+            lock(&timers.wheel, Lock::Timers).schedule(&self.deadline, tick);
+        }
+    }
+
+    // the deadline passed, expired() may also wake for one pushed back meanwhile
+    pub fn due(&self) -> bool {
+        self.deadline.at.load(Ordering::SeqCst) <= timers().ticks(Instant::now())
+    }
+
+    pub async fn expired(&self) {
+        self.deadline.expired.notified().await
+    }
+}
+
+impl Drop for Timer {
+    fn drop(&mut self) {
+        if self.deadline.entry.load(Ordering::Relaxed) != NONE {
+            lock(&timers().wheel, Lock::Timers).cancel(&self.deadline);
+        }
+    }
+}
@@ -0,0 +1,1179 @@
+use bytes::{Buf, Bytes, BytesMut};
+use std::cell::RefCell;
+use std::collections::VecDeque;
+use std::future::poll_fn;
+use std::io::{Error, ErrorKind, Result};
+use std::mem::size_of;
+use std::net::{Shutdown, SocketAddr, TcpListener, TcpStream};
+use std::os::fd::{AsRawFd, FromRawFd, OwnedFd, RawFd};
+use std::ptr;
+use std::sync::atomic::{AtomicU16, AtomicU32, Ordering};
+use std::sync::Arc;
+use std::task::{Poll, Waker};
+use tokio::io::unix::AsyncFd;
+use tokio::io::Interest;
+use tokio::select;
+use tokio::sync::Notify;
+use tokio::task::yield_now;
+use tracing::error;
+
+use crate::datatype::MESSAGE_LENGTH_MAX;
+
+/* io_uring backend of the shards, linux only.
+Every shard thread owns one ring. A multishot accept stays armed per listener and a multishot
+recv per connection, received bytes land in a ring of provided buffers sized for the longest
+frame and are copied out to their connection as completions are reaped, so a buffer is only
+busy between the kernel filling it and the next reap. Writes copy the queued frames into
+registered buffers of the same size. Submissions of every connection of the shard are queued
+and go to the kernel together when the reaper task runs, which sleeps on the readiness of
+the ring in the tokio reactor.
+Listeners and connections are handles into slabs of the thread, a socket is only closed once
+no operation on it is in flight, so its fd is never reused under a pending operation. */
+
+const SQ_ENTRIES: u32 = 1024;
+const CQ_ENTRIES: u32 = 8192;
+const BUFFER_SIZE: usize = 8 + MESSAGE_LENGTH_MAX; // longest frame including the length field
+const RECV_BUFFERS: u16 = 1024; // provided to the kernel, a power of two
+const WRITE_BUFFERS: u16 = 256; // registered, writes allocate once all of them are busy
+const RECV_BACKLOG_MAX: usize = 64 * 1024; // received and unread bytes before recv pauses
+const WRITES_QUEUED_MAX: usize = 16; // buffers written per connection before a flush waits
+const BUFFER_GROUP: u16 = 0;
+const CANCEL: u64 = u64::MAX; // user data of cancellations, their completions are ignored
+
+// linux/io_uring.h
+const IORING_SETUP_CQSIZE: u32 = 1 << 3;
+const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+const IORING_OFF_SQ_RING: i64 = 0;
+const IORING_OFF_CQ_RING: i64 = 0x8000000;
+const IORING_OFF_SQES: i64 = 0x10000000;
+const IORING_REGISTER_BUFFERS: u32 = 0;
+const IORING_REGISTER_PBUF_RING: u32 = 22;
+const IORING_OP_WRITE_FIXED: u8 = 5;
+const IORING_OP_ACCEPT: u8 = 13;
+const IORING_OP_ASYNC_CANCEL: u8 = 14;
+const IORING_OP_SEND: u8 = 26;
+const IORING_OP_RECV: u8 = 27;
+const IOSQE_BUFFER_SELECT: u8 = 1 << 5;
+const IORING_ACCEPT_MULTISHOT: u16 = 1 << 0;
+const IORING_RECV_MULTISHOT: u16 = 1 << 1;
+const IORING_CQE_F_BUFFER: u32 = 1 << 0;
+const IORING_CQE_F_MORE: u32 = 1 << 1;
+const IORING_CQE_BUFFER_SHIFT: u32 = 16;
+
+#[repr(C)]
+#[derive(Default)]
+struct SqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    flags: u32,
+    dropped: u32,
+    array: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct CqringOffsets {
+    head: u32,
+    tail: u32,
+    ring_mask: u32,
+    ring_entries: u32,
+    overflow: u32,
+    cqes: u32,
+    flags: u32,
+    resv1: u32,
+    user_addr: u64,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Params {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqringOffsets,
+    cq_off: CqringOffsets,
+}
+
+#[repr(C)]
+#[derive(Default)]
+struct Sqe {
+    opcode: u8,
+    flags: u8,
+    ioprio: u16,
+    fd: i32,
+    off: u64,
+    addr: u64,
+    len: u32,
+    op_flags: u32,
+    user_data: u64,
+    buf_index: u16, // buffer group with IOSQE_BUFFER_SELECT
+    personality: u16,
+    file_index: u32,
+    addr3: u64,
+    pad: u64,
+}
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+#[repr(C)]
+struct BufReg {
+    ring_addr: u64,
+    ring_entries: u32,
+    bgid: u16,
+    flags: u16,
+    resv: [u64; 3],
+}
+
+// entry of a provided buffer ring, the tail of the ring overlaps resv of the first entry
+#[repr(C)]
+struct BufEntry {
+    addr: u64,
+    len: u32,
+    bid: u16,
+    resv: u16,
+}
+
+const _: () = assert!(size_of::<Params>() == 120);
+const _: () = assert!(size_of::<Sqe>() == 64);
+const _: () = assert!(size_of::<Cqe>() == 16);
+const _: () = assert!(size_of::<BufEntry>() == 16);
+
+fn last_error() -> Error {
+    Error::last_os_error()
+}
+
+struct Mmap {
+    ptr: *mut u8,
+    len: usize,
+}
+
+impl Mmap {
+    // anonymous memory for an fd of -1
+    fn new(len: usize, fd: RawFd, offset: i64) -> Result<Self> {
+        let flags = if fd < 0 {
+            libc::MAP_PRIVATE | libc::MAP_ANONYMOUS
+        } else {
+            libc::MAP_SHARED | libc::MAP_POPULATE
+        };
+        let ptr = unsafe {
+            libc::mmap(
+                ptr::null_mut(),
+                len,
+                libc::PROT_READ | libc::PROT_WRITE,
+                flags,
+                fd,
+                offset,
+            )
+        };
+        if ptr == libc::MAP_FAILED {
+            return Err(last_error());
+        }
+        Ok(Mmap {
+            ptr: ptr as *mut u8,
+            len,
+        })
+    }
+
+    fn at<T>(&self, offset: usize) -> *mut T {
+        debug_assert!(offset + size_of::<T>() <= self.len);
+        unsafe { self.ptr.add(offset) as *mut T }
+    }
+}
+
+impl Drop for Mmap {
+    fn drop(&mut self) {
+        unsafe {
+            libc::munmap(self.ptr as *mut libc::c_void, self.len);
+        }
+    }
+}
+
+struct Ring {
+    sq_head: *const AtomicU32,
+    sq_tail: *const AtomicU32,
+    sq_mask: u32,
+    sq_entries: u32,
+    sq_array: *mut u32,
+    cq_head: *const AtomicU32,
+    cq_tail: *const AtomicU32,
+    cq_mask: u32,
+    cqes: *const Cqe,
+    queued: u32, // pushed and not yet submitted
+    sqes: Mmap,
+    _cq_ring: Option<Mmap>,
+    _sq_ring: Mmap,
+    fd: OwnedFd, // closed after the maps
+}
+
+impl Ring {
+    fn new() -> Result<Self> {
+        let mut p = Params {
+            cq_entries: CQ_ENTRIES,
+            flags: IORING_SETUP_CQSIZE,
+            ..Default::default()
+        };
+        let fd =
+            unsafe { libc::syscall(libc::SYS_io_uring_setup, SQ_ENTRIES, &mut p as *mut Params) };
+        if fd < 0 {
+            return Err(last_error());
+        }
+        let fd = unsafe { OwnedFd::from_raw_fd(fd as RawFd) };
+        let sq_len = p.sq_off.array as usize + p.sq_entries as usize * size_of::<u32>();
+        let cq_len = p.cq_off.cqes as usize + p.cq_entries as usize * size_of::<Cqe>();
+        let single = p.features & IORING_FEAT_SINGLE_MMAP != 0;
+        let sq_ring = Mmap::new(
+            if single { sq_len.max(cq_len) } else { sq_len },
+            fd.as_raw_fd(),
+            IORING_OFF_SQ_RING,
+        )?;
+        let cq_ring = match single {
+            true => None,
+            false => Some(Mmap::new(cq_len, fd.as_raw_fd(), IORING_OFF_CQ_RING)?),
+        };
+        let sqes = Mmap::new(
+            p.sq_entries as usize * size_of::<Sqe>(),
+            fd.as_raw_fd(),
+            IORING_OFF_SQES,
+        )?;
+        let cq = cq_ring.as_ref().unwrap_or(&sq_ring);
+        let (cq_head, cq_tail, cq_mask, cqes) = unsafe {
+            (
+                cq.at(p.cq_off.head as usize),
+                cq.at(p.cq_off.tail as usize),
+                *cq.at::<u32>(p.cq_off.ring_mask as usize),
+                cq.at(p.cq_off.cqes as usize),
+            )
+        };
+        Ok(Ring {
+            sq_head: sq_ring.at(p.sq_off.head as usize),
+            sq_tail: sq_ring.at(p.sq_off.tail as usize),
+            sq_mask: unsafe { *sq_ring.at::<u32>(p.sq_off.ring_mask as usize) },
+            sq_entries: p.sq_entries,
+            sq_array: sq_ring.at(p.sq_off.array as usize),
+            cq_head,
+            cq_tail,
+            cq_mask,
+            cqes,
+            queued: 0,
+            sqes,
+            _cq_ring: cq_ring,
+            _sq_ring: sq_ring,
+            fd,
+        })
+    }
+
+    fn register(&self, opcode: u32, arg: *const libc::c_void, nr: u32) -> Result<()> {
+        let result = unsafe {
+            libc::syscall(
+                libc::SYS_io_uring_register,
+                self.fd.as_raw_fd(),
+                opcode,
+                arg,
+                nr,
+            )
+        };
+        if result < 0 {
+            return Err(last_error());
+        }
+        Ok(())
+    }
+
+    fn push(&mut self, sqe: Sqe) -> Result<()> {
+        let tail = unsafe { (*self.sq_tail).load(Ordering::Relaxed) };
+        if tail.wrapping_sub(unsafe { (*self.sq_head).load(Ordering::Acquire) }) >= self.sq_entries
+        {
+            self.submit()?;
+            if tail.wrapping_sub(unsafe { (*self.sq_head).load(Ordering::Acquire) })
+                >= self.sq_entries
+            {
+                return Err(Error::new(
+                    ErrorKind::WouldBlock,
+                    "io_uring submission queue is full.",
+                ));
+            }
+        }
+        let index = tail & self.sq_mask;
+        unsafe {
+            ptr::write(self.sqes.at(index as usize * size_of::<Sqe>()), sqe);
+            *self.sq_array.add(index as usize) = index;
+            (*self.sq_tail).store(tail.wrapping_add(1), Ordering::Release);
+        }
+        self.queued += 1;
+        Ok(())
+    }
+
+    // a busy completion queue leaves the rest queued until it is reaped
+    fn submit(&mut self) -> Result<()> {
+        while self.queued > 0 {
+            let submitted = unsafe {
+                libc::syscall(
+                    libc::SYS_io_uring_enter,
+                    self.fd.as_raw_fd(),
+                    self.queued,
+                    0,
+                    0,
+                    ptr::null::<libc::c_void>(),
+                    0usize,
+                )
+            };
+            if submitted < 0 {
+                let e = last_error();
+                match e.raw_os_error() {
+                    Some(libc::EINTR) => continue,
+                    Some(libc::EAGAIN) | Some(libc::EBUSY) => return Ok(()),
+                    _ => return Err(e),
+                }
+            }
+            self.queued -= submitted as u32;
+        }
+        Ok(())
+    }
+
+    fn reap(&mut self, completions: &mut Vec<Cqe>) {
+        unsafe {
+            let mut head = (*self.cq_head).load(Ordering::Relaxed);
+            let tail = (*self.cq_tail).load(Ordering::Acquire);
+            while head != tail {
+                completions.push(*self.cqes.add((head & self.cq_mask) as usize));
+                head = head.wrapping_add(1);
+            }
+            (*self.cq_head).store(head, Ordering::Release);
+        }
+    }
+}
+
+// buffers the kernel picks from for every recv, given back as soon as they are copied out
+struct RecvBuffers {
+    ring: Mmap,
+    memory: Mmap,
+    tail: u16,
+}
+
+impl RecvBuffers {
+    fn new(ring: &Ring) -> Result<Self> {
+        let mut buffers = RecvBuffers {
+            ring: Mmap::new(RECV_BUFFERS as usize * size_of::<BufEntry>(), -1, 0)?,
+            memory: Mmap::new(RECV_BUFFERS as usize * BUFFER_SIZE, -1, 0)?,
+            tail: 0,
+        };
+        let reg = BufReg {
+            ring_addr: buffers.ring.ptr as u64,
+            ring_entries: RECV_BUFFERS as u32,
+            bgid: BUFFER_GROUP,
+            flags: 0,
+            resv: [0; 3],
+        };
+        ring.register(
+            IORING_REGISTER_PBUF_RING,
+            &reg as *const BufReg as *const libc::c_void,
+            1,
+        )?;
+        for bid in 0..RECV_BUFFERS {
+            buffers.provide(bid);
+        }
+        Ok(buffers)
+    }
+
+    fn get(&self, bid: u16, len: usize) -> &[u8] {
+        unsafe {
+            std::slice::from_raw_parts(
+                self.memory.at::<u8>(bid as usize * BUFFER_SIZE),
+                len.min(BUFFER_SIZE),
+            )
+        }
+    }
+
+    fn provide(&mut self, bid: u16) {
+        let buf: *mut BufEntry = self
+            .ring
+            .at((self.tail & (RECV_BUFFERS - 1)) as usize * size_of::<BufEntry>());
+        unsafe {
+            // resv is left alone, in the first entry it is the tail
+            (*buf).addr = self.memory.at::<u8>(bid as usize * BUFFER_SIZE) as u64;
+            (*buf).len = BUFFER_SIZE as u32;
+            (*buf).bid = bid;
+            self.tail = self.tail.wrapping_add(1);
+            (*self.ring.at::<AtomicU16>(14)).store(self.tail, Ordering::Release);
+        }
+    }
+}
+
+// registered buffers holding frames being written
+struct WriteBuffers {
+    memory: Mmap,
+    free: Vec<u16>,
+}
+
+impl WriteBuffers {
+    fn new(ring: &Ring) -> Result<Self> {
+        let memory = Mmap::new(WRITE_BUFFERS as usize * BUFFER_SIZE, -1, 0)?;
+        let iovecs: Vec<libc::iovec> = (0..WRITE_BUFFERS as usize)
+            .map(|i| libc::iovec {
+                iov_base: memory.at::<libc::c_void>(i * BUFFER_SIZE),
+                iov_len: BUFFER_SIZE,
+            })
+            .collect();
+        ring.register(
+            IORING_REGISTER_BUFFERS,
+            iovecs.as_ptr() as *const libc::c_void,
+            WRITE_BUFFERS as u32,
+        )?;
+        Ok(WriteBuffers {
+            memory,
+            free: (0..WRITE_BUFFERS).rev().collect(),
+        })
+    }
+
+    fn ptr(&self, i: u16) -> *mut u8 {
+        self.memory.at(i as usize * BUFFER_SIZE)
+    }
+}
+
+#[derive(Debug)]
+enum WriteBuffer {
+    Fixed(u16),
+    Owned(Vec<u8>),
+}
+
+#[derive(Debug)]
+struct Slab<T> {
+    entries: Vec<(u32, Option<T>)>, // generation, value
+    free: Vec<u32>,
+}
+
+impl<T> Slab<T> {
+    fn new() -> Self {
+        Slab {
+            entries: Vec::new(),
+            free: Vec::new(),
+        }
+    }
+
+    fn insert(&mut self, value: T) -> (u32, u32) {
+        match self.free.pop() {
+            Some(id) => {
+                let entry = &mut self.entries[id as usize];
+                entry.1 = Some(value);
+                (id, entry.0)
+            }
+            None => {
+                self.entries.push((0, Some(value)));
+                (self.entries.len() as u32 - 1, 0)
+            }
+        }
+    }
+
+    fn get(&mut self, id: u32, generation: u32) -> Option<&mut T> {
+        match self.entries.get_mut(id as usize) {
+            Some((g, Some(value))) if *g == generation => Some(value),
+            _ => None,
+        }
+    }
+
+    // entries with operations in flight stay, so operations refer to them by id alone
+    fn at(&mut self, id: u32) -> &mut T {
+        self.entries[id as usize].1.as_mut().unwrap()
+    }
+
+    fn remove(&mut self, id: u32) -> T {
+        let entry = &mut self.entries[id as usize];
+        entry.0 = entry.0.wrapping_add(1);
+        self.free.push(id);
+        entry.1.take().unwrap()
+    }
+}
+
+#[derive(Debug)]
+enum Op {
+    Accept(u32), // listener
+    Recv(u32),   // socket
+    Write(u32),  // socket, writing the front of its queue
+}
+
+#[derive(Debug)]
+struct ListenerSlot {
+    listener: TcpListener,
+    ops: u32,
+    accept: Option<u32>, // armed accept
+    accepted: VecDeque<Result<TcpStream>>,
+    waker: Option<Waker>,
+    closed: bool,
+}
+
+#[derive(Debug)]
+struct SocketSlot {
+    stream: TcpStream,
+    ops: u32,
+    recv: Option<u32>, // armed recv
+    inbox: BytesMut,   // received and not yet read
+    eof: bool,
+    error: Option<Error>,
+    reader: Option<Waker>,
+    writes: VecDeque<(WriteBuffer, usize, usize)>, // buffer, written, length, the front in flight
+    write_error: Option<Error>,
+    writer: Option<Waker>,
+    detaching: bool,
+    closed: bool,
+}
+
+fn wake(waker: &mut Option<Waker>) {
+    if let Some(waker) = waker.take() {
+        waker.wake();
+    }
+}
+
+struct Driver {
+    ring: Ring,
+    recv_buffers: RecvBuffers,
+    write_buffers: WriteBuffers,
+    ops: Slab<Op>,
+    listeners: Slab<ListenerSlot>,
+    sockets: Slab<SocketSlot>,
+    completions: Vec<Cqe>,
+    multishot_accept: bool, // cleared when the kernel rejects it
+    multishot_recv: bool,
+    notify: Arc<Notify>, // wakes the reaper to submit
+}
+
+impl Driver {
+    fn new() -> Result<Self> {
+        let ring = Ring::new()?;
+        Ok(Driver {
+            recv_buffers: RecvBuffers::new(&ring)?,
+            write_buffers: WriteBuffers::new(&ring)?,
+            ring,
+            ops: Slab::new(),
+            listeners: Slab::new(),
+            sockets: Slab::new(),
+            completions: Vec::new(),
+            multishot_accept: true,
+            multishot_recv: true,
+            notify: Arc::new(Notify::new()),
+        })
+    }
+
+    fn push(&mut self, sqe: Sqe) -> Result<()> {
+        self.ring.push(sqe)?;
+        self.notify.notify_one();
+        Ok(())
+    }
+
+    fn cancel(&mut self, op: u32) {
+        let sqe = Sqe {
+            opcode: IORING_OP_ASYNC_CANCEL,
+            fd: -1,
+            addr: op as u64,
+            user_data: CANCEL,
+            ..Default::default()
+        };
+        if let Err(e) = self.push(sqe) {
+            error!("Failed to cancel io_uring operation: {}", e);
+        }
+    }
+
+    // submit what is queued and handle what completed, returns the number of completions
+    fn turn(&mut self) -> Result<usize> {
+        self.ring.submit()?;
+        let mut completions = std::mem::take(&mut self.completions);
+        self.ring.reap(&mut completions);
+        let n = completions.len();
+        for cqe in completions.drain(..) {
+            self.complete(cqe);
+        }
+        self.completions = completions;
+        Ok(n)
+    }
+
+    fn complete(&mut self, cqe: Cqe) {
+        if cqe.user_data == CANCEL {
+            return;
+        }
+        let id = cqe.user_data as u32;
+        if cqe.flags & IORING_CQE_F_MORE != 0 {
+            match *self.ops.at(id) {
+                Op::Accept(l) => self.accepted(l, &cqe),
+                Op::Recv(s) => self.received(s, id, &cqe, true),
+                Op::Write(_) => unreachable!(),
+            }
+            return;
+        }
+        match self.ops.remove(id) {
+            Op::Accept(l) => {
+                self.accepted(l, &cqe);
+                let slot = self.listeners.at(l);
+                slot.accept = None;
+                slot.ops -= 1;
+                self.free_listener(l);
+            }
+            Op::Recv(s) => {
+                self.received(s, id, &cqe, false);
+                let slot = self.sockets.at(s);
+                slot.recv = None;
+                slot.ops -= 1;
+                wake(&mut slot.reader);
+                if !slot.closed
+                    && !slot.detaching
+                    && !slot.eof
+                    && slot.error.is_none()
+                    && slot.inbox.len() <= RECV_BACKLOG_MAX
+                {
+                    self.arm_recv(s);
+                }
+                self.free_socket(s);
+            }
+            Op::Write(s) => {
+                let slot = self.sockets.at(s);
+                slot.ops -= 1;
+                if slot.closed {
+                    self.free_socket(s);
+                    return;
+                }
+                let front = slot.writes.front_mut().unwrap();
+                if cqe.res <= 0 {
+                    self.fail_writes(
+                        s,
+                        match cqe.res {
+                            0 => Error::new(ErrorKind::WriteZero, "Failed to write frame."),
+                            res => Error::from_raw_os_error(-res),
+                        },
+                    );
+                } else {
+                    front.1 += cqe.res as usize;
+                    if front.1 >= front.2 {
+                        let (buffer, _, _) = slot.writes.pop_front().unwrap();
+                        self.release(buffer);
+                    }
+                    if !self.sockets.at(s).writes.is_empty() {
+                        self.write(s);
+                    }
+                }
+                let slot = self.sockets.at(s);
+                wake(&mut slot.writer);
+                wake(&mut slot.reader);
+            }
+        }
+    }
+
+    fn accepted(&mut self, l: u32, cqe: &Cqe) {
+        let slot = self.listeners.at(l);
+        if cqe.res >= 0 {
+            let stream = unsafe { TcpStream::from_raw_fd(cqe.res) };
+            if !slot.closed {
+                slot.accepted.push_back(Ok(stream));
+            }
+        } else {
+            match -cqe.res {
+                libc::ECANCELED => {}
+                libc::EINVAL if self.multishot_accept => self.multishot_accept = false,
+                e => slot.accepted.push_back(Err(Error::from_raw_os_error(e))),
+            }
+        }
+        wake(&mut slot.waker);
+    }
+
+    fn received(&mut self, s: u32, id: u32, cqe: &Cqe, more: bool) {
+        let slot = self.sockets.at(s);
+        if cqe.flags & IORING_CQE_F_BUFFER != 0 {
+            let bid = (cqe.flags >> IORING_CQE_BUFFER_SHIFT) as u16;
+            if cqe.res > 0 && !slot.closed {
+                slot.inbox
+                    .extend_from_slice(self.recv_buffers.get(bid, cqe.res as usize));
+            }
+            self.recv_buffers.provide(bid);
+        }
+        if cqe.res == 0 {
+            slot.eof = true;
+        } else if cqe.res < 0 {
+            match -cqe.res {
+                libc::ENOBUFS | libc::ECANCELED => {}
+                libc::EINVAL if self.multishot_recv => self.multishot_recv = false,
+                e => slot.error = Some(Error::from_raw_os_error(e)),
+            }
+        }
+        wake(&mut slot.reader);
+        // a connection not reading its frames stops receiving until it catches up
+        if more && slot.inbox.len() > RECV_BACKLOG_MAX {
+            self.cancel(id);
+        }
+    }
+
+    fn arm_accept(&mut self, l: u32) {
+        let (id, _) = self.ops.insert(Op::Accept(l));
+        let slot = self.listeners.at(l);
+        let sqe = Sqe {
+            opcode: IORING_OP_ACCEPT,
+            ioprio: if self.multishot_accept {
+                IORING_ACCEPT_MULTISHOT
+            } else {
+                0
+            },
+            fd: slot.listener.as_raw_fd(),
+            op_flags: libc::SOCK_CLOEXEC as u32,
+            user_data: id as u64,
+            ..Default::default()
+        };
+        match self.push(sqe) {
+            Ok(()) => {
+                let slot = self.listeners.at(l);
+                slot.accept = Some(id);
+                slot.ops += 1;
+            }
+            Err(e) => {
+                self.ops.remove(id);
+                self.listeners.at(l).accepted.push_back(Err(e));
+            }
+        }
+    }
+
+    fn arm_recv(&mut self, s: u32) {
+        let (id, _) = self.ops.insert(Op::Recv(s));
+        let slot = self.sockets.at(s);
+        let sqe = Sqe {
+            opcode: IORING_OP_RECV,
+            flags: IOSQE_BUFFER_SELECT,
+            ioprio: if self.multishot_recv {
+                IORING_RECV_MULTISHOT
+            } else {
+                0
+            },
+            fd: slot.stream.as_raw_fd(),
+            user_data: id as u64,
+            buf_index: BUFFER_GROUP,
+            ..Default::default()
+        };
+        match self.push(sqe) {
+            Ok(()) => {
+                let slot = self.sockets.at(s);
+                slot.recv = Some(id);
+                slot.ops += 1;
+            }
+            Err(e) => {
+                self.ops.remove(id);
+                let slot = self.sockets.at(s);
+                slot.error = Some(e);
+                wake(&mut slot.reader);
+            }
+        }
+    }
+
+    // copy queued frames into a buffer, returns it with the number of bytes copied
+    fn fill(&mut self, pending: &mut VecDeque<Bytes>) -> (WriteBuffer, usize) {
+        let mut buffer = match self.write_buffers.free.pop() {
+            Some(i) => WriteBuffer::Fixed(i),
+            None => WriteBuffer::Owned(vec![0; BUFFER_SIZE]),
+        };
+        let target = match &mut buffer {
+            WriteBuffer::Fixed(i) => unsafe {
+                std::slice::from_raw_parts_mut(self.write_buffers.ptr(*i), BUFFER_SIZE)
+            },
+            WriteBuffer::Owned(v) => &mut v[..],
+        };
+        let mut len = 0;
+        while let Some(frame) = pending.front_mut() {
+            let n = frame.len().min(BUFFER_SIZE - len);
+            target[len..len + n].copy_from_slice(&frame[..n]);
+            len += n;
+            if n < frame.len() {
+                frame.advance(n);
+                break;
+            }
+            pending.pop_front();
+        }
+        (buffer, len)
+    }
+
+    // a stream takes one write at a time, the next buffer goes once the front is written
+    fn queue_write(&mut self, s: u32, buffer: WriteBuffer, len: usize) {
+        let slot = self.sockets.at(s);
+        slot.writes.push_back((buffer, 0, len));
+        if slot.writes.len() == 1 {
+            self.write(s);
+        }
+    }
+
+    fn write(&mut self, s: u32) {
+        let (id, _) = self.ops.insert(Op::Write(s));
+        let slot = self.sockets.at(s);
+        let fd = slot.stream.as_raw_fd();
+        let (buffer, offset, len) = slot.writes.front().unwrap();
+        let sqe = match buffer {
+            WriteBuffer::Fixed(i) => Sqe {
+                opcode: IORING_OP_WRITE_FIXED,
+                fd,
+                off: u64::MAX, // current position, the only one of a stream
+                addr: unsafe { self.write_buffers.ptr(*i).add(*offset) } as u64,
+                len: (len - offset) as u32,
+                buf_index: *i,
+                user_data: id as u64,
+                ..Default::default()
+            },
+            WriteBuffer::Owned(v) => Sqe {
+                opcode: IORING_OP_SEND,
+                fd,
+                addr: v[*offset..].as_ptr() as u64,
+                len: (len - offset) as u32,
+                op_flags: libc::MSG_NOSIGNAL as u32,
+                user_data: id as u64,
+                ..Default::default()
+            },
+        };
+        match self.push(sqe) {
+            Ok(()) => self.sockets.at(s).ops += 1,
+            Err(e) => {
+                self.ops.remove(id);
+                self.fail_writes(s, e);
+            }
+        }
+    }
+
+    // the stream is broken, what is still queued is dropped and the next flush fails
+    fn fail_writes(&mut self, s: u32, e: Error) {
+        let slot = self.sockets.at(s);
+        let writes = std::mem::take(&mut slot.writes);
+        slot.write_error = Some(e);
+        for (buffer, _, _) in writes {
+            self.release(buffer);
+        }
+    }
+
+    fn release(&mut self, buffer: WriteBuffer) {
+        if let WriteBuffer::Fixed(i) = buffer {
+            self.write_buffers.free.push(i);
+        }
+    }
+
+    fn free_listener(&mut self, l: u32) {
+        let slot = self.listeners.at(l);
+        if slot.closed && slot.ops == 0 {
+            self.listeners.remove(l);
+        }
+    }
+
+    fn free_socket(&mut self, s: u32) {
+        let slot = self.sockets.at(s);
+        if slot.closed && slot.ops == 0 {
+            for (buffer, _, _) in self.sockets.remove(s).writes {
+                self.release(buffer);
+            }
+        }
+    }
+}
+
+thread_local! {
+    static DRIVER: RefCell<Option<Driver>> = const { RefCell::new(None) };
+}
+
+fn with_driver<R>(f: impl FnOnce(&mut Driver) -> R) -> Result<R> {
+    DRIVER
+        .try_with(|driver| driver.borrow_mut().as_mut().map(f))
+        .ok()
+        .flatten()
+        .ok_or_else(|| Error::new(ErrorKind::NotConnected, "io_uring is not running."))
+}
+
+struct RingFd(RawFd);
+
+impl AsRawFd for RingFd {
+    fn as_raw_fd(&self) -> RawFd {
+        self.0
+    }
+}
+
+// submit and reap whenever a connection queued operations or the ring has completions
+async fn reap(ring: AsyncFd<RingFd>, notify: Arc<Notify>) {
+    loop {
+        match with_driver(Driver::turn) {
+            Ok(Ok(0)) => {}
+            // let the woken connections run before reaping again
+            Ok(Ok(_)) => {
+                yield_now().await;
+                continue;
+            }
+            Ok(Err(e)) => {
+                error!("io_uring failed: {}", e);
+                return;
+            }
+            Err(_) => return,
+        }
+        select! {
+            result = ring.readable() => match result {
+                // cleared before reaping, so completions after the reap make it ready again
+                Ok(mut guard) => guard.clear_ready(),
+                Err(e) => {
+                    error!("Failed to poll io_uring: {}", e);
+                    return;
+                }
+            },
+            _ = notify.notified() => {}
+        }
+    }
+}
+
+// set up the ring of the calling thread and its reaper on the current runtime
+pub fn start() -> Result<()> {
+    let driver = Driver::new()?;
+    let fd = driver.ring.fd.as_raw_fd();
+    let notify = driver.notify.clone();
+    let ring = AsyncFd::with_interest(RingFd(fd), Interest::READABLE)?;
+    DRIVER.with(|d| *d.borrow_mut() = Some(driver));
+    tokio::spawn(reap(ring, notify));
+    Ok(())
+}
+
+// close the ring of the calling thread, every operation in flight is cancelled with it
+pub fn stop() {
+    let _ = DRIVER.try_with(|d| d.borrow_mut().take());
+}
+
+#[derive(Debug)]
+pub struct Listener {
+    id: u32,
+    generation: u32,
+}
+
+impl Listener {
+    pub fn new(listener: TcpListener) -> Result<Self> {
+        let (id, generation) = with_driver(|d| {
+            d.listeners.insert(ListenerSlot {
+                listener,
+                ops: 0,
+                accept: None,
+                accepted: VecDeque::new(),
+                waker: None,
+                closed: false,
+            })
+        })?;
+        Ok(Listener { id, generation })
+    }
+
+    // cancel safe, connections accepted meanwhile wait in the queue
+    pub async fn accept(&self) -> Result<(TcpStream, SocketAddr)> {
+        poll_fn(|cx| {
+            let polled = with_driver(|d| loop {
+                let slot = match d.listeners.get(self.id, self.generation) {
+                    Some(slot) => slot,
+                    None => return Poll::Ready(Err(Error::from(ErrorKind::NotConnected))),
+                };
+                match slot.accepted.pop_front() {
+                    // a peer already gone has no address and is dropped
+                    Some(Ok(stream)) => match stream.peer_addr() {
+                        Ok(addr) => return Poll::Ready(Ok((stream, addr))),
+                        Err(_) => continue,
+                    },
+                    Some(Err(e)) => return Poll::Ready(Err(e)),
+                    None => {}
+                }
+                slot.waker = Some(cx.waker().clone());
+                if slot.accept.is_none() {
+                    d.arm_accept(self.id);
+                }
+                return Poll::Pending;
+            });
+            match polled {
+                Ok(poll) => poll,
+                Err(e) => Poll::Ready(Err(e)),
+            }
+        })
+        .await
+    }
+}
+
+impl Drop for Listener {
+    fn drop(&mut self) {
+        let _ = with_driver(|d| {
+            if let Some(slot) = d.listeners.get(self.id, self.generation) {
+                slot.closed = true;
+                slot.accepted.clear();
+                if let Some(op) = slot.accept {
+                    d.cancel(op);
+                }
+                d.free_listener(self.id);
+            }
+        });
+    }
+}
+
+// connection of the ring of its thread, receives from the moment it is created
+#[derive(Debug)]
+pub struct Socket {
+    id: u32,
+    generation: u32,
+}
+
+impl Socket {
+    pub fn new(stream: TcpStream) -> Result<Self> {
+        with_driver(|d| {
+            let (id, generation) = d.sockets.insert(SocketSlot {
+                stream,
+                ops: 0,
+                recv: None,
+                inbox: BytesMut::new(),
+                eof: false,
+                error: None,
+                reader: None,
+                writes: VecDeque::new(),
+                write_error: None,
+                writer: None,
+                detaching: false,
+                closed: false,
+            });
+            d.arm_recv(id);
+            Socket { id, generation }
+        })
+    }
+
+    // f finds the slot by id, which is checked to still be this socket
+    fn with<R>(&self, f: impl FnOnce(&mut Driver) -> R) -> Result<R> {
+        with_driver(|d| match d.sockets.get(self.id, self.generation) {
+            Some(_) => Ok(f(d)),
+            None => Err(Error::from(ErrorKind::NotConnected)),
+        })?
+    }
+
+    // received bytes, the end of the stream or an error are ready to be read
+    pub async fn readable(&self) -> Result<()> {
+        poll_fn(|cx| {
+            match self.with(|d| {
+                let slot = d.sockets.at(self.id);
+                if !slot.inbox.is_empty() || slot.eof || slot.error.is_some() {
+                    return true;
+                }
+                slot.reader = Some(cx.waker().clone());
+                false
+            }) {
+                Ok(true) => Poll::Ready(Ok(())),
+                Ok(false) => Poll::Pending,
+                Err(e) => Poll::Ready(Err(e)),
+            }
+        })
+        .await
+    }
+
+    // like TcpStream::try_read_buf, 0 at the end of the stream
+    pub fn try_read_buf(&self, buffer: &mut BytesMut) -> Result<usize> {
+        self.with(|d| {
+            let slot = d.sockets.at(self.id);
+            if slot.inbox.is_empty() {
+                return match slot.error.take() {
+                    Some(e) => Err(e),
+                    None if slot.eof => Ok(0),
+                    None => Err(Error::from(ErrorKind::WouldBlock)),
+                };
+            }
+            let n = slot.inbox.len();
+            if buffer.is_empty() {
+                std::mem::swap(buffer, &mut slot.inbox);
+            } else {
+                buffer.extend_from_slice(&slot.inbox);
+                slot.inbox.clear();
+            }
+            // caught up after having paused
+            if slot.recv.is_none() && !slot.eof && slot.error.is_none() && !slot.detaching {
+                d.arm_recv(self.id);
+            }
+            Ok(n)
+        })?
+    }
+
+    // wait until at most max buffers are being written, fails once a write failed
+    async fn drain(&self, max: usize) -> Result<()> {
+        poll_fn(|cx| {
+            match self.with(|d| {
+                let slot = d.sockets.at(self.id);
+                if let Some(e) = slot.write_error.take() {
+                    return Some(Err(e));
+                }
+                if slot.writes.len() <= max {
+                    return Some(Ok(()));
+                }
+                slot.writer = Some(cx.waker().clone());
+                None
+            }) {
+                Ok(Some(result)) => Poll::Ready(result),
+                Ok(None) => Poll::Pending,
+                Err(e) => Poll::Ready(Err(e)),
+            }
+        })
+        .await
+    }
+
+    /* hand every queued frame to the ring without waiting for it to be written,
+    a connection writing faster than its peer reads waits for its oldest buffers */
+    pub async fn write_frames(&self, pending: &mut VecDeque<Bytes>) -> Result<()> {
+        while !pending.is_empty() {
+            self.drain(WRITES_QUEUED_MAX - 1).await?;
+            self.with(|d| {
+                let (buffer, len) = d.fill(pending);
+                d.queue_write(self.id, buffer, len);
+            })?;
+        }
+        Ok(())
+    }
+
+    // once everything is written
+    pub async fn shutdown(&self) -> Result<()> {
+        self.drain(0).await?;
+        self.with(|d| d.sockets.at(self.id).stream.shutdown(Shutdown::Write))?
+    }
+
+    /* stop receiving and take the stream out of the ring with what was received and not read,
+    e.g. to relay it with ordinary readiness based I/O */
+    pub async fn detach(&mut self) -> Result<(TcpStream, BytesMut)> {
+        self.with(|d| {
+            let slot = d.sockets.at(self.id);
+            slot.detaching = true;
+            if let Some(op) = slot.recv {
+                d.cancel(op);
+            }
+        })?;
+        self.drain(0).await?;
+        poll_fn(|cx| {
+            match self.with(|d| {
+                let slot = d.sockets.at(self.id);
+                if slot.ops == 0 {
+                    return true;
+                }
+                slot.reader = Some(cx.waker().clone());
+                false
+            }) {
+                Ok(true) => Poll::Ready(Ok(())),
+                Ok(false) => Poll::Pending,
+                Err(e) => Poll::Ready(Err(e)),
+            }
+        })
+        .await?;
+        with_driver(|d| {
+            let slot = d.sockets.remove(self.id);
+            (slot.stream, slot.inbox)
+        })
+    }
+}
+
+impl Drop for Socket {
+    fn drop(&mut self) {
+        let _ = self.with(|d| {
+            let slot = d.sockets.at(self.id);
+            slot.closed = true;
+            slot.inbox = BytesMut::new();
+            if let Some(op) = slot.recv {
+                d.cancel(op);
+            }
+            d.free_socket(self.id);
+        });
+    }
+}
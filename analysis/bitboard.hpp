@@ -0,0 +1,526 @@
+#ifndef BITBOARD_HPP
+#define BITBOARD_HPP
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+/* notes:
+Bitboards and a legal move generator for a single board, requires C++20.
+Board size and piece set are template parameters: masks, shifts and attack tables
+are computed at compile time and pieces absent from the set are compiled out,
+so every variant of variant_list.txt gets its own generator (8x8 down to Very Small).
+Square s = y * W + x with the conventions of 5dcserver/src/engine.rs:
+y = 0 is the back rank of white, x = 0 is the a-file.
+Only moves inside one board are generated, time travel is left to the 5D layer,
+so unicorns and dragons (which need three axes) are not board pieces and
+princesses move like queens. Legal means the mover's kings are not attacked afterwards.
+Pawns double step and kings castle while unmoved, promotion is to a queen as in the game,
+or to any piece with Underpromotion for comparing against classical perft results. */
+
+namespace bitboard
+{
+
+enum piece : uint8_t
+{
+    pawn,
+    knight,
+    bishop,
+    rook,
+    queen,
+    king,
+    princess,
+    piece_count,
+    no_piece = piece_count
+};
+
+enum color : uint8_t
+{
+    white,
+    black
+};
+
+constexpr unsigned set_of(piece p)
+{
+    return 1u << p;
+}
+
+constexpr unsigned standard_pieces =
+    set_of(pawn) | set_of(knight) | set_of(bishop) | set_of(rook) | set_of(queen) | set_of(king);
+
+template <int W, int H>
+struct geometry
+{
+    static_assert(W >= 1 && H >= 1 && W * H <= 64, "a board must fit in 64 bits");
+
+    static constexpr int width = W;
+    static constexpr int height = H;
+    static constexpr int size = W * H;
+    static constexpr uint64_t all = size == 64 ? ~uint64_t(0) : (uint64_t(1) << size) - 1;
+
+    static constexpr uint64_t bit(int x, int y)
+    {
+        return uint64_t(1) << (y * W + x);
+    }
+
+    static constexpr uint64_t file(int x)
+    {
+        uint64_t b = 0;
+        for (int y = 0; y < H; ++y)
+            b |= bit(x, y);
+        return b;
+    }
+
+    static constexpr uint64_t rank(int y)
+    {
+        return all & ((uint64_t(1) << W) - 1) << (y * W);
+    }
+
+    /* squares that stay on the board when moved by dx files */
+    static constexpr uint64_t keep(int dx)
+    {
+        uint64_t b = 0;
+        for (int x = 0; x < W; ++x)
+            if (x + dx >= 0 && x + dx < W)
+                b |= file(x);
+        return b;
+    }
+
+    template <int DX, int DY>
+    static constexpr uint64_t shift(uint64_t b)
+    {
+        constexpr int n = DY * W + DX;
+        b &= keep(DX);
+        if constexpr (n >= 64 || n <= -64)
+            return 0;
+        else if constexpr (n >= 0)
+            return (b << n) & all;
+        else
+            return b >> -n;
+    }
+
+    /* squares attacked by a slider along (DX, DY), the first blocker included */
+    template <int DX, int DY>
+    static constexpr uint64_t ray(uint64_t from, uint64_t empty)
+    {
+        uint64_t attacks = 0;
+        for (uint64_t b = shift<DX, DY>(from); b; b = shift<DX, DY>(b & empty))
+        {
+            attacks |= b;
+            b &= empty;
+        }
+        return attacks;
+    }
+
+    static constexpr uint64_t rook_attacks(uint64_t from, uint64_t occupied)
+    {
+        const uint64_t empty = ~occupied;
+        return ray<1, 0>(from, empty) | ray<-1, 0>(from, empty) | ray<0, 1>(from, empty) | ray<0, -1>(from, empty);
+    }
+
+    static constexpr uint64_t bishop_attacks(uint64_t from, uint64_t occupied)
+    {
+        const uint64_t empty = ~occupied;
+        return ray<1, 1>(from, empty) | ray<-1, 1>(from, empty) | ray<1, -1>(from, empty) | ray<-1, -1>(from, empty);
+    }
+
+    static constexpr uint64_t knight_step(uint64_t b)
+    {
+        return shift<1, 2>(b) | shift<-1, 2>(b) | shift<2, 1>(b) | shift<-2, 1>(b) | shift<1, -2>(b) |
+               shift<-1, -2>(b) | shift<2, -1>(b) | shift<-2, -1>(b);
+    }
+
+    static constexpr uint64_t king_step(uint64_t b)
+    {
+        return shift<1, 0>(b) | shift<-1, 0>(b) | shift<0, 1>(b) | shift<0, -1>(b) | shift<1, 1>(b) |
+               shift<-1, 1>(b) | shift<1, -1>(b) | shift<-1, -1>(b);
+    }
+
+    template <uint64_t (*Step)(uint64_t)>
+    static constexpr std::array<uint64_t, size> table()
+    {
+        std::array<uint64_t, size> t{};
+        for (int s = 0; s < size; ++s)
+            t[s] = Step(uint64_t(1) << s);
+        return t;
+    }
+
+    static constexpr std::array<uint64_t, size> knight_table = table<knight_step>();
+    static constexpr std::array<uint64_t, size> king_table = table<king_step>();
+};
+
+struct move
+{
+    uint8_t from;
+    uint8_t to;
+    uint8_t promotion; /* no_piece unless a pawn reaches the last rank */
+    uint8_t special;
+
+    static constexpr uint8_t quiet = 0;
+    static constexpr uint8_t double_step = 1;
+    static constexpr uint8_t en_passant = 2;
+    static constexpr uint8_t castle = 3;
+};
+
+/* more than the 218 moves of the richest known 8x8 position */
+constexpr size_t max_moves = 256;
+
+template <int W, int H, unsigned Pieces = standard_pieces, bool Underpromotion = false>
+class position
+{
+public:
+    using geo = geometry<W, H>;
+
+    static constexpr bool has(piece p)
+    {
+        return (Pieces & set_of(p)) != 0;
+    }
+
+    /* ranks from y = H - 1 down to y = 0 separated by '/', digits count empty squares,
+    PNBRQKS for white and pnbrqks for black, then the side to move 'w' or 'b'.
+    Kings, rooks on the back rank and pawns on the second rank start unmoved.
+    An optional castling field like FEN ("KQkq" or "-") restricts which rooks are unmoved,
+    an optional en passant field names the square passed by the last double step, e.g. "e3". */
+    static position from_layout(std::string_view layout)
+    {
+        position p;
+        int x = 0, y = H - 1;
+        size_t i = 0;
+        for (; i < layout.size() && layout[i] != ' '; ++i)
+        {
+            char c = layout[i];
+            if (c == '/')
+            {
+                if (x != W)
+                    throw std::runtime_error("rank of the wrong width in layout");
+                x = 0;
+                --y;
+                continue;
+            }
+            if (c >= '1' && c <= '9')
+            {
+                x += c - '0';
+                continue;
+            }
+            piece kind = piece_of(c);
+            if (kind == no_piece || !has(kind))
+                throw std::runtime_error(std::string("piece outside the piece set in layout: ") + c);
+            if (x >= W || y < 0)
+                throw std::runtime_error("layout does not fit the board");
+            color side = c >= 'a' ? black : white;
+            uint64_t b = geo::bit(x, y);
+            p.pieces_[kind] |= b;
+            p.colors_[side] |= b;
+            const int back = side == white ? 0 : H - 1;
+            if (kind == king || (kind == rook && y == back) || (kind == pawn && y == back + (side == white ? 1 : -1)))
+                p.unmoved_ |= b;
+            ++x;
+        }
+        if (x != W || y != 0)
+            throw std::runtime_error("layout does not fit the board");
+        if (i + 1 >= layout.size() || (layout[i + 1] != 'w' && layout[i + 1] != 'b'))
+            throw std::runtime_error("missing side to move in layout");
+        p.side_ = layout[i + 1] == 'w' ? white : black;
+        i += 2;
+        if (i + 1 < layout.size())
+        {
+            uint64_t rooks = p.pieces_[rook] & (geo::rank(0) | geo::rank(H - 1));
+            uint64_t castling = 0;
+            for (++i; i < layout.size() && layout[i] != ' '; ++i)
+            {
+                switch (layout[i])
+                {
+                case 'K': castling |= geo::bit(W - 1, 0); break;
+                case 'Q': castling |= geo::bit(0, 0); break;
+                case 'k': castling |= geo::bit(W - 1, H - 1); break;
+                case 'q': castling |= geo::bit(0, H - 1); break;
+                case '-': break;
+                default: throw std::runtime_error("bad castling field in layout");
+                }
+            }
+            p.unmoved_ &= ~(rooks & ~castling);
+            if (i + 2 < layout.size() && layout[i + 1] != '-')
+            {
+                int ex = layout[i + 1] - 'a', ey = layout[i + 2] - '1';
+                if (ex < 0 || ex >= W || ey < 0 || ey >= H)
+                    throw std::runtime_error("bad en passant field in layout");
+                p.en_passant_ = int8_t(ey * W + ex);
+            }
+        }
+        return p;
+    }
+
+    color side() const
+    {
+        return side_;
+    }
+
+    uint64_t occupied() const
+    {
+        return colors_[white] | colors_[black];
+    }
+
+    uint64_t pieces(piece p, color c) const
+    {
+        return pieces_[p] & colors_[c];
+    }
+
+    piece piece_at(int s) const
+    {
+        const uint64_t b = uint64_t(1) << s;
+        for (int p = 0; p < piece_count; ++p)
+            if (has(piece(p)) && (pieces_[p] & b))
+                return piece(p);
+        return no_piece;
+    }
+
+    /* whether square s is attacked by a piece of color by */
+    bool attacked(int s, color by) const
+    {
+        const uint64_t b = uint64_t(1) << s;
+        const uint64_t theirs = colors_[by];
+        if constexpr (has(pawn))
+        {
+            /* a pawn of by attacks s from one rank behind s, seen from by */
+            const uint64_t pawns = pieces_[pawn] & theirs;
+            uint64_t from = by == white ? geo::template shift<1, -1>(b) | geo::template shift<-1, -1>(b)
+                                        : geo::template shift<1, 1>(b) | geo::template shift<-1, 1>(b);
+            if (from & pawns)
+                return true;
+        }
+        if constexpr (has(knight))
+            if (geo::knight_table[s] & pieces_[knight] & theirs)
+                return true;
+        if constexpr (has(king))
+            if (geo::king_table[s] & pieces_[king] & theirs)
+                return true;
+        const uint64_t diagonal = (pieces_[bishop] | pieces_[queen] | pieces_[princess]) & theirs;
+        if (diagonal && (geo::bishop_attacks(b, occupied()) & diagonal))
+            return true;
+        const uint64_t straight = (pieces_[rook] | pieces_[queen] | pieces_[princess]) & theirs;
+        if (straight && (geo::rook_attacks(b, occupied()) & straight))
+            return true;
+        return false;
+    }
+
+    /* whether a king of c is attacked */
+    bool in_check(color c) const
+    {
+        if constexpr (!has(king))
+            return false;
+        const color them = color(c ^ 1);
+        for (uint64_t k = pieces_[king] & colors_[c]; k; k &= k - 1)
+            if (attacked(std::countr_zero(k), them))
+                return true;
+        return false;
+    }
+
+    /* writes the legal moves of the side to move to out, returns their count */
+    size_t generate(move *out) const
+    {
+        move pseudo[max_moves];
+        size_t n = generate_pseudo(pseudo), legal = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            position next = *this;
+            next.make(pseudo[i]);
+            if (!next.in_check(side_))
+                out[legal++] = pseudo[i];
+        }
+        return legal;
+    }
+
+    void make(const move &m)
+    {
+        const uint64_t from = uint64_t(1) << m.from, to = uint64_t(1) << m.to;
+        const color us = side_, them = color(side_ ^ 1);
+        const piece mover = piece_at(m.from);
+        if (colors_[them] & to)
+        {
+            pieces_[piece_at(m.to)] &= ~to;
+            colors_[them] &= ~to;
+        }
+        if (m.special == move::en_passant)
+        {
+            const uint64_t captured = us == white ? to >> W : to << W;
+            pieces_[pawn] &= ~captured;
+            colors_[them] &= ~captured;
+        }
+        pieces_[mover] &= ~from;
+        pieces_[m.promotion == no_piece ? uint8_t(mover) : m.promotion] |= to;
+        colors_[us] = (colors_[us] & ~from) | to;
+        if (m.special == move::castle)
+        {
+            /* the rook on the edge the king moved towards lands on the square passed */
+            const int y = m.from / W;
+            const bool east = m.to > m.from;
+            const uint64_t corner = geo::bit(east ? W - 1 : 0, y);
+            const uint64_t passed = uint64_t(1) << ((m.from + m.to) / 2);
+            pieces_[rook] = (pieces_[rook] & ~corner) | passed;
+            colors_[us] = (colors_[us] & ~corner) | passed;
+            unmoved_ &= ~corner;
+        }
+        unmoved_ &= ~(from | to);
+        en_passant_ = m.special == move::double_step ? int8_t((m.from + m.to) / 2) : int8_t(-1);
+        side_ = them;
+    }
+
+    uint64_t perft(int depth) const
+    {
+        move moves[max_moves];
+        const size_t n = generate(moves);
+        if (depth <= 1)
+            return depth == 1 ? n : 1;
+        uint64_t nodes = 0;
+        for (size_t i = 0; i < n; ++i)
+        {
+            position next = *this;
+            next.make(moves[i]);
+            nodes += next.perft(depth - 1);
+        }
+        return nodes;
+    }
+
+private:
+    static piece piece_of(char c)
+    {
+        switch (c | 0x20)
+        {
+        case 'p': return pawn;
+        case 'n': return knight;
+        case 'b': return bishop;
+        case 'r': return rook;
+        case 'q': return queen;
+        case 'k': return king;
+        case 's': return princess;
+        default: return no_piece;
+        }
+    }
+
+    static void add(move *out, size_t &n, int from, uint64_t targets, uint8_t special = move::quiet)
+    {
+        for (; targets; targets &= targets - 1)
+            out[n++] = move{uint8_t(from), uint8_t(std::countr_zero(targets)), no_piece, special};
+    }
+
+    static void add_pawn(move *out, size_t &n, int from, int to, uint64_t last_rank, uint8_t special)
+    {
+        if (!((uint64_t(1) << to) & last_rank))
+        {
+            out[n++] = move{uint8_t(from), uint8_t(to), no_piece, special};
+            return;
+        }
+        out[n++] = move{uint8_t(from), uint8_t(to), queen, special};
+        if constexpr (Underpromotion)
+            for (piece p : {knight, bishop, rook})
+                if (has(p))
+                    out[n++] = move{uint8_t(from), uint8_t(to), p, special};
+    }
+
+    size_t generate_pseudo(move *out) const
+    {
+        size_t n = 0;
+        const color us = side_, them = color(side_ ^ 1);
+        const uint64_t ours = colors_[us], theirs = colors_[them], occ = occupied(), empty = geo::all & ~occ;
+        if constexpr (has(pawn))
+        {
+            const int forward = us == white ? W : -W;
+            const uint64_t last_rank = geo::rank(us == white ? H - 1 : 0);
+            const uint64_t passed = en_passant_ >= 0 ? uint64_t(1) << en_passant_ : 0;
+            for (uint64_t b = pieces_[pawn] & ours; b; b &= b - 1)
+            {
+                const int s = std::countr_zero(b);
+                const uint64_t from = uint64_t(1) << s;
+                const uint64_t ahead = us == white ? geo::template shift<0, 1>(from) : geo::template shift<0, -1>(from);
+                if (ahead & empty)
+                {
+                    add_pawn(out, n, s, s + forward, last_rank, move::quiet);
+                    const uint64_t two = us == white ? geo::template shift<0, 1>(ahead) : geo::template shift<0, -1>(ahead);
+                    if ((unmoved_ & from) && (two & empty))
+                        out[n++] = move{uint8_t(s), uint8_t(s + 2 * forward), no_piece, move::double_step};
+                }
+                const uint64_t captures = us == white ? geo::template shift<1, 1>(from) | geo::template shift<-1, 1>(from)
+                                                      : geo::template shift<1, -1>(from) | geo::template shift<-1, -1>(from);
+                for (uint64_t c = captures & theirs; c; c &= c - 1)
+                    add_pawn(out, n, s, std::countr_zero(c), last_rank, move::quiet);
+                if (captures & passed)
+                    out[n++] = move{uint8_t(s), uint8_t(en_passant_), no_piece, move::en_passant};
+            }
+        }
+        if constexpr (has(knight))
+            for (uint64_t b = pieces_[knight] & ours; b; b &= b - 1)
+            {
+                const int s = std::countr_zero(b);
+                add(out, n, s, geo::knight_table[s] & ~ours);
+            }
+        for (uint64_t b = (pieces_[bishop] | pieces_[queen] | pieces_[princess]) & ours; b; b &= b - 1)
+        {
+            const int s = std::countr_zero(b);
+            uint64_t targets = geo::bishop_attacks(uint64_t(1) << s, occ);
+            if (!(pieces_[bishop] & (uint64_t(1) << s)))
+                targets |= geo::rook_attacks(uint64_t(1) << s, occ);
+            add(out, n, s, targets & ~ours);
+        }
+        if constexpr (has(rook))
+            for (uint64_t b = pieces_[rook] & ours; b; b &= b - 1)
+            {
+                const int s = std::countr_zero(b);
+                add(out, n, s, geo::rook_attacks(uint64_t(1) << s, occ) & ~ours);
+            }
+        if constexpr (has(king))
+            for (uint64_t b = pieces_[king] & ours; b; b &= b - 1)
+            {
+                const int s = std::countr_zero(b);
+                add(out, n, s, geo::king_table[s] & ~ours);
+                if (unmoved_ & (uint64_t(1) << s))
+                    castles(out, n, s);
+            }
+        return n;
+    }
+
+    /* the king moves two squares towards an unmoved rook on the edge of its rank,
+    the squares between them are empty and the king neither starts nor passes in check */
+    void castles(move *out, size_t &n, int s) const
+    {
+        if constexpr (has(rook))
+        {
+            const int x = s % W, y = s / W;
+            const color them = color(side_ ^ 1);
+            const uint64_t rooks = pieces_[rook] & colors_[side_] & unmoved_;
+            bool checked = false, in_check_now = false;
+            for (int dir : {1, -1})
+            {
+                const int edge = dir > 0 ? W - 1 : 0;
+                if ((edge - x) * dir < 3 || !(rooks & geo::bit(edge, y)))
+                    continue;
+                bool clear = true;
+                for (int i = x + dir; i != edge && clear; i += dir)
+                    clear = !(occupied() & geo::bit(i, y));
+                if (!clear)
+                    continue;
+                if (!checked)
+                {
+                    in_check_now = attacked(s, them);
+                    checked = true;
+                }
+                if (in_check_now || attacked(s + dir, them))
+                    continue;
+                out[n++] = move{uint8_t(s), uint8_t(s + 2 * dir), no_piece, move::castle};
+            }
+        }
+    }
+
+    uint64_t pieces_[piece_count + 1] = {}; /* indexed by piece, no_piece is always empty */
+    uint64_t colors_[2] = {};
+    uint64_t unmoved_ = 0;
+    int8_t en_passant_ = -1; /* square passed by the last double step */
+    color side_ = white;
+};
+
+} // namespace bitboard
+
+#endif
@@ -0,0 +1,35 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <stdint.h>
+
+/* notes:
+Capture files written by 5dcserver when `capture` is set in its config.
+All data are little-endian, structs are packed like message.h.
+A file is a CaptureFileHeader followed by records until the end of the file,
+records are appended and never rewritten, a file may end with a truncated record.
+Every server run appends a session record first, connection ids restart from 1 in each session,
+so a connection is identified by its session and its connection id.
+Records of a connection are in the order they were read or queued for writing,
+records of different connections are interleaved in roughly the same order. */
+
+#pragma pack(push, 1)
+
+struct CaptureFileHeader
+{
+    char magic[8]; /* = "5DCCAP\0\0" */
+    uint64_t version; /* = 1 */
+};
+
+struct CaptureRecord
+{
+    uint64_t timestamp; /* nanoseconds since unix epoch */
+    uint32_t connection; /* Session = 0, Connection = id */
+    uint32_t direction; /* Session = 0, C2S = 1, S2C = 2 */
+    /* followed by the frame exactly as in message.h, starting with its length field,
+    the frame of a session record is empty (length = 0) */
+};
+
+#pragma pack(pop)
+
+#endif /* CAPTURE_H */
@@ -0,0 +1,382 @@
+#ifndef CAPTURE_READER_HPP
+#define CAPTURE_READER_HPP
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "capture.h"
+#include "message_view.hpp"
+
+/* notes:
+Read-only access to capture files (see capture.h) through mmap, requires C++20 and POSIX.
+Records and their frames are views into the mapping, nothing is copied.
+A scan stops at the first truncated record, which is where the recorder is still writing.
+capture_index maps matchId (from S2CMatchStart) to the offsets of the records of the match,
+match ids restart in every session of 5dcserver, so a match is identified by its session too,
+it is saved next to the capture and extended from where it stopped when the capture grows. */
+
+namespace capture
+{
+
+struct record_view
+{
+    uint64_t offset; /* of the CaptureRecord in the file */
+    uint64_t session; /* counted from 1 by a scan, 0 when looked up by offset */
+    const CaptureRecord *head;
+    const uint8_t *frame; /* starts at the length field */
+    size_t frame_size; /* includes the length field */
+
+    bool is_session() const
+    {
+        return head->direction == 0;
+    }
+
+    message::direction dir() const
+    {
+        return static_cast<message::direction>(head->direction);
+    }
+
+    /* 0 when the frame is too short to have a type */
+    int64_t type() const
+    {
+        return frame_size >= sizeof(message::header) ? message::view_as<message::header>(frame)->type : 0;
+    }
+
+    template <typename T>
+    const T *as() const
+    {
+        return message::try_view_as<T>(frame, frame_size);
+    }
+
+    uint64_t end() const
+    {
+        return offset + sizeof(CaptureRecord) + frame_size;
+    }
+};
+
+namespace detail
+{
+
+/* record at offset, nullopt if it is truncated */
+inline std::optional<record_view> parse(const uint8_t *data, size_t size, uint64_t offset, uint64_t session)
+{
+    if (offset > size || size - offset < sizeof(CaptureRecord) + sizeof(uint64_t))
+        return std::nullopt;
+    const uint8_t *frame = data + offset + sizeof(CaptureRecord);
+    uint64_t length;
+    std::memcpy(&length, frame, sizeof(length));
+    if (length > size - offset - sizeof(CaptureRecord) - sizeof(uint64_t))
+        return std::nullopt;
+    return record_view{offset, session, reinterpret_cast<const CaptureRecord *>(data + offset), frame,
+                       static_cast<size_t>(sizeof(uint64_t) + length)};
+}
+
+} // namespace detail
+
+class record_iterator
+{
+public:
+    using value_type = record_view;
+    using difference_type = std::ptrdiff_t;
+
+    record_iterator() = default;
+
+    record_iterator(const uint8_t *data, size_t size, uint64_t offset, uint64_t session)
+        : data_(data), size_(size)
+    {
+        load(offset, session);
+    }
+
+    const record_view &operator*() const
+    {
+        return *current_;
+    }
+
+    const record_view *operator->() const
+    {
+        return &*current_;
+    }
+
+    record_iterator &operator++()
+    {
+        load(current_->end(), current_->session);
+        return *this;
+    }
+
+    record_iterator operator++(int)
+    {
+        record_iterator old = *this;
+        ++*this;
+        return old;
+    }
+
+    bool operator==(std::default_sentinel_t) const
+    {
+        return !current_;
+    }
+
+private:
+    void load(uint64_t offset, uint64_t session)
+    {
+        current_ = detail::parse(data_, size_, offset, session);
+        if (current_ && current_->is_session())
+            current_->session = session + 1;
+    }
+
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    std::optional<record_view> current_;
+};
+
+static_assert(std::input_iterator<record_iterator>);
+
+struct record_range
+{
+    record_iterator first;
+
+    record_iterator begin() const
+    {
+        return first;
+    }
+
+    std::default_sentinel_t end() const
+    {
+        return std::default_sentinel;
+    }
+};
+
+class capture_file
+{
+public:
+    explicit capture_file(const std::string &path)
+    {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("cannot open " + path);
+        struct stat st;
+        if (::fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(CaptureFileHeader))
+        {
+            ::close(fd);
+            throw std::runtime_error(path + " is not a capture file");
+        }
+        size_ = size_t(st.st_size);
+        void *p = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+        if (p == MAP_FAILED)
+            throw std::runtime_error("cannot map " + path);
+        data_ = static_cast<const uint8_t *>(p);
+        ::madvise(p, size_, MADV_SEQUENTIAL);
+        const CaptureFileHeader *h = reinterpret_cast<const CaptureFileHeader *>(data_);
+        if (std::memcmp(h->magic, "5DCCAP\0\0", 8) != 0 || h->version != 1)
+        {
+            ::munmap(p, size_);
+            throw std::runtime_error(path + " is not a capture file of version 1");
+        }
+    }
+
+    capture_file(const capture_file &) = delete;
+    capture_file &operator=(const capture_file &) = delete;
+
+    ~capture_file()
+    {
+        ::munmap(const_cast<uint8_t *>(data_), size_);
+    }
+
+    const uint8_t *data() const
+    {
+        return data_;
+    }
+
+    size_t size() const
+    {
+        return size_;
+    }
+
+    /* records from offset, which must be the start of a record in the given session */
+    record_range records(uint64_t offset = sizeof(CaptureFileHeader), uint64_t session = 0) const
+    {
+        return record_range{record_iterator(data_, size_, offset, session)};
+    }
+
+    std::optional<record_view> at(uint64_t offset) const
+    {
+        return detail::parse(data_, size_, offset, 0);
+    }
+
+private:
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+};
+
+/* a connection is in a match from the S2CMatchStart it receives until it forfeits,
+its opponent leaves or a new session starts, the records of the match are
+that S2CMatchStart and the C2SOrS2CAction, C2SForfeit and S2COpponentLeft of both players */
+class capture_index
+{
+public:
+    using offsets = std::vector<uint64_t>;
+    using match_key = std::pair<uint64_t, int64_t>; /* session and matchId */
+
+    /* index the records added since the last update,
+    starts over when the capture is not the one indexed before */
+    void update(const capture_file &file)
+    {
+        std::optional<record_view> first = file.at(sizeof(CaptureFileHeader));
+        uint64_t origin = first ? first->head->timestamp : 0;
+        if (origin != origin_ || covered_ > file.size())
+            *this = capture_index{};
+        origin_ = origin;
+        for (const record_view &r : file.records(covered_, session_))
+        {
+            add(r);
+            covered_ = r.end();
+            session_ = r.session;
+        }
+    }
+
+    const offsets *find(uint64_t session, int64_t match_id) const
+    {
+        auto it = matches_.find(match_key{session, match_id});
+        return it == matches_.end() ? nullptr : &it->second;
+    }
+
+    /* ordered by session then matchId */
+    const std::map<match_key, offsets> &matches() const
+    {
+        return matches_;
+    }
+
+    /* records before this offset are indexed */
+    uint64_t covered() const
+    {
+        return covered_;
+    }
+
+    bool save(const std::string &path) const
+    {
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        out.write(index_magic, 8);
+        put(out, index_version);
+        put(out, origin_);
+        put(out, covered_);
+        put(out, session_);
+        put(out, uint64_t(playing_.size()));
+        for (const auto &[connection, match_id] : playing_)
+        {
+            put(out, connection);
+            put(out, match_id);
+        }
+        put(out, uint64_t(matches_.size()));
+        for (const auto &[key, records] : matches_)
+        {
+            put(out, key.first);
+            put(out, key.second);
+            put(out, uint64_t(records.size()));
+            out.write(reinterpret_cast<const char *>(records.data()), std::streamsize(records.size() * sizeof(uint64_t)));
+        }
+        return bool(out);
+    }
+
+    /* nullopt if the file is missing or not an index */
+    static std::optional<capture_index> load(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        char magic[8];
+        in.read(magic, 8);
+        capture_index index;
+        if (!in || std::memcmp(magic, index_magic, 8) != 0 || get<uint64_t>(in) != index_version)
+            return std::nullopt;
+        index.origin_ = get<uint64_t>(in);
+        index.covered_ = get<uint64_t>(in);
+        index.session_ = get<uint64_t>(in);
+        for (uint64_t n = get<uint64_t>(in); n > 0 && in; --n)
+        {
+            uint32_t connection = get<uint32_t>(in);
+            index.playing_[connection] = get<int64_t>(in);
+        }
+        for (uint64_t n = get<uint64_t>(in); n > 0 && in; --n)
+        {
+            uint64_t session = get<uint64_t>(in);
+            offsets &records = index.matches_[match_key{session, get<int64_t>(in)}];
+            records.resize(get<uint64_t>(in));
+            in.read(reinterpret_cast<char *>(records.data()), std::streamsize(records.size() * sizeof(uint64_t)));
+        }
+        if (!in)
+            return std::nullopt;
+        return index;
+    }
+
+private:
+    static constexpr char index_magic[8] = {'5', 'D', 'C', 'I', 'D', 'X', 0, 0};
+    static constexpr uint64_t index_version = 1;
+
+    template <typename T>
+    static void put(std::ofstream &out, T v)
+    {
+        out.write(reinterpret_cast<const char *>(&v), sizeof(v));
+    }
+
+    template <typename T>
+    static T get(std::ifstream &in)
+    {
+        T v{};
+        in.read(reinterpret_cast<char *>(&v), sizeof(v));
+        return v;
+    }
+
+    void add(const record_view &r)
+    {
+        if (r.is_session())
+        {
+            playing_.clear();
+            return;
+        }
+        if (const S2CMatchStart *start = r.as<S2CMatchStart>())
+        {
+            playing_[r.head->connection] = start->matchId;
+            matches_[match_key{r.session, start->matchId}].push_back(r.offset);
+            return;
+        }
+        auto it = playing_.find(r.head->connection);
+        if (it == playing_.end())
+            return;
+        switch (r.type())
+        {
+        case message::traits<C2SOrS2CAction>::type:
+            matches_[match_key{r.session, it->second}].push_back(r.offset);
+            break;
+        case message::traits<C2SForfeit>::type:
+        case message::traits<S2COpponentLeft>::type:
+            matches_[match_key{r.session, it->second}].push_back(r.offset);
+            playing_.erase(it);
+            break;
+        default:
+            break;
+        }
+    }
+
+    uint64_t origin_ = 0; /* timestamp of the first session */
+    uint64_t covered_ = sizeof(CaptureFileHeader);
+    uint64_t session_ = 0;
+    std::unordered_map<uint32_t, int64_t> playing_; /* connection of the current session to matchId */
+    std::map<match_key, offsets> matches_;
+};
+
+} // namespace capture
+
+#endif /* CAPTURE_READER_HPP */
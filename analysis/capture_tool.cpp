@@ -0,0 +1,228 @@
+/* notes:
+Queries over capture files written by 5dcserver, requires C++20 and POSIX.
+Build:
+    g++ -std=c++20 -O2 -o capture_tool capture_tool.cpp
+The match index is kept in <capture>.idx and extended on every run,
+so only the records appended since the last query are scanned. */
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <utility>
+
+#include "capture_reader.hpp"
+#include "message_view.hpp"
+
+namespace
+{
+
+const char *type_name(int64_t type)
+{
+    static const char *const names[] = {
+        "Unknown", "C2SGreet", "S2CGreet", "C2SMatchCreateOrJoin",
+        "S2CMatchCreateOrJoinResult", "C2SMatchCancel", "S2CMatchCancelResult", "S2CMatchStart",
+        "Unknown8", "S2COpponentLeft", "C2SForfeit", "C2SOrS2CAction",
+        "C2SMatchListRequest", "S2CMatchList",
+    };
+    return type > 0 && type < int64_t(std::size(names)) ? names[type] : "Unknown";
+}
+
+const char *direction_name(message::direction dir)
+{
+    switch (dir)
+    {
+    case message::c2s:
+        return "C2S";
+    case message::s2c:
+        return "S2C";
+    default:
+        return "-";
+    }
+}
+
+void print_usage(const char *arg0)
+{
+    std::printf("\nusage: %s <COMMAND> <CAPTURE FILE> [ARGS]\n\n", arg0);
+    std::printf("commands:\n");
+    std::printf("    stats                   frames and bytes by type and direction\n");
+    std::printf("    matches                 indexed matches with their number of records\n");
+    std::printf("    match <MATCH ID> [SESSION]\n");
+    std::printf("                            every record of a match, in every session by default\n");
+    std::printf("    actions [ACTION TYPE]   C2SOrS2CAction by action type, or the C2S ones of a type\n");
+    std::printf("    unknown                 values seen in the unknown fields of message.h\n");
+}
+
+capture::capture_index load_index(const capture::capture_file &file, const std::string &path)
+{
+    std::string index_path = path + ".idx";
+    capture::capture_index index = capture::capture_index::load(index_path).value_or(capture::capture_index{});
+    uint64_t covered = index.covered();
+    index.update(file);
+    if (index.covered() != covered && !index.save(index_path))
+        std::fprintf(stderr, "cannot save %s\n", index_path.c_str());
+    return index;
+}
+
+void print_record(const capture::record_view &r, uint64_t origin)
+{
+    std::printf("%12.6f %6" PRIu32 " %s %-27s", double(r.head->timestamp - origin) / 1e9, r.head->connection,
+                direction_name(r.dir()), type_name(r.type()));
+    if (const C2SOrS2CAction *a = r.as<C2SOrS2CAction>())
+        std::printf(" action %" PRId64 " color %" PRId64 " seconds %" PRIu64 " (%" PRId64 " T%" PRId64 " %" PRId64
+                    " %" PRId64 ") -> (%" PRId64 " T%" PRId64 " %" PRId64 " %" PRId64 ")",
+                    a->actionType, a->color, a->secondsPassed, a->srcL, a->srcT, a->srcY, a->srcX, a->dstL,
+                    a->dstT, a->dstY, a->dstX);
+    else if (const S2CMatchStart *s = r.as<S2CMatchStart>())
+        std::printf(" clock %" PRId64 " variant %" PRId64 " color %" PRId64 " seconds %" PRIu64, s->clock,
+                    s->variant, s->color, s->secondsPassed);
+    std::printf("\n");
+}
+
+int stats(const capture::capture_file &file)
+{
+    /* (type, direction) to frames and bytes */
+    std::map<std::pair<int64_t, int>, std::pair<uint64_t, uint64_t>> counts;
+    uint64_t sessions = 0, end = sizeof(CaptureFileHeader);
+    for (const capture::record_view &r : file.records())
+    {
+        auto &[frames, bytes] = counts[{r.type(), int(r.dir())}];
+        ++frames;
+        bytes += r.frame_size;
+        sessions = r.session;
+        end = r.end();
+    }
+    std::printf("%" PRIu64 " sessions, %" PRIu64 " bytes, %zu bytes truncated\n", sessions, end,
+                size_t(file.size() - end));
+    for (const auto &[key, value] : counts)
+        if (key.second != 0)
+            std::printf("%s %-27s %12" PRIu64 " frames %14" PRIu64 " bytes\n",
+                        direction_name(message::direction(key.second)), type_name(key.first), value.first,
+                        value.second);
+    return 0;
+}
+
+int matches(const capture::capture_index &index)
+{
+    std::printf("%8s %20s %10s\n", "session", "match id", "records");
+    for (const auto &[key, records] : index.matches())
+        std::printf("%8" PRIu64 " %20" PRId64 " %10zu\n", key.first, key.second, records.size());
+    std::printf("%zu matches\n", index.matches().size());
+    return 0;
+}
+
+int match(const capture::capture_file &file, const capture::capture_index &index, int64_t match_id,
+          std::optional<uint64_t> session)
+{
+    bool found = false;
+    for (const auto &[key, records] : index.matches())
+    {
+        if (key.second != match_id || (session && key.first != *session))
+            continue;
+        found = true;
+        std::printf("session %" PRIu64 " match %" PRId64 "\n", key.first, key.second);
+        uint64_t origin = file.at(records.front())->head->timestamp;
+        for (uint64_t offset : records)
+            print_record(*file.at(offset), origin);
+    }
+    if (!found)
+        std::fprintf(stderr, "match %" PRId64 " not found\n", match_id);
+    return found ? 0 : 1;
+}
+
+int actions(const capture::capture_file &file, std::optional<int64_t> action_type)
+{
+    std::map<std::pair<int64_t, int>, uint64_t> counts;
+    uint64_t origin = 0;
+    for (const capture::record_view &r : file.records())
+    {
+        if (r.is_session())
+            origin = r.head->timestamp;
+        const C2SOrS2CAction *a = r.as<C2SOrS2CAction>();
+        if (a == nullptr)
+            continue;
+        if (!action_type)
+            ++counts[{a->actionType, int(r.dir())}];
+        else if (a->actionType == *action_type && r.dir() == message::c2s)
+            print_record(r, origin);
+    }
+    for (const auto &[key, count] : counts)
+        std::printf("%s action type %2" PRId64 " %12" PRIu64 "\n", direction_name(message::direction(key.second)),
+                    key.first, count);
+    return 0;
+}
+
+int unknown(const capture::capture_file &file)
+{
+    /* field name to value to count */
+    std::map<std::string, std::map<int64_t, uint64_t>> seen;
+    for (const capture::record_view &r : file.records())
+    {
+        if (const C2SGreet *m = r.as<C2SGreet>())
+        {
+            ++seen["C2SGreet.version1"][m->version1];
+            ++seen["C2SGreet.version2"][m->version2];
+            ++seen["C2SGreet.unknown1"][m->unknown1];
+            ++seen["C2SGreet.unknown2"][m->unknown2];
+            ++seen["C2SGreet.unknown3"][m->unknown3];
+            ++seen["C2SGreet.unknown4"][m->unknown4];
+        }
+        else if (const C2SMatchCancel *m = r.as<C2SMatchCancel>())
+            ++seen["C2SMatchCancel.unknown"][m->unknown];
+        else if (const C2SForfeit *m = r.as<C2SForfeit>())
+            ++seen["C2SForfeit.unknown"][m->unknown];
+        else if (const C2SMatchListRequest *m = r.as<C2SMatchListRequest>())
+            ++seen["C2SMatchListRequest.unknown"][m->unknown];
+        else if (const S2CGreet *m = r.as<S2CGreet>())
+            ++seen["S2CGreet.version"][m->version];
+        else if (const S2CMatchList *m = r.as<S2CMatchList>())
+            ++seen["S2CMatchList.unknown1"][m->unknown1];
+        else if (const S2CMatchCreateOrJoinResult *m = r.as<S2CMatchCreateOrJoinResult>())
+            ++seen["S2CMatchCreateOrJoinResult.reason"][m->reason];
+    }
+    for (const auto &[name, values] : seen)
+    {
+        std::printf("%s\n", name.c_str());
+        for (const auto &[value, count] : values)
+            std::printf("    %20" PRId64 " %12" PRIu64 "\n", value, count);
+    }
+    return 0;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    if (argc < 3)
+    {
+        print_usage(argv[0]);
+        return 1;
+    }
+    std::string command = argv[1];
+    std::string path = argv[2];
+    try
+    {
+        capture::capture_file file(path);
+        if (command == "stats")
+            return stats(file);
+        if (command == "matches")
+            return matches(load_index(file, path));
+        if (command == "match" && argc > 3)
+            return match(file, load_index(file, path), std::strtoll(argv[3], nullptr, 10),
+                         argc > 4 ? std::optional<uint64_t>(std::strtoull(argv[4], nullptr, 10)) : std::nullopt);
+        if (command == "actions")
+            return actions(file, argc > 3 ? std::optional<int64_t>(std::strtoll(argv[3], nullptr, 10))
+                                          : std::nullopt);
+        if (command == "unknown")
+            return unknown(file);
+    }
+    catch (const std::exception &e)
+    {
+        std::fprintf(stderr, "%s\n", e.what());
+        return 1;
+    }
+    print_usage(argv[0]);
+    return 1;
+}
@@ -0,0 +1,128 @@
+#ifndef FRAME_DECODER_HPP
+#define FRAME_DECODER_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <span>
+
+#include "message_view.hpp"
+
+/* notes:
+Streaming decoder for length-prefixed frames, requires C++20.
+One recv() may carry several frames back to back and a partial one at the end.
+The decoder owns a fixed receive buffer, recv() directly into prepare(),
+then decode() returns views of every complete frame without copying them.
+Nothing is allocated after construction, the partial tail is moved to the
+front of the buffer only when the free space runs out.
+
+usage:
+    auto free = decoder.prepare();
+    ssize_t n = recv(fd, free.data(), free.size(), 0);
+    decoder.commit(n);
+    for (const message::frame_view &f : decoder.decode())
+        dispatcher.dispatch(ctx, f.data, f.size);
+Views are valid until the next call to prepare().
+Drain decode() until it returns an empty span before calling prepare() again,
+otherwise complete frames may fill the buffer and leave no free space. */
+
+namespace message
+{
+
+/* same limit as MESSAGE_LENGTH_MAX of 5dcserver, >= 1008, prevent attacks */
+inline constexpr uint64_t max_frame_length = 4096;
+
+struct frame_view
+{
+    const uint8_t *data; /* starts at the length field */
+    size_t size; /* includes the length field */
+
+    const header &head() const
+    {
+        return *view_as<header>(data);
+    }
+
+    template <typename T>
+    const T *as() const
+    {
+        return try_view_as<T>(data, size);
+    }
+};
+
+template <size_t Capacity = 16384, size_t MaxFrames = 256>
+class frame_decoder
+{
+    static_assert(Capacity >= sizeof(uint64_t) + max_frame_length,
+                  "buffer must hold the largest legal frame");
+
+public:
+    /* free space at the end of the buffer, invalidates views returned by decode() */
+    std::span<uint8_t> prepare()
+    {
+        if (Capacity - end_ < sizeof(uint64_t) + max_frame_length && begin_ > 0)
+        {
+            std::memmove(buffer_.data(), buffer_.data() + begin_, end_ - begin_);
+            end_ -= begin_;
+            begin_ = 0;
+        }
+        return std::span<uint8_t>(buffer_.data() + end_, Capacity - end_);
+    }
+
+    /* mark n bytes written by recv() into prepare() */
+    void commit(size_t n)
+    {
+        end_ += n;
+    }
+
+    /* views of the complete frames received so far, at most MaxFrames per call,
+    call again without recv() to get the rest when the span is full */
+    std::span<const frame_view> decode()
+    {
+        size_t count = 0;
+        while (count < MaxFrames && !failed_)
+        {
+            size_t available = end_ - begin_;
+            if (available < sizeof(uint64_t))
+                break;
+            uint64_t length;
+            std::memcpy(&length, buffer_.data() + begin_, sizeof(length));
+            if (length > max_frame_length)
+            {
+                failed_ = true;
+                break;
+            }
+            size_t size = sizeof(uint64_t) + length;
+            if (available < size)
+                break;
+            frames_[count++] = frame_view{buffer_.data() + begin_, size};
+            begin_ += size;
+        }
+        if (begin_ == end_)
+            begin_ = end_ = 0; /* nothing left to keep, valid views still point at the data */
+        return std::span<const frame_view>(frames_.data(), count);
+    }
+
+    /* a frame longer than max_frame_length was seen, the stream cannot be resynchronized */
+    bool failed() const
+    {
+        return failed_;
+    }
+
+    /* bytes of the incomplete frame kept for the next read */
+    size_t pending() const
+    {
+        return end_ - begin_;
+    }
+
+private:
+    alignas(8) std::array<uint8_t, Capacity> buffer_;
+    std::array<frame_view, MaxFrames> frames_;
+    size_t begin_ = 0;
+    size_t end_ = 0;
+    bool failed_ = false;
+};
+
+} // namespace message
+
+#endif /* FRAME_DECODER_HPP */
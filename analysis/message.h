@@ -1,3 +1,6 @@
+#ifndef MESSAGE_H
+#define MESSAGE_H
+
 #include <stdint.h>
 
 /* notes:
@@ -6,7 +9,12 @@ The field length excludes itself.
 Comments of unknown fields are seen values.
 Passcode seems to identify not started matches (both public and private).
 Other two tokens seems to identify every match and every S2C action message.
-All judgments is performed locally thus it is impossible to cheat. */
+All judgments is performed locally, 5dcserver relays actions as they are
+unless validate_moves is set, see 5dcserver/src/engine.rs.
+Structs are packed so that they match the frames on the wire byte by byte,
+see message_view.hpp for overlaying them on a received buffer. */
+
+#pragma pack(push, 1)
 
 struct C2SGreet
 {
@@ -159,3 +167,7 @@ struct S2CMatchList
     } serverHistoryMatches[13];
     int64_t serverHistoryMatchesCount;
 };
+
+#pragma pack(pop)
+
+#endif /* MESSAGE_H */
@@ -0,0 +1,125 @@
+#ifndef MESSAGE_DISPATCH_HPP
+#define MESSAGE_DISPATCH_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+#include "message_view.hpp"
+
+/* notes:
+Table driven validation and routing of frames, requires C++20.
+The table is indexed by type and generated at compile time from the traits
+in message_view.hpp, unknown types (0, 8, 14 and above) have no direction
+so they fail the same lookup that checks the length of a known type. */
+
+namespace message
+{
+
+struct type_info
+{
+    uint64_t length; /* 0 for unknown types */
+    direction dir;
+};
+
+/* power of two above the largest type, so the bound check is a single compare */
+inline constexpr size_t type_count = 16;
+
+template <typename... Ts>
+constexpr std::array<type_info, type_count> make_type_table()
+{
+    std::array<type_info, type_count> table{};
+    ((table[traits<Ts>::type] = type_info{traits<Ts>::length, traits<Ts>::dir}), ...);
+    return table;
+}
+
+inline constexpr std::array<type_info, type_count> type_table =
+    make_type_table<C2SGreet, S2CGreet, C2SMatchCreateOrJoin,
+                    S2CMatchCreateOrJoinResult, C2SMatchCancel,
+                    S2CMatchCancelResult, S2CMatchStart, S2COpponentLeft,
+                    C2SForfeit, C2SOrS2CAction, C2SMatchListRequest,
+                    S2CMatchList>();
+
+static_assert(type_table[8].dir == none, "type = 8 is never seen");
+static_assert(type_table[11].dir == both);
+static_assert(type_table[13].length == 1008);
+
+enum class dispatch_result
+{
+    ok,
+    truncated, /* fewer bytes than the frame claims */
+    rejected, /* unknown type, wrong length or wrong direction */
+    unhandled, /* valid frame without a registered handler */
+};
+
+/* lookup of a frame header, nullptr if it is not a valid frame for the direction */
+inline const type_info *validate(const header &h, direction accepted)
+{
+    uint64_t t = static_cast<uint64_t>(h.type);
+    if (t >= type_count)
+        return nullptr;
+    const type_info &info = type_table[t];
+    if (info.length != h.length || (info.dir & accepted) == 0)
+        return nullptr;
+    return &info;
+}
+
+/* per-consumer handler slots, one indirect call per dispatched frame */
+template <typename Context>
+class dispatcher
+{
+public:
+    using handler = dispatch_result (*)(Context &, const uint8_t *frame);
+
+    explicit dispatcher(direction accepted) : accepted_(accepted)
+    {
+        handlers_.fill(&unhandled);
+    }
+
+    /* register a typed handler, the frame is overlaid as T before the call */
+    template <typename T, void (*H)(Context &, const T &)>
+    void on()
+    {
+        handlers_[traits<T>::type] = [](Context &ctx, const uint8_t *frame) {
+            H(ctx, *view_as<T>(frame));
+            return dispatch_result::ok;
+        };
+    }
+
+    /* register an untyped handler working on the raw frame,
+    false for a type that dispatch() never accepts, as validate() would reject it */
+    [[nodiscard]] bool on(int64_t type, handler h)
+    {
+        uint64_t t = static_cast<uint64_t>(type);
+        if (t >= type_count || (type_table[t].dir & accepted_) == 0)
+            return false;
+        handlers_[t] = h;
+        return true;
+    }
+
+    dispatch_result dispatch(Context &ctx, const uint8_t *frame, size_t size) const
+    {
+        if (size < sizeof(header))
+            return dispatch_result::truncated;
+        const header &h = *view_as<header>(frame);
+        const type_info *info = validate(h, accepted_);
+        if (info == nullptr)
+            return dispatch_result::rejected;
+        if (size < sizeof(uint64_t) + info->length)
+            return dispatch_result::truncated;
+        return handlers_[h.type](ctx, frame);
+    }
+
+private:
+    static dispatch_result unhandled(Context &, const uint8_t *)
+    {
+        return dispatch_result::unhandled;
+    }
+
+    std::array<handler, type_count> handlers_;
+    direction accepted_;
+};
+
+} // namespace message
+
+#endif /* MESSAGE_DISPATCH_HPP */
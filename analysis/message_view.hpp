@@ -0,0 +1,110 @@
+#ifndef MESSAGE_VIEW_HPP
+#define MESSAGE_VIEW_HPP
+
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+
+#include "message.h"
+
+/* notes:
+Zero-copy views over the structs in message.h, requires C++20.
+A frame is the 8-byte length field followed by length bytes, exactly as received.
+Structs in message.h are packed (alignment 1), so a pointer to any byte
+of a receive buffer can be reinterpreted in place without copying.
+Fields are little-endian, hence only little-endian hosts are supported. */
+
+static_assert(std::endian::native == std::endian::little,
+              "message.h views require a little-endian host");
+
+namespace message
+{
+
+/* leading fields shared by every frame */
+#pragma pack(push, 1)
+struct header
+{
+    uint64_t length;
+    int64_t type;
+};
+#pragma pack(pop)
+
+/* bit flags, C2SOrS2CAction goes both ways */
+enum direction : uint8_t
+{
+    none = 0,
+    c2s = 1,
+    s2c = 2,
+    both = c2s | s2c,
+};
+
+template <typename T>
+struct traits;
+
+#define MESSAGE_TRAITS(name, type_value, length_value, direction_value)       \
+    template <>                                                               \
+    struct traits<::name>                                                     \
+    {                                                                         \
+        static constexpr int64_t type = type_value;                           \
+        static constexpr uint64_t length = length_value;                      \
+        static constexpr direction dir = direction_value;                     \
+    };                                                                        \
+    static_assert(sizeof(::name) == sizeof(uint64_t) + length_value,          \
+                  #name " does not match its wire length");                   \
+    static_assert(alignof(::name) == 1, #name " is not packed")
+
+MESSAGE_TRAITS(C2SGreet, 1, 56, c2s);
+MESSAGE_TRAITS(S2CGreet, 2, 56, s2c);
+MESSAGE_TRAITS(C2SMatchCreateOrJoin, 3, 48, c2s);
+MESSAGE_TRAITS(S2CMatchCreateOrJoinResult, 4, 64, s2c);
+MESSAGE_TRAITS(C2SMatchCancel, 5, 9, c2s);
+MESSAGE_TRAITS(S2CMatchCancelResult, 6, 16, s2c);
+MESSAGE_TRAITS(S2CMatchStart, 7, 48, s2c);
+MESSAGE_TRAITS(S2COpponentLeft, 9, 9, s2c);
+MESSAGE_TRAITS(C2SForfeit, 10, 9, c2s);
+MESSAGE_TRAITS(C2SOrS2CAction, 11, 112, both);
+MESSAGE_TRAITS(C2SMatchListRequest, 12, 9, c2s);
+MESSAGE_TRAITS(S2CMatchList, 13, 1008, s2c);
+
+#undef MESSAGE_TRAITS
+
+/* spot checks of the fields following a padding-prone member */
+static_assert(sizeof(header) == 16);
+static_assert(offsetof(C2SMatchCancel, unknown) == 16);
+static_assert(offsetof(C2SOrS2CAction, dstX) == 112);
+static_assert(sizeof(S2CMatchList::PublicMatch) == 32);
+static_assert(sizeof(S2CMatchList::ServerHistoryMatch) == 40);
+static_assert(offsetof(S2CMatchList, publicMatchesCount) == 480);
+static_assert(offsetof(S2CMatchList, serverHistoryMatchesCount) == 1008);
+
+/* size of the frame including the length field */
+template <typename T>
+constexpr size_t frame_size = sizeof(uint64_t) + traits<T>::length;
+
+/* reinterpret a frame in place, no check is performed */
+template <typename T>
+inline const T *view_as(const uint8_t *frame)
+{
+    return reinterpret_cast<const T *>(frame);
+}
+
+/* check that size bytes at frame hold a complete frame of type T */
+template <typename T>
+inline bool is_frame_of(const uint8_t *frame, size_t size)
+{
+    if (size < frame_size<T>)
+        return false;
+    const T *m = view_as<T>(frame);
+    return m->length == traits<T>::length && m->type == traits<T>::type;
+}
+
+/* checked overlay, nullptr if the frame is not of type T */
+template <typename T>
+inline const T *try_view_as(const uint8_t *frame, size_t size)
+{
+    return is_frame_of<T>(frame, size) ? view_as<T>(frame) : nullptr;
+}
+
+} // namespace message
+
+#endif /* MESSAGE_VIEW_HPP */
@@ -0,0 +1,160 @@
+/* notes:
+Microbenchmarks of the C++ views over message.h, requires C++20.
+Build and run:
+    g++ -std=c++20 -O2 -o message_view_bench message_view_bench.cpp && ./message_view_bench
+Every case runs for about bench_time and prints the mean time per frame.
+The stream is what a client sends during a match: actions with a match list
+request every 16 frames, split into chunks of a typical TCP segment. */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include "action_validator.hpp"
+#include "frame_decoder.hpp"
+#include "message_dispatch.hpp"
+#include "message_view.hpp"
+
+namespace
+{
+
+constexpr auto bench_time = std::chrono::milliseconds(500);
+constexpr size_t stream_frames = 4096;
+constexpr size_t segment_size = 1448;
+
+volatile uint64_t sink;
+
+template <typename F>
+void bench(const char *name, size_t frames, F f)
+{
+    using clock = std::chrono::steady_clock;
+    f(); /* warm up */
+    uint64_t iterations = 0;
+    auto start = clock::now();
+    while (clock::now() - start < bench_time)
+    {
+        f();
+        ++iterations;
+    }
+    double ns = std::chrono::duration<double, std::nano>(clock::now() - start).count();
+    std::printf("%-40s %10.2f ns/frame\n", name, ns / double(iterations * frames));
+}
+
+C2SOrS2CAction make_action(int64_t i)
+{
+    C2SOrS2CAction a{};
+    a.length = message::traits<C2SOrS2CAction>::length;
+    a.type = message::traits<C2SOrS2CAction>::type;
+    a.actionType = 1;
+    a.color = i & 1;
+    a.srcT = 1;
+    a.srcY = i % 8;
+    a.srcX = (i / 8) % 8;
+    a.dstT = 1;
+    a.dstY = (i + 1) % 8;
+    a.dstX = (i / 8) % 8;
+    return a;
+}
+
+template <typename T>
+void append(std::vector<uint8_t> &stream, const T &m)
+{
+    const uint8_t *p = reinterpret_cast<const uint8_t *>(&m);
+    stream.insert(stream.end(), p, p + sizeof(m));
+}
+
+struct counters
+{
+    uint64_t actions = 0;
+    uint64_t list_requests = 0;
+};
+
+void on_action(counters &c, const C2SOrS2CAction &a)
+{
+    c.actions += a.dstX;
+}
+
+void on_list_request(counters &c, const C2SMatchListRequest &)
+{
+    ++c.list_requests;
+}
+
+} // namespace
+
+int main()
+{
+    std::vector<C2SOrS2CAction> actions;
+    std::vector<uint8_t> stream;
+    for (size_t i = 0; i < stream_frames; ++i)
+    {
+        if (i % 16 == 15)
+        {
+            C2SMatchListRequest r{};
+            r.length = message::traits<C2SMatchListRequest>::length;
+            r.type = message::traits<C2SMatchListRequest>::type;
+            append(stream, r);
+        }
+        else
+        {
+            actions.push_back(make_action(int64_t(i)));
+            append(stream, actions.back());
+        }
+    }
+    const uint8_t *raw = reinterpret_cast<const uint8_t *>(actions.data());
+    const size_t action_size = sizeof(C2SOrS2CAction);
+
+    bench("try_view_as<C2SOrS2CAction>", actions.size(), [&] {
+        uint64_t sum = 0;
+        for (size_t i = 0; i < actions.size(); ++i)
+            if (const auto *a = message::try_view_as<C2SOrS2CAction>(raw + i * action_size, action_size))
+                sum += a->dstX;
+        sink = sum;
+    });
+
+    message::dispatcher<counters> d(message::c2s);
+    d.on<C2SOrS2CAction, on_action>();
+    d.on<C2SMatchListRequest, on_list_request>();
+    bench("dispatcher::dispatch", stream_frames, [&] {
+        counters c;
+        size_t offset = 0;
+        while (offset < stream.size())
+        {
+            const uint8_t *frame = stream.data() + offset;
+            d.dispatch(c, frame, stream.size() - offset);
+            offset += sizeof(uint64_t) + message::view_as<message::header>(frame)->length;
+        }
+        sink = c.actions + c.list_requests;
+    });
+
+    static message::frame_decoder<> decoder;
+    bench("frame_decoder + dispatch", stream_frames, [&] {
+        counters c;
+        for (size_t offset = 0; offset < stream.size(); offset += segment_size)
+        {
+            size_t n = std::min(segment_size, stream.size() - offset);
+            std::memcpy(decoder.prepare().data(), stream.data() + offset, n);
+            decoder.commit(n);
+            for (const message::frame_view &f : decoder.decode())
+                d.dispatch(c, f.data, f.size);
+        }
+        sink = c.actions + c.list_requests;
+    });
+
+    const message::board_size size{8, 8};
+    std::vector<uint64_t> accepted((actions.size() + 63) / 64);
+    bench("validate_actions", actions.size(), [&] {
+        sink = message::validate_actions(actions.data(), actions.size(), size, accepted.data());
+    });
+    bench("validate_actions_scalar", actions.size(), [&] {
+        sink = message::validate_actions_scalar(actions.data(), actions.size(), size, accepted.data());
+    });
+#ifdef ACTION_VALIDATOR_AVX2
+    bench("validate_actions_avx2", actions.size(), [&] {
+        sink = message::validate_actions_avx2(actions.data(), actions.size(), size, accepted.data());
+    });
+#endif
+    return 0;
+}
@@ -0,0 +1,148 @@
+#ifndef PASSCODE_HPP
+#define PASSCODE_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+/* notes:
+Conversion between passcodes in notation and their internal value, requires C++20.
+Same mapping as passcode.py: a passcode is 6 characters of PNBRQKpnbrqk (capital for white),
+the i-th character is the i-th base-12 digit of the internal value, least significant first,
+so the internal value is in 0..space - 1 (kkkkkk = 2985983), -1 means none as in message.h.
+Single conversions are constexpr, the batch API splits a value into two halves of
+3 digits (12^3 = 1728) and looks each half up in a table instead of 6 divisions.
+Strings are 6 bytes without a terminator, a batch of n is 6 * n contiguous bytes. */
+
+namespace passcode
+{
+
+constexpr int64_t space = 2985984; /* 12^6 */
+constexpr int64_t none = -1;
+constexpr size_t length = 6;
+
+namespace detail
+{
+
+constexpr char notation[13] = "PNBRQKpnbrqk";
+constexpr uint8_t invalid_digit = 0xff;
+
+constexpr std::array<uint8_t, 256> make_digits()
+{
+    std::array<uint8_t, 256> digits{};
+    for (auto &d : digits)
+        d = invalid_digit;
+    for (uint8_t i = 0; i < 12; ++i)
+        digits[uint8_t(notation[i])] = i;
+    return digits;
+}
+
+/* 3 characters of every value in 0..1727, padded to 4 bytes */
+constexpr std::array<std::array<char, 4>, 1728> make_triples()
+{
+    std::array<std::array<char, 4>, 1728> triples{};
+    for (int v = 0; v < 1728; ++v)
+        triples[v] = {notation[v % 12], notation[v / 12 % 12], notation[v / 144], 0};
+    return triples;
+}
+
+inline constexpr std::array<uint8_t, 256> digits = make_digits();
+inline constexpr std::array<std::array<char, 4>, 1728> triples = make_triples();
+
+} // namespace detail
+
+/* writes the 6 characters of internal to out, false if internal is out of range */
+constexpr bool encode(int64_t internal, char *out)
+{
+    if (internal < 0 || internal >= space)
+        return false;
+    for (size_t i = 0; i < length; ++i)
+    {
+        out[i] = detail::notation[internal % 12];
+        internal /= 12;
+    }
+    return true;
+}
+
+/* internal value of the 6 characters at in, none if any of them is not PNBRQKpnbrqk */
+constexpr int64_t decode(const char *in)
+{
+    int64_t internal = 0;
+    for (size_t i = length; i-- > 0;)
+    {
+        uint8_t d = detail::digits[uint8_t(in[i])];
+        if (d == detail::invalid_digit)
+            return none;
+        internal = internal * 12 + d;
+    }
+    return internal;
+}
+
+/* encodes count values into 6 * count bytes, out of range values become "------",
+returns how many were in range */
+inline size_t encode_batch(const int64_t *internal, size_t count, char *out)
+{
+    size_t ok = 0;
+    for (size_t i = 0; i < count; ++i, out += length)
+    {
+        const int64_t v = internal[i];
+        if (v < 0 || v >= space)
+        {
+            for (size_t j = 0; j < length; ++j)
+                out[j] = '-';
+            continue;
+        }
+        const auto &lo = detail::triples[uint32_t(v) % 1728];
+        const auto &hi = detail::triples[uint32_t(v) / 1728];
+        out[0] = lo[0];
+        out[1] = lo[1];
+        out[2] = lo[2];
+        out[3] = hi[0];
+        out[4] = hi[1];
+        out[5] = hi[2];
+        ++ok;
+    }
+    return ok;
+}
+
+/* decodes 6 * count bytes into count values, invalid passcodes become none,
+returns how many were valid */
+inline size_t decode_batch(const char *in, size_t count, int64_t *out)
+{
+    size_t ok = 0;
+    for (size_t i = 0; i < count; ++i, in += length)
+    {
+        uint32_t d[length];
+        uint32_t bad = 0;
+        for (size_t j = 0; j < length; ++j)
+        {
+            d[j] = detail::digits[uint8_t(in[j])];
+            bad |= d[j];
+        }
+        /* invalid_digit is the only entry with bit 7 set */
+        if (bad & 0x80)
+        {
+            out[i] = none;
+            continue;
+        }
+        out[i] = int64_t(d[0] + d[1] * 12 + d[2] * 144) + int64_t(d[3] + d[4] * 12 + d[5] * 144) * 1728;
+        ++ok;
+    }
+    return ok;
+}
+
+/* the examples of passcode.py */
+static_assert(decode("PPPPPP") == 0x00000000);
+static_assert(decode("NNNNNN") == 0x0004245d);
+static_assert(decode("PnBrQk") == 0x002b4634);
+static_assert(decode("kkkkkk") == space - 1);
+static_assert(decode("PPPPPX") == none);
+static_assert([] {
+    char s[length]{};
+    return encode(0x002b4634, s) && s[0] == 'P' && s[1] == 'n' && s[2] == 'B' && s[3] == 'r' && s[4] == 'Q' &&
+           s[5] == 'k';
+}());
+
+} // namespace passcode
+
+#endif
@@ -0,0 +1,65 @@
+/* notes:
+Perft of the board move generator in bitboard.hpp, requires C++20.
+Build and run:
+    g++ -std=c++20 -O2 -o perft_bench perft_bench.cpp && ./perft_bench [depth]
+Positions with published perft results are checked against them (underpromotion on),
+the rest only report speed since there is nothing to compare with.
+The small layouts stand in for boards of the Small and Very Small variants and a
+reduced piece set shows the generator without the pieces of a Focused variant. */
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+
+#include "bitboard.hpp"
+
+namespace
+{
+
+using namespace bitboard;
+
+constexpr unsigned knights_and_kings = set_of(pawn) | set_of(knight) | set_of(king);
+
+bool failed = false;
+
+template <typename P>
+void run(const char *name, const char *layout, int depth, std::vector<uint64_t> expected = {})
+{
+    using clock = std::chrono::steady_clock;
+    const P p = P::from_layout(layout);
+    for (int d = 1; d <= depth; ++d)
+    {
+        auto start = clock::now();
+        uint64_t nodes = p.perft(d);
+        double s = std::chrono::duration<double>(clock::now() - start).count();
+        const char *check = "";
+        if (size_t(d) <= expected.size())
+        {
+            check = nodes == expected[d - 1] ? " ok" : " MISMATCH";
+            failed |= nodes != expected[d - 1];
+        }
+        std::printf("%-24s depth %d %12llu nodes %8.2f Mnodes/s%s\n", name, d, (unsigned long long)nodes,
+                    double(nodes) / s / 1e6, check);
+    }
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    const int depth = argc > 1 ? std::atoi(argv[1]) : 5;
+    run<position<8, 8>>("standard", "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w", depth,
+                        {20, 400, 8902, 197281, 4865609, 119060324});
+    run<position<8, 8, standard_pieces, true>>(
+        "castling and promotion", "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq -",
+        depth - 1, {48, 2039, 97862, 4085603, 193690690});
+    run<position<8, 8, standard_pieces, true>>("en passant and pins", "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - -",
+                                               depth, {14, 191, 2812, 43238, 674624, 11030083});
+    run<position<8, 8, knights_and_kings>>("knights, kings, pawns", "nnnnknnn/pppppppp/8/8/8/8/PPPPPPPP/NNNNKNNN w",
+                                           depth);
+    run<position<5, 5>>("5x5", "rnbqk/ppppp/5/PPPPP/RNBQK w", depth + 1);
+    run<position<4, 4>>("4x4", "rnbk/pppp/PPPP/RNBK w", depth + 2);
+    return failed ? 1 : 0;
+}